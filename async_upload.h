@@ -0,0 +1,463 @@
+#ifndef ASYNC_UPLOAD_H
+#define ASYNC_UPLOAD_H
+
+// Uploads on a worker thread with its own GL context, shared with the render thread's, so that large transfers happen
+// while the render thread draws. Each stream (one per engine device) has ASYNC_UPLOAD_SLOTS buffers. The worker writes
+// a submitted frame into a free one and fences it; the render thread then draws from whichever slot completed last,
+// and keeps drawing the previous one until a newer upload is done. A slot is only written again once the draws
+// reading it have finished, which the render thread fences when it releases the slot.
+//
+// The worker does not copy the submitted data up front, so it has to stay unchanged until async_upload_wait_idle()
+// returns, or the same stream's next submit does.
+
+#define ASYNC_UPLOAD_SLOTS 3
+
+typedef struct async_upload_worker async_upload_worker_t;
+typedef struct async_upload_stream async_upload_stream_t;
+
+// Makes the shared context current on the calling thread, or releases it when 'current' is 0. Returns 0 on failure.
+typedef int32_t (*async_upload_make_current_fn)( void* context, int32_t current );
+
+// What the render thread draws from; 'buffer' is 0 if nothing was uploaded yet.
+typedef struct async_upload_view
+{
+    GLuint buffer;
+    size_t size;
+    uint32_t n_elems;
+} async_upload_view_t;
+
+async_upload_worker_t* async_upload_worker_create( async_upload_make_current_fn make_current, void* context );
+void async_upload_worker_destroy( async_upload_worker_t** worker );
+void async_upload_wait_idle( async_upload_worker_t* worker );
+// Makes async_upload_acquire() wait for the latest submission instead of drawing whatever completed last, so that
+// frames show the data they were given - for image comparisons.
+void async_upload_set_synchronous( async_upload_worker_t* worker, bool synchronous );
+
+async_upload_stream_t* async_upload_stream_create( async_upload_worker_t* worker );
+void async_upload_stream_destroy( async_upload_stream_t** stream );
+void async_upload_submit( async_upload_stream_t* stream, const void* data, uint32_t n_elems, size_t elem_size );
+async_upload_view_t async_upload_acquire( async_upload_stream_t* stream );
+void async_upload_release( async_upload_stream_t* stream );
+uint64_t async_upload_buffer_bytes( async_upload_stream_t* stream );
+
+#endif /* ASYNC_UPLOAD_H */
+
+#ifdef ASYNC_UPLOAD_IMPLEMENTATION
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE             async_upload__thread_t;
+typedef CRITICAL_SECTION   async_upload__mutex_t;
+typedef CONDITION_VARIABLE async_upload__cond_t;
+#define async_upload__lock( m )          EnterCriticalSection( m )
+#define async_upload__unlock( m )        LeaveCriticalSection( m )
+#define async_upload__wait( c, m )       SleepConditionVariableCS( c, m, INFINITE )
+#define async_upload__broadcast( c )     WakeAllConditionVariable( c )
+#else
+#include <pthread.h>
+typedef pthread_t          async_upload__thread_t;
+typedef pthread_mutex_t    async_upload__mutex_t;
+typedef pthread_cond_t     async_upload__cond_t;
+#define async_upload__lock( m )          pthread_mutex_lock( m )
+#define async_upload__unlock( m )        pthread_mutex_unlock( m )
+#define async_upload__wait( c, m )       pthread_cond_wait( c, m )
+#define async_upload__broadcast( c )     pthread_cond_broadcast( c )
+#endif
+
+typedef enum async_upload__slot_state
+{
+    ASYNC_UPLOAD__FREE,
+    ASYNC_UPLOAD__WRITING,
+    ASYNC_UPLOAD__READY,   // written, not drawn yet
+    ASYNC_UPLOAD__CURRENT, // what the render thread draws
+    ASYNC_UPLOAD__RETIRED  // superseded, but draws may still read it until 'draw_fence' signals
+} async_upload__slot_state_t;
+
+typedef struct async_upload__slot
+{
+    GLuint buffer;
+    uint8_t* mapped;
+    size_t capacity;
+    size_t size;
+    uint32_t n_elems;
+    uint64_t seq;
+    async_upload__slot_state_t state;
+    GLsync upload_fence;
+    GLsync draw_fence;
+} async_upload__slot_t;
+
+struct async_upload_stream
+{
+    async_upload_worker_t* worker;
+    async_upload__slot_t slots[ASYNC_UPLOAD_SLOTS];
+    int32_t current;
+
+    // Submission waiting for, or being written by, the worker; at most one per stream.
+    const void* data;
+    uint32_t n_elems;
+    size_t elem_size;
+    uint64_t n_submitted;
+    bool pending;
+    async_upload_stream_t* next_pending;
+    uint64_t buffer_bytes;
+};
+
+struct async_upload_worker
+{
+    async_upload__thread_t thread;
+    int32_t created;
+    async_upload_make_current_fn make_current;
+    void* context;
+
+    // Everything below is guarded by the mutex.
+    async_upload__mutex_t mutex;
+    async_upload__cond_t work_available;
+    async_upload__cond_t work_done;
+    async_upload_stream_t* first_pending;
+    async_upload_stream_t* last_pending;
+    int32_t n_pending;
+    int32_t started;
+    int32_t shutdown;
+    bool synchronous;
+};
+
+// Waits for a fence that may come from the other context, which has to flush it for this to return.
+static void
+async_upload__wait_fence( GLsync fence )
+{
+    for( ;; )
+    {
+        GLenum status = glClientWaitSync( fence, 0, 1000000000 );
+        if( status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED ) { break; }
+        if( status == GL_WAIT_FAILED )
+        {
+            fprintf( stderr, "[AsyncUpload] Waiting for a fence failed\n" );
+            break;
+        }
+    }
+}
+
+// Picks the slot for a new upload: never the one being drawn, preferably one that was never drawn from or whose
+// draws are done, otherwise the oldest one - the new upload supersedes it anyway. Called with the mutex held.
+static int32_t
+async_upload__pick_slot( const async_upload_stream_t* stream )
+{
+    int32_t best = -1;
+    for( int32_t i = 0; i < ASYNC_UPLOAD_SLOTS; ++i )
+    {
+        const async_upload__slot_t* slot = stream->slots + i;
+        if( slot->state == ASYNC_UPLOAD__CURRENT || slot->state == ASYNC_UPLOAD__WRITING ) { continue; }
+        if( slot->state == ASYNC_UPLOAD__FREE ) { return i; }
+        if( best < 0 || slot->seq < stream->slots[best].seq ) { best = i; }
+    }
+    return best;
+}
+
+static void
+async_upload__write( async_upload_worker_t* worker, async_upload_stream_t* stream )
+{
+    async_upload__lock( &worker->mutex );
+    int32_t slot_idx = async_upload__pick_slot( stream );
+    async_upload__slot_t* slot = stream->slots + slot_idx;
+    GLsync draw_fence = slot->draw_fence;
+    GLsync upload_fence = slot->upload_fence;
+    slot->draw_fence = slot->upload_fence = NULL;
+    slot->state = ASYNC_UPLOAD__WRITING;
+    const void* data = stream->data;
+    uint32_t n_elems = stream->n_elems;
+    size_t size = (size_t)n_elems * stream->elem_size;
+    uint64_t seq = stream->n_submitted;
+    async_upload__unlock( &worker->mutex );
+
+    if( upload_fence ) { glDeleteSync( upload_fence ); }
+    if( draw_fence )
+    {
+        async_upload__wait_fence( draw_fence );
+        glDeleteSync( draw_fence );
+    }
+
+    if( slot->capacity < size )
+    {
+        if( slot->buffer )
+        {
+            glUnmapNamedBuffer( slot->buffer );
+            glDeleteBuffers( 1, &slot->buffer );
+        }
+        uint32_t n_low_use_updates = 0;
+        size_t capacity = gl_utils_next_capacity( slot->capacity, size, &n_low_use_updates );
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers( 1, &slot->buffer );
+        glNamedBufferStorage( slot->buffer, capacity, NULL, flags );
+        slot->mapped = glMapNamedBufferRange( slot->buffer, 0, capacity, flags );
+        slot->capacity = slot->mapped ? capacity : 0;
+        if( !slot->mapped )
+        {
+            fprintf( stderr, "[AsyncUpload] Failed to map a buffer of %zu bytes\n", capacity );
+            glDeleteBuffers( 1, &slot->buffer );
+            slot->buffer = 0;
+        }
+    }
+    if( slot->mapped ) { memcpy( slot->mapped, data, size ); }
+
+    // The render thread waits for this before drawing, which also makes a new buffer object visible to its context.
+    GLsync fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    glFlush();
+
+    async_upload__lock( &worker->mutex );
+    slot->upload_fence = fence;
+    slot->size = slot->mapped ? size : 0;
+    slot->n_elems = slot->mapped ? n_elems : 0;
+    slot->seq = seq;
+    slot->state = ASYNC_UPLOAD__READY;
+    stream->buffer_bytes = 0;
+    for( int32_t i = 0; i < ASYNC_UPLOAD_SLOTS; ++i ) { stream->buffer_bytes += stream->slots[i].capacity; }
+    stream->pending = false;
+    worker->n_pending--;
+    async_upload__broadcast( &worker->work_done );
+    async_upload__unlock( &worker->mutex );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+async_upload__main( LPVOID arg )
+#else
+static void*
+async_upload__main( void* arg )
+#endif
+{
+    async_upload_worker_t* worker = arg;
+    int32_t current = worker->make_current( worker->context, 1 );
+
+    async_upload__lock( &worker->mutex );
+    worker->started = current ? 1 : -1;
+    async_upload__broadcast( &worker->work_done );
+    while( current )
+    {
+        while( !worker->shutdown && !worker->first_pending )
+        {
+            async_upload__wait( &worker->work_available, &worker->mutex );
+        }
+        if( worker->shutdown ) { break; }
+
+        // The stream stays pending, and thus in use, until it is written.
+        async_upload_stream_t* stream = worker->first_pending;
+        worker->first_pending = stream->next_pending;
+        if( !worker->first_pending ) { worker->last_pending = NULL; }
+        async_upload__unlock( &worker->mutex );
+        async_upload__write( worker, stream );
+        async_upload__lock( &worker->mutex );
+    }
+    async_upload__unlock( &worker->mutex );
+
+    if( current ) { worker->make_current( worker->context, 0 ); }
+    return 0;
+}
+
+async_upload_worker_t*
+async_upload_worker_create( async_upload_make_current_fn make_current, void* context )
+{
+    async_upload_worker_t* worker = malloc( sizeof(async_upload_worker_t) );
+    memset( worker, 0, sizeof(async_upload_worker_t) );
+    worker->make_current = make_current;
+    worker->context = context;
+
+#ifdef _WIN32
+    InitializeCriticalSection( &worker->mutex );
+    InitializeConditionVariable( &worker->work_available );
+    InitializeConditionVariable( &worker->work_done );
+    worker->thread = CreateThread( NULL, 0, async_upload__main, worker, 0, NULL );
+    worker->created = worker->thread != NULL;
+#else
+    pthread_mutex_init( &worker->mutex, NULL );
+    pthread_cond_init( &worker->work_available, NULL );
+    pthread_cond_init( &worker->work_done, NULL );
+    worker->created = pthread_create( &worker->thread, NULL, async_upload__main, worker ) == 0;
+#endif
+    if( !worker->created )
+    {
+        fprintf( stderr, "[AsyncUpload] Failed to start the upload thread\n" );
+        worker->started = -1;
+    }
+
+    // Wait until the thread has its context, so that failing to get it can be reported here.
+    async_upload__lock( &worker->mutex );
+    while( !worker->started ) { async_upload__wait( &worker->work_done, &worker->mutex ); }
+    async_upload__unlock( &worker->mutex );
+    if( worker->started < 0 )
+    {
+        if( worker->created ) { fprintf( stderr, "[AsyncUpload] Failed to make the shared context current\n" ); }
+        async_upload_worker_destroy( &worker );
+    }
+    return worker;
+}
+
+void
+async_upload_worker_destroy( async_upload_worker_t** worker_in )
+{
+    async_upload_worker_t* worker = *worker_in;
+    if( !worker ) { return; }
+
+    async_upload__lock( &worker->mutex );
+    worker->shutdown = 1;
+    async_upload__broadcast( &worker->work_available );
+    async_upload__unlock( &worker->mutex );
+
+#ifdef _WIN32
+    if( worker->created )
+    {
+        WaitForSingleObject( worker->thread, INFINITE );
+        CloseHandle( worker->thread );
+    }
+    DeleteCriticalSection( &worker->mutex );
+#else
+    if( worker->created ) { pthread_join( worker->thread, NULL ); }
+    pthread_mutex_destroy( &worker->mutex );
+    pthread_cond_destroy( &worker->work_available );
+    pthread_cond_destroy( &worker->work_done );
+#endif
+    free( worker );
+    *worker_in = NULL;
+}
+
+void
+async_upload_wait_idle( async_upload_worker_t* worker )
+{
+    async_upload__lock( &worker->mutex );
+    while( worker->n_pending ) { async_upload__wait( &worker->work_done, &worker->mutex ); }
+    async_upload__unlock( &worker->mutex );
+}
+
+void
+async_upload_set_synchronous( async_upload_worker_t* worker, bool synchronous )
+{
+    async_upload__lock( &worker->mutex );
+    worker->synchronous = synchronous;
+    async_upload__unlock( &worker->mutex );
+}
+
+async_upload_stream_t*
+async_upload_stream_create( async_upload_worker_t* worker )
+{
+    async_upload_stream_t* stream = malloc( sizeof(async_upload_stream_t) );
+    memset( stream, 0, sizeof(async_upload_stream_t) );
+    stream->worker = worker;
+    stream->current = -1;
+    return stream;
+}
+
+// Waits for the worker to be done with the stream's submission. Called with the mutex held.
+static void
+async_upload__wait_written( async_upload_stream_t* stream )
+{
+    while( stream->pending ) { async_upload__wait( &stream->worker->work_done, &stream->worker->mutex ); }
+}
+
+void
+async_upload_stream_destroy( async_upload_stream_t** stream_in )
+{
+    async_upload_stream_t* stream = *stream_in;
+    if( !stream ) { return; }
+    async_upload__lock( &stream->worker->mutex );
+    async_upload__wait_written( stream );
+    async_upload__unlock( &stream->worker->mutex );
+
+    for( int32_t i = 0; i < ASYNC_UPLOAD_SLOTS; ++i )
+    {
+        async_upload__slot_t* slot = stream->slots + i;
+        if( slot->upload_fence ) { glDeleteSync( slot->upload_fence ); }
+        if( slot->draw_fence ) { glDeleteSync( slot->draw_fence ); }
+        if( slot->buffer )
+        {
+            glUnmapNamedBuffer( slot->buffer );
+            glDeleteBuffers( 1, &slot->buffer );
+        }
+    }
+    free( stream );
+    *stream_in = NULL;
+}
+
+// Queues 'n_elems' elements of 'elem_size' bytes for upload, once the worker is done with the previous submission.
+void
+async_upload_submit( async_upload_stream_t* stream, const void* data, uint32_t n_elems, size_t elem_size )
+{
+    async_upload_worker_t* worker = stream->worker;
+    async_upload__lock( &worker->mutex );
+    async_upload__wait_written( stream );
+    stream->data = data;
+    stream->n_elems = n_elems;
+    stream->elem_size = elem_size;
+    stream->n_submitted++;
+    stream->pending = true;
+    worker->n_pending++;
+    stream->next_pending = NULL;
+    if( worker->last_pending ) { worker->last_pending->next_pending = stream; }
+    else { worker->first_pending = stream; }
+    worker->last_pending = stream;
+    async_upload__broadcast( &worker->work_available );
+    async_upload__unlock( &worker->mutex );
+}
+
+// Switches to the newest completed upload, if there is one newer than the current slot. Only waits for the worker
+// before the first upload is done, or in synchronous mode. Release the slot after issuing the draws reading it.
+async_upload_view_t
+async_upload_acquire( async_upload_stream_t* stream )
+{
+    async_upload_worker_t* worker = stream->worker;
+    async_upload__lock( &worker->mutex );
+    if( worker->synchronous || stream->current < 0 ) { async_upload__wait_written( stream ); }
+
+    int32_t newest = stream->current;
+    for( int32_t i = 0; i < ASYNC_UPLOAD_SLOTS; ++i )
+    {
+        const async_upload__slot_t* slot = stream->slots + i;
+        if( slot->state != ASYNC_UPLOAD__READY ) { continue; }
+        if( newest < 0 || slot->seq > stream->slots[newest].seq ) { newest = i; }
+    }
+    if( newest != stream->current )
+    {
+        if( stream->current >= 0 ) { stream->slots[stream->current].state = ASYNC_UPLOAD__RETIRED; }
+        async_upload__slot_t* slot = stream->slots + newest;
+        slot->state = ASYNC_UPLOAD__CURRENT;
+        // Orders the draws after the worker's writes, without blocking this thread.
+        glWaitSync( slot->upload_fence, 0, GL_TIMEOUT_IGNORED );
+        glDeleteSync( slot->upload_fence );
+        slot->upload_fence = NULL;
+        stream->current = newest;
+    }
+
+    async_upload_view_t view = {0};
+    if( stream->current >= 0 )
+    {
+        const async_upload__slot_t* slot = stream->slots + stream->current;
+        view = (async_upload_view_t){ .buffer = slot->buffer, .size = slot->size, .n_elems = slot->n_elems };
+    }
+    async_upload__unlock( &worker->mutex );
+    return view;
+}
+
+void
+async_upload_release( async_upload_stream_t* stream )
+{
+    async_upload_worker_t* worker = stream->worker;
+    async_upload__lock( &worker->mutex );
+    if( stream->current >= 0 )
+    {
+        async_upload__slot_t* slot = stream->slots + stream->current;
+        if( slot->draw_fence ) { glDeleteSync( slot->draw_fence ); }
+        slot->draw_fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        // The worker waits for it from its own context.
+        glFlush();
+    }
+    async_upload__unlock( &worker->mutex );
+}
+
+uint64_t
+async_upload_buffer_bytes( async_upload_stream_t* stream )
+{
+    async_upload__lock( &stream->worker->mutex );
+    uint64_t n_bytes = stream->buffer_bytes;
+    async_upload__unlock( &stream->worker->mutex );
+    return n_bytes;
+}
+
+#endif /*ASYNC_UPLOAD_IMPLEMENTATION*/
@@ -0,0 +1,359 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Storage for per-frame timings gathered while cycling through the line drawing engines, along with the memory used
+// by each engine, the number of bytes it uploaded and the stream ring stalls of every frame and, optionally, pipeline
+// statistics of a single frame.
+// Results can be written out as csv (one row per frame) or json (grouped per engine), picked based on the file
+// extension.
+
+typedef struct benchmark
+{
+    int32_t n_engines;
+    int32_t n_frames;
+    const char** engine_names;
+    frame_timings_t* samples;
+    uint64_t* uploaded_bytes;
+    uint64_t* stalls;
+    memory_stats_t* memory;
+    profiler_pipeline_stats_t* pipeline_stats;
+    int32_t has_pipeline_stats;
+} benchmark_t;
+
+void benchmark_init( benchmark_t* bench, int32_t n_engines, int32_t n_frames, const char** engine_names );
+void benchmark_record( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, frame_timings_t timings );
+void benchmark_record_gpu( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, double gpu );
+void benchmark_record_memory( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, memory_stats_t stats );
+void benchmark_record_pipeline_stats( benchmark_t* bench, int32_t engine_idx, profiler_pipeline_stats_t stats );
+frame_timings_t benchmark_mean( const benchmark_t* bench, int32_t engine_idx );
+double benchmark_mean_uploaded_bytes( const benchmark_t* bench, int32_t engine_idx );
+uint64_t benchmark_total_stalls( const benchmark_t* bench, int32_t engine_idx );
+frame_timings_t benchmark_percentile( const benchmark_t* bench, int32_t engine_idx, double percentile );
+frame_timings_t benchmark_max( const benchmark_t* bench, int32_t engine_idx );
+void benchmark_print_summary( const benchmark_t* bench );
+int32_t benchmark_write( const benchmark_t* bench, const char* filename );
+void benchmark_term( benchmark_t* bench );
+
+#endif /* BENCHMARK_H */
+
+#ifdef BENCHMARK_IMPLEMENTATION
+
+void
+benchmark_init( benchmark_t* bench, int32_t n_engines, int32_t n_frames, const char** engine_names )
+{
+    bench->n_engines = n_engines;
+    bench->n_frames = n_frames;
+    bench->engine_names = engine_names;
+    bench->samples = calloc( n_engines * n_frames, sizeof(frame_timings_t) );
+    bench->uploaded_bytes = calloc( n_engines * n_frames, sizeof(uint64_t) );
+    bench->stalls = calloc( n_engines * n_frames, sizeof(uint64_t) );
+    bench->memory = calloc( n_engines, sizeof(memory_stats_t) );
+    bench->pipeline_stats = calloc( n_engines, sizeof(profiler_pipeline_stats_t) );
+    bench->has_pipeline_stats = 0;
+}
+
+// Frames with negative indices are warm-up frames and are not recorded.
+void
+benchmark_record( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, frame_timings_t timings )
+{
+    if( frame_idx < 0 ) { return; }
+    assert( engine_idx < bench->n_engines && frame_idx < bench->n_frames );
+    frame_timings_t* sample = bench->samples + engine_idx * bench->n_frames + frame_idx;
+    sample->generate = timings.generate;
+    sample->submit = timings.submit;
+}
+
+// GPU timings are resolved asynchronously, so they arrive separately from the cpu ones.
+void
+benchmark_record_gpu( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, double gpu )
+{
+    if( frame_idx < 0 ) { return; }
+    assert( engine_idx < bench->n_engines && frame_idx < bench->n_frames );
+    bench->samples[ engine_idx * bench->n_frames + frame_idx ].gpu = gpu;
+}
+
+// Buffer sizes are kept from the last recorded frame, upload sizes and stalls are kept for every frame.
+void
+benchmark_record_memory( benchmark_t* bench, int32_t engine_idx, int32_t frame_idx, memory_stats_t stats )
+{
+    if( frame_idx < 0 ) { return; }
+    assert( engine_idx < bench->n_engines && frame_idx < bench->n_frames );
+    bench->uploaded_bytes[ engine_idx * bench->n_frames + frame_idx ] = stats.uploaded_bytes;
+    bench->stalls[ engine_idx * bench->n_frames + frame_idx ] = stats.stalls;
+    bench->memory[engine_idx] = stats;
+}
+
+void
+benchmark_record_pipeline_stats( benchmark_t* bench, int32_t engine_idx, profiler_pipeline_stats_t stats )
+{
+    assert( engine_idx < bench->n_engines );
+    bench->pipeline_stats[engine_idx] = stats;
+    bench->has_pipeline_stats = 1;
+}
+
+frame_timings_t
+benchmark_mean( const benchmark_t* bench, int32_t engine_idx )
+{
+    frame_timings_t mean = {0};
+    const frame_timings_t* samples = bench->samples + engine_idx * bench->n_frames;
+    for( int32_t i = 0; i < bench->n_frames; ++i )
+    {
+        mean.generate += samples[i].generate;
+        mean.submit   += samples[i].submit;
+        mean.gpu      += samples[i].gpu;
+    }
+    if( bench->n_frames )
+    {
+        mean.generate /= bench->n_frames;
+        mean.submit   /= bench->n_frames;
+        mean.gpu      /= bench->n_frames;
+    }
+    return mean;
+}
+
+double
+benchmark_mean_uploaded_bytes( const benchmark_t* bench, int32_t engine_idx )
+{
+    if( !bench->n_frames ) { return 0.0; }
+    double total = 0.0;
+    const uint64_t* uploaded_bytes = bench->uploaded_bytes + engine_idx * bench->n_frames;
+    for( int32_t i = 0; i < bench->n_frames; ++i ) { total += uploaded_bytes[i]; }
+    return total / bench->n_frames;
+}
+
+uint64_t
+benchmark_total_stalls( const benchmark_t* bench, int32_t engine_idx )
+{
+    uint64_t total = 0;
+    const uint64_t* stalls = bench->stalls + engine_idx * bench->n_frames;
+    for( int32_t i = 0; i < bench->n_frames; ++i ) { total += stalls[i]; }
+    return total;
+}
+
+static int
+benchmark__compare_doubles( const void* a, const void* b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double
+benchmark__percentile( const benchmark_t* bench, int32_t engine_idx, size_t field_offset, double percentile,
+                       double* scratch )
+{
+    if( !bench->n_frames ) { return 0.0; }
+    const frame_timings_t* samples = bench->samples + engine_idx * bench->n_frames;
+    for( int32_t i = 0; i < bench->n_frames; ++i )
+    {
+        scratch[i] = *(const double*)((const char*)(samples + i) + field_offset);
+    }
+    qsort( scratch, bench->n_frames, sizeof(double), benchmark__compare_doubles );
+    // Nearest rank
+    int32_t rank = (int32_t)ceil( percentile * 0.01 * bench->n_frames );
+    return scratch[ msh_clamp( rank - 1, 0, bench->n_frames - 1 ) ];
+}
+
+// 'percentile' is in [0, 100]. Computed exactly from the recorded samples.
+frame_timings_t
+benchmark_percentile( const benchmark_t* bench, int32_t engine_idx, double percentile )
+{
+    frame_timings_t result = {0};
+    double* scratch = malloc( msh_max( bench->n_frames, 1 ) * sizeof(double) );
+    result.generate = benchmark__percentile( bench, engine_idx, offsetof(frame_timings_t, generate), percentile, scratch );
+    result.submit   = benchmark__percentile( bench, engine_idx, offsetof(frame_timings_t, submit), percentile, scratch );
+    result.gpu      = benchmark__percentile( bench, engine_idx, offsetof(frame_timings_t, gpu), percentile, scratch );
+    free( scratch );
+    return result;
+}
+
+frame_timings_t
+benchmark_max( const benchmark_t* bench, int32_t engine_idx )
+{
+    return benchmark_percentile( bench, engine_idx, 100.0 );
+}
+
+static void
+benchmark__print_distribution( const char* engine_name, const char* phase, const frame_timings_t* p50,
+                               const frame_timings_t* p95, const frame_timings_t* p99, const frame_timings_t* max,
+                               size_t field_offset )
+{
+    #define BENCHMARK__FIELD( timings ) *(const double*)((const char*)(timings) + field_offset)
+    printf( "%-24s %-10s %10.4f %10.4f %10.4f %10.4f\n", engine_name, phase,
+            BENCHMARK__FIELD( p50 ), BENCHMARK__FIELD( p95 ), BENCHMARK__FIELD( p99 ), BENCHMARK__FIELD( max ) );
+    #undef BENCHMARK__FIELD
+}
+
+void
+benchmark_print_summary( const benchmark_t* bench )
+{
+    const double mib = 1024.0 * 1024.0;
+    printf( "%-24s %14s %14s %14s %14s %14s %14s %8s\n", "Method", "Generate [ms]", "Submit [ms]", "GPU [ms]",
+            "Staging [MiB]", "Buffers [MiB]", "Upload [MiB]", "Stalls" );
+    for( int32_t i = 0; i < bench->n_engines; ++i )
+    {
+        frame_timings_t mean = benchmark_mean( bench, i );
+        printf( "%-24s %14.4f %14.4f %14.4f %14.2f %14.2f %14.4f %8llu\n", bench->engine_names[i],
+                mean.generate, mean.submit, mean.gpu,
+                bench->memory[i].cpu_staging_bytes / mib, bench->memory[i].gpu_buffer_bytes / mib,
+                benchmark_mean_uploaded_bytes( bench, i ) / mib,
+                (unsigned long long)benchmark_total_stalls( bench, i ) );
+    }
+
+    printf( "\n%-24s %-10s %10s %10s %10s %10s\n", "Method", "Phase", "p50 [ms]", "p95 [ms]", "p99 [ms]", "Max [ms]" );
+    for( int32_t i = 0; i < bench->n_engines; ++i )
+    {
+        frame_timings_t p50 = benchmark_percentile( bench, i, 50.0 );
+        frame_timings_t p95 = benchmark_percentile( bench, i, 95.0 );
+        frame_timings_t p99 = benchmark_percentile( bench, i, 99.0 );
+        frame_timings_t max = benchmark_max( bench, i );
+        benchmark__print_distribution( bench->engine_names[i], "generate", &p50, &p95, &p99, &max,
+                                       offsetof(frame_timings_t, generate) );
+        benchmark__print_distribution( bench->engine_names[i], "submit", &p50, &p95, &p99, &max,
+                                       offsetof(frame_timings_t, submit) );
+        benchmark__print_distribution( bench->engine_names[i], "gpu", &p50, &p95, &p99, &max,
+                                       offsetof(frame_timings_t, gpu) );
+    }
+
+    if( bench->has_pipeline_stats )
+    {
+        const char* columns[PROFILER_N_PIPELINE_STATS] =
+        {
+            "Vertices", "Primitives", "VS invoc.", "GS invoc.", "GS prims", "Clip in", "Clip out", "FS invoc."
+        };
+        printf( "\n%-24s", "Method" );
+        for( int32_t j = 0; j < PROFILER_N_PIPELINE_STATS; ++j ) { printf( " %12s", columns[j] ); }
+        printf( "\n" );
+        for( int32_t i = 0; i < bench->n_engines; ++i )
+        {
+            printf( "%-24s", bench->engine_names[i] );
+            for( int32_t j = 0; j < PROFILER_N_PIPELINE_STATS; ++j )
+            {
+                printf( " %12llu", (unsigned long long)bench->pipeline_stats[i].values[j] );
+            }
+            printf( "\n" );
+        }
+    }
+}
+
+static void
+benchmark__write_csv( const benchmark_t* bench, FILE* fp )
+{
+    fprintf( fp, "engine,frame,generate_ms,submit_ms,gpu_ms,uploaded_bytes,stalls\n" );
+    for( int32_t i = 0; i < bench->n_engines; ++i )
+    {
+        const frame_timings_t* samples = bench->samples + i * bench->n_frames;
+        const uint64_t* uploaded_bytes = bench->uploaded_bytes + i * bench->n_frames;
+        const uint64_t* stalls = bench->stalls + i * bench->n_frames;
+        for( int32_t j = 0; j < bench->n_frames; ++j )
+        {
+            fprintf( fp, "\"%s\",%d,%.6f,%.6f,%.6f,%llu,%llu\n", bench->engine_names[i], j,
+                     samples[j].generate, samples[j].submit, samples[j].gpu, (unsigned long long)uploaded_bytes[j],
+                     (unsigned long long)stalls[j] );
+        }
+    }
+}
+
+static void
+benchmark__write_json_array( FILE* fp, const char* name, const frame_timings_t* samples, int32_t n_frames,
+                             size_t field_offset )
+{
+    fprintf( fp, "      \"%s\": [", name );
+    for( int32_t j = 0; j < n_frames; ++j )
+    {
+        double value = *(const double*)((const char*)(samples + j) + field_offset);
+        fprintf( fp, "%s%.6f", j ? ", " : "", value );
+    }
+    fprintf( fp, "]" );
+}
+
+static void
+benchmark__write_json( const benchmark_t* bench, FILE* fp )
+{
+    fprintf( fp, "{\n  \"frames\": %d,\n  \"engines\": [\n", bench->n_frames );
+    for( int32_t i = 0; i < bench->n_engines; ++i )
+    {
+        const frame_timings_t* samples = bench->samples + i * bench->n_frames;
+        frame_timings_t mean = benchmark_mean( bench, i );
+        fprintf( fp, "    {\n" );
+        fprintf( fp, "      \"name\": \"%s\",\n", bench->engine_names[i] );
+        fprintf( fp, "      \"mean_generate_ms\": %.6f,\n", mean.generate );
+        fprintf( fp, "      \"mean_submit_ms\": %.6f,\n", mean.submit );
+        fprintf( fp, "      \"mean_gpu_ms\": %.6f,\n", mean.gpu );
+        const double percentiles[3] = { 50.0, 95.0, 99.0 };
+        for( int32_t k = 0; k < 3; ++k )
+        {
+            frame_timings_t p = benchmark_percentile( bench, i, percentiles[k] );
+            fprintf( fp, "      \"p%d_generate_ms\": %.6f,\n", (int32_t)percentiles[k], p.generate );
+            fprintf( fp, "      \"p%d_submit_ms\": %.6f,\n", (int32_t)percentiles[k], p.submit );
+            fprintf( fp, "      \"p%d_gpu_ms\": %.6f,\n", (int32_t)percentiles[k], p.gpu );
+        }
+        frame_timings_t max = benchmark_max( bench, i );
+        fprintf( fp, "      \"max_generate_ms\": %.6f,\n", max.generate );
+        fprintf( fp, "      \"max_submit_ms\": %.6f,\n", max.submit );
+        fprintf( fp, "      \"max_gpu_ms\": %.6f,\n", max.gpu );
+        fprintf( fp, "      \"cpu_staging_bytes\": %llu,\n", (unsigned long long)bench->memory[i].cpu_staging_bytes );
+        fprintf( fp, "      \"gpu_buffer_bytes\": %llu,\n", (unsigned long long)bench->memory[i].gpu_buffer_bytes );
+        fprintf( fp, "      \"mean_uploaded_bytes\": %.1f,\n", benchmark_mean_uploaded_bytes( bench, i ) );
+        fprintf( fp, "      \"total_stalls\": %llu,\n", (unsigned long long)benchmark_total_stalls( bench, i ) );
+        if( bench->has_pipeline_stats )
+        {
+            fprintf( fp, "      \"pipeline_stats\": {" );
+            for( int32_t j = 0; j < PROFILER_N_PIPELINE_STATS; ++j )
+            {
+                fprintf( fp, "%s\"%s\": %llu", j ? ", " : "", profiler_pipeline_stat_names[j],
+                         (unsigned long long)bench->pipeline_stats[i].values[j] );
+            }
+            fprintf( fp, "},\n" );
+        }
+        benchmark__write_json_array( fp, "generate_ms", samples, bench->n_frames, offsetof(frame_timings_t, generate) );
+        fprintf( fp, ",\n" );
+        benchmark__write_json_array( fp, "submit_ms", samples, bench->n_frames, offsetof(frame_timings_t, submit) );
+        fprintf( fp, ",\n" );
+        benchmark__write_json_array( fp, "gpu_ms", samples, bench->n_frames, offsetof(frame_timings_t, gpu) );
+        fprintf( fp, ",\n      \"uploaded_bytes\": [" );
+        for( int32_t j = 0; j < bench->n_frames; ++j )
+        {
+            fprintf( fp, "%s%llu", j ? ", " : "", (unsigned long long)bench->uploaded_bytes[i * bench->n_frames + j] );
+        }
+        fprintf( fp, "]" );
+        fprintf( fp, ",\n      \"stalls\": [" );
+        for( int32_t j = 0; j < bench->n_frames; ++j )
+        {
+            fprintf( fp, "%s%llu", j ? ", " : "", (unsigned long long)bench->stalls[i * bench->n_frames + j] );
+        }
+        fprintf( fp, "]" );
+        fprintf( fp, "\n    }%s\n", i < bench->n_engines - 1 ? "," : "" );
+    }
+    fprintf( fp, "  ]\n}\n" );
+}
+
+int32_t
+benchmark_write( const benchmark_t* bench, const char* filename )
+{
+    FILE* fp = fopen( filename, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "[Benchmark] Failed to open %s for writing\n", filename );
+        return 0;
+    }
+
+    const char* ext = msh_path_get_ext( filename );
+    if( ext && !strcmp( ext, "json" ) ) { benchmark__write_json( bench, fp ); }
+    else                                { benchmark__write_csv( bench, fp ); }
+
+    fclose( fp );
+    return 1;
+}
+
+void
+benchmark_term( benchmark_t* bench )
+{
+    free( bench->samples );
+    free( bench->uploaded_bytes );
+    free( bench->stalls );
+    free( bench->memory );
+    free( bench->pipeline_stats );
+    memset( bench, 0, sizeof(benchmark_t) );
+}
+
+#endif /*BENCHMARK_IMPLEMENTATION*/
@@ -5,130 +5,71 @@
 void* cpu_lines_init_device();
 uint32_t cpu_lines_update( void* device, const void* data, int32_t n_elems, int32_t elem_size, 
                            uniform_data_t* uniform_data );
-void cpu_lines_render( const void* device, const int32_t count );
+uint32_t cpu_lines_update_ranges( void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                  const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data );
+// Changes the device in streaming mode, which expands and uploads the segments in between the draws. Those phases are
+// traced as "update" scopes, nested in whatever scope the caller has open around the render.
+void cpu_lines_render( void* device, const int32_t count );
 void cpu_lines_term_device( void** device );
+memory_stats_t cpu_lines_memory_stats( const void* device );
+
+// Number of threads expanding the lines, including the render thread; 0 (the default) uses all cores.
+// Takes effect for devices created afterwards.
+void cpu_lines_set_thread_count( int32_t n_threads );
+
+// Layout of the expanded vertices; see cpu_lines_compact_vertex_t. Takes effect for devices created afterwards.
+typedef enum cpu_lines_vertex_format
+{
+  CPU_LINES_FORMAT_FULL,
+  CPU_LINES_FORMAT_COMPACT
+} cpu_lines_vertex_format_t;
+
+void cpu_lines_set_vertex_format( cpu_lines_vertex_format_t format );
+
+// Write 4 vertices per segment and draw them with a static index buffer, instead of 6 vertices of two triangles.
+// Takes effect for devices created afterwards.
+void cpu_lines_set_indexed( bool indexed );
+
+// Skip segments outside of the view before expanding them, and clip the ones crossing the near plane. On by default.
+// Takes effect for devices created afterwards.
+void cpu_lines_set_culling( bool cull );
+
+// Expand straight into a persistently mapped vertex buffer, instead of into a staging buffer that is then copied with
+// glNamedBufferSubData. On by default. Takes effect for devices created afterwards.
+void cpu_lines_set_zero_copy( bool zero_copy );
+
+// Keep a copy of the last segments and uniforms, and only expand again what changed: nothing when the data and view
+// are the same as in the previous update, and just the changed chunks of segments when only the data differs. Costs
+// a copy of the input and a comparison against it every update. Off by default. Takes effect for devices created
+// afterwards.
+void cpu_lines_set_caching( bool cache );
+
+// Expand and draw the segments 'chunk_segments' at a time while rendering, instead of all at once in the update.
+// Chunks go through a ring of CPU_LINES_STREAM_SLOTS regions of a persistently mapped buffer, so memory does not
+// depend on the input size, and the GPU draws each chunk while the next one is expanded. The input passed to the
+// update has to stay valid until the render call. Replaces caching and the copying upload. 0, the default, turns
+// streaming off. Takes effect for devices created afterwards.
+void cpu_lines_set_streaming( uint32_t chunk_segments );
 
 #endif /* CPU_LINES_H */
 
 #ifdef CPU_LINES_IMPLEMENTATION
 
-// NOTE(maciej): We need a fatter vertices to communicate all required info. 
-//               It is possible to pack this info more tightly and then unpack on shader side, but this is a reference 
-//               implementation, so we don't care if we sacrifice performance for clarity.
-typedef struct cpu_lines_vertex
-{
-  msh_vec4_t clip_pos;
-  msh_vec4_t col;
-  msh_vec4_t line_params;
-} cpu_lines_vertex_t;
+// Quads per draw call in indexed mode - the most that 16-bit indices can address. All batches share one index buffer,
+// and are offset with a base vertex.
+#define CPU_LINES_INDEX_BATCH_QUADS (65536 / 4)
 
-void
-cpu_lines_expand( const vertex_t* line_buf, uint32_t line_buf_len,
-                  cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
-                  msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
-{
-  if( line_buf_len * 3 >= quad_buf_cap )
-  {
-    fprintf(stderr, "Not enough space to generate quads from line\n" );
-    return;
-  }
-
-  cpu_lines_vertex_t* dst = quad_buf;
-  *quad_buf_len = 0;
-
-  float width = viewport_size.x;
-  float height = viewport_size.y;
-  float aspect_ratio = height / width;
-
-  for( int i = 0; i < line_buf_len; i += 2 )
-  {
-    const vertex_t* src_v0 = line_buf + i;
-    const vertex_t* src_v1 = src_v0 + 1;
-
-    // Move vertices from model space to clip space
-    msh_vec4_t clip_a0 = msh_mat4_vec4_mul( mvp, msh_vec4(src_v0->pos.x, src_v0->pos.y, src_v0->pos.z, 1.0f) );
-    msh_vec4_t clip_b0 = msh_mat4_vec4_mul( mvp, msh_vec4(src_v1->pos.x, src_v1->pos.y, src_v1->pos.z, 1.0f) );
-    msh_vec4_t clip_a1;
-    msh_vec4_t clip_b1;
-
-    // Perspective divide to create vertex location in normalized device coordinates
-    msh_vec2_t ndc_a = msh_vec2_scalar_div( msh_vec2(clip_a0.x, clip_a0.y), clip_a0.w );
-    msh_vec2_t ndc_b = msh_vec2_scalar_div( msh_vec2(clip_b0.x, clip_b0.y), clip_b0.w );
-
-    // Calculate the line vector in viewport space, as well as the direction of the line (corrected for aspect ratio)
-    msh_vec2_t line_vector = msh_vec2_sub( ndc_b, ndc_a );
-    msh_vec2_t viewport_line_vector = msh_vec2_mul( line_vector, viewport_size );
-    msh_vec2_t dir = msh_vec2_normalize( msh_vec2( line_vector.x, line_vector.y * aspect_ratio ) );
-
-    // Calculate vectors modifying the vertex positions in 
-    float      extension_length = aa_radius.y;
-    float      line_width_a     = msh_max( 1.0f, src_v0->width ) + aa_radius.x;
-    float      line_width_b     = msh_max( 1.0f, src_v1->width ) + aa_radius.x;
-    float      line_length      = msh_vec2_norm( viewport_line_vector ) + 2.0f * extension_length;
-    msh_vec2_t normal           = msh_vec2( -dir.y, dir.x );
-    msh_vec2_t normal_a         = msh_vec2_mul( msh_vec2( line_width_a / width, line_width_a / height), normal );
-    msh_vec2_t normal_b         = msh_vec2_mul( msh_vec2( line_width_b / width, line_width_b / height), normal );
-    msh_vec2_t extension        = msh_vec2_mul( msh_vec2( extension_length / width, extension_length / height), dir );
-
-    // Calculate the four corners of a quad in clip space (revert w division after adding correct vectors to input position)
-    clip_a1 = msh_vec4( (ndc_a.x - normal_a.x - extension.x) * clip_a0.w,
-                        (ndc_a.y - normal_a.y - extension.y) * clip_a0.w,
-                        clip_a0.z,
-                        clip_a0.w );
-    clip_a0 = msh_vec4( (ndc_a.x + normal_a.x - extension.x) * clip_a0.w,
-                        (ndc_a.y + normal_a.y - extension.y) * clip_a0.w,
-                        clip_a0.z,
-                        clip_a0.w );
-
-    clip_b1 = msh_vec4( (ndc_b.x - normal_b.x + extension.x) * clip_b0.w,
-                        (ndc_b.y - normal_b.y + extension.y) * clip_b0.w,
-                        clip_b0.z,
-                        clip_b0.w );
-    clip_b0 = msh_vec4( (ndc_b.x + normal_b.x + extension.x) * clip_b0.w,
-                        (ndc_b.y + normal_b.y + extension.y) * clip_b0.w,
-                        clip_b0.z,
-                        clip_b0.w );
-
-    // Adjust colors in case line width is smaller than 1 pixels, to simulate a partial coverage.
-    float alpha_a = msh_min( src_v0->col.w * src_v0->width, 1.0f );
-    float alpha_b = msh_min( src_v0->col.w * src_v1->width, 1.0f );
-
-    // Communicate the new data to the buffer. We draw arrays, so each quad is 2 triangles.
-    // Note the additional "line_params" attribute that communicates the correct data to the glsl program
-    (dst + 0)->clip_pos = clip_a0;
-    (dst + 0)->col = msh_vec4( src_v0->col.x, src_v0->col.y, src_v0->col.z, alpha_a );
-    (dst + 0)->line_params = msh_vec4( -line_width_a, -0.5*line_length, line_width_a, 0.5*line_length );
-
-    (dst + 1)->clip_pos = clip_a1;
-    (dst + 1)->col = msh_vec4( src_v0->col.x, src_v0->col.y, src_v0->col.z, alpha_a );
-    (dst + 1)->line_params = msh_vec4( line_width_a, -0.5*line_length, line_width_a, 0.5*line_length );
-
-    (dst + 2)->clip_pos = clip_b0;
-    (dst + 2)->col = msh_vec4( src_v1->col.x, src_v1->col.x, src_v1->col.z, alpha_b );
-    (dst + 2)->line_params = msh_vec4( -line_width_b, 0.5*line_length, line_width_b, 0.5*line_length );
-
-    (dst + 3)->clip_pos = clip_a1;
-    (dst + 3)->col = msh_vec4( src_v0->col.x, src_v0->col.y, src_v0->col.z, alpha_a );
-    (dst + 3)->line_params = msh_vec4( line_width_a, -0.5*line_length, line_width_a, 0.5*line_length );
-
-    (dst + 4)->clip_pos = clip_b0;
-    (dst + 4)->col = msh_vec4( src_v1->col.x, src_v1->col.x, src_v1->col.z, alpha_b );
-    (dst + 4)->line_params = msh_vec4( -line_width_b, 0.5*line_length, line_width_b, 0.5*line_length );
-
-    (dst + 5)->clip_pos = clip_b1;
-    (dst + 5)->col = msh_vec4( src_v1->col.x, src_v1->col.x, src_v1->col.z, alpha_b );
-    (dst + 5)->line_params = msh_vec4( line_width_b, 0.5*line_length, line_width_b, 0.5*line_length );
-
-    *quad_buf_len += 6;
-    dst = quad_buf + (*quad_buf_len);
-  }
-}
+// Chunks that can be in flight in streaming mode.
+#define CPU_LINES_STREAM_SLOTS 4
 
 typedef struct cpu_lines_device
 {
   GLuint program_id;
   GLuint vao;
   GLuint vbo;
+  GLuint ibo;
+  // Backs 'vbo' unless zero_copy is set, in which case the stream buffer does.
+  gl_utils_buffer_t buffer;
 
   struct cpu_lines_uniforms_locations
   {
@@ -140,19 +81,161 @@ typedef struct cpu_lines_device
     GLuint clip_pos;
     GLuint col;
     GLuint line_params;
+    GLuint clip_zw;
   } attribs;
 
-  cpu_lines_vertex_t* quad_buf;
+  cpu_lines_vertex_format_t format;
+  bool indexed;
+  bool cull;
+  bool zero_copy;
+  size_t vertex_size;
+  void* quad_buf;
+  gl_utils_stream_buffer_t stream;
+  GLint first_vertex;
+
+  // Streaming mode; the input of the last update, expanded by the render call.
+  uint32_t stream_segments;
+  const vertex_t* stream_data;
+  int32_t stream_len;
+
+  // Input size, uniforms and per-chunk output counts of the last full expansion, which ranged updates and caching
+  // expand changed chunks against. Caching also keeps a shadow copy of the input to find them.
+  bool cache;
+  bool expansion_valid;
+  int32_t expanded_len;
+  float expanded_uniforms[20];
+  uint32_t expanded_quad_buf_len;
+  uint32_t* chunk_counts;
+  uint32_t* run_chunk_counts;
+  uint8_t* dirty_chunks;
+  uint32_t chunk_counts_cap;
+  cpu_lines_expand_scratch_t expand_scratch;
+  vertex_t* shadow_buf;
+  int32_t shadow_cap;
+  // Without zero copy, changed runs are expanded here first, and only written out if they still fit.
+  void* run_buf;
+  size_t run_buf_size;
   uniform_data_t* uniform_data;
+  worker_pool_t* pool;
+
+  memory_stats_t mem_stats;
 
 } cpu_lines_device_t;
 
+static int32_t cpu_lines__n_threads = 0;
+static cpu_lines_vertex_format_t cpu_lines__format = CPU_LINES_FORMAT_FULL;
+static bool cpu_lines__indexed = false;
+static bool cpu_lines__cull = true;
+static bool cpu_lines__zero_copy = true;
+static bool cpu_lines__cache = false;
+static uint32_t cpu_lines__stream_segments = 0;
+
+void
+cpu_lines_set_thread_count( int32_t n_threads )
+{
+  cpu_lines__n_threads = n_threads;
+}
+
+void
+cpu_lines_set_vertex_format( cpu_lines_vertex_format_t format )
+{
+  cpu_lines__format = format;
+}
+
+void
+cpu_lines_set_indexed( bool indexed )
+{
+  cpu_lines__indexed = indexed;
+}
+
+void
+cpu_lines_set_culling( bool cull )
+{
+  cpu_lines__cull = cull;
+}
+
+void
+cpu_lines_set_zero_copy( bool zero_copy )
+{
+  cpu_lines__zero_copy = zero_copy;
+}
+
+void
+cpu_lines_set_caching( bool cache )
+{
+  cpu_lines__cache = cache;
+}
+
+void
+cpu_lines_set_streaming( uint32_t chunk_segments )
+{
+  cpu_lines__stream_segments = chunk_segments;
+}
+
+static void
+cpu_lines__update_memory_stats( cpu_lines_device_t* device )
+{
+  size_t vbo_size = device->zero_copy ? device->stream.size : device->buffer.size;
+  size_t ibo_size = device->ibo ? 6 * CPU_LINES_INDEX_BATCH_QUADS * sizeof(uint16_t) : 0;
+  size_t shadow_size = (size_t)device->shadow_cap * sizeof(vertex_t);
+  device->mem_stats.gpu_buffer_bytes = vbo_size + ibo_size;
+  device->mem_stats.cpu_staging_bytes = (device->zero_copy ? 0 : vbo_size + device->run_buf_size) + shadow_size;
+}
+
+// Grows or shrinks the vertex buffer, and the staging buffer with it, to fit 'n_vertices'. Contents are lost when the
+// storage changes, and with them the last expansion. Returns 0 when the buffer could not be allocated.
+static int32_t
+cpu_lines__fit_buffers( cpu_lines_device_t* device, uint32_t n_vertices )
+{
+  // The expansion wants the capacity to exceed its output, hence the extra vertex.
+  size_t frame_size = ((size_t)n_vertices + 1) * device->vertex_size;
+  int32_t replaced = 0;
+  if( device->zero_copy )
+  {
+    replaced = gl_utils_stream_buffer_fit( &device->stream, GL_UTILS_STREAM_FRAMES * frame_size );
+    if( !device->stream.mapped )
+    {
+      device->expansion_valid = false;
+      return 0;
+    }
+    device->vbo = device->stream.buffer;
+  }
+  else if( gl_utils_buffer_fit( &device->buffer, frame_size ) )
+  {
+    replaced = 1;
+    device->vbo = device->buffer.buffer;
+    free( device->quad_buf );
+    device->quad_buf = malloc( device->buffer.size );
+  }
+
+  if( replaced )
+  {
+    device->expansion_valid = false;
+    glVertexArrayVertexBuffer( device->vao, 0, device->vbo, 0, device->vertex_size );
+    cpu_lines__update_memory_stats( device );
+  }
+  return 1;
+}
+
 void*
 cpu_lines_init_device( void )
 {
   cpu_lines_device_t* device = malloc( sizeof(cpu_lines_device_t) );
   memset( device, 0, sizeof(cpu_lines_device_t) );
-  device->quad_buf = malloc( MAX_VERTS * sizeof(vertex_t) );
+  device->format = cpu_lines__format;
+  device->indexed = cpu_lines__indexed;
+  device->cull = cpu_lines__cull;
+  device->zero_copy = cpu_lines__zero_copy;
+  device->cache = cpu_lines__cache;
+  device->stream_segments = cpu_lines__stream_segments;
+  if( device->stream_segments )
+  {
+    device->zero_copy = true;
+    device->cache = false;
+  }
+  device->vertex_size = device->format == CPU_LINES_FORMAT_COMPACT ? sizeof(cpu_lines_compact_vertex_t)
+                                                                   : sizeof(cpu_lines_vertex_t);
+  device->pool = worker_pool_create( cpu_lines__n_threads );
 
   // Inline shaders
   const char* vs_src = 
@@ -173,15 +256,38 @@ cpu_lines_init_device( void )
         gl_Position = clip_pos;
       }
     );
+
+  // Compact vertices carry the position after the perspective divide; w is multiplied back in for clipping and
+  // interpolation.
+  const char* compact_vs_src = 
+    GL_UTILS_SHDR_VERSION
+    GL_UTILS_SHDR_SOURCE
+    (
+      layout(location = 0) in vec2 ndc_pos;
+      layout(location = 1) in vec4 col;
+      layout(location = 2) in vec4 line_params;
+      layout(location = 3) in vec2 clip_zw;
+
+      out vec4 v_col;
+      out noperspective vec4 v_line_params;
+
+      void main()
+      {
+        v_col = col;
+        v_line_params = line_params;
+        gl_Position = vec4( ndc_pos * clip_zw.y, clip_zw.x, clip_zw.y );
+      }
+    );
+  if( device->format == CPU_LINES_FORMAT_COMPACT ) { vs_src = compact_vs_src; }
   
   const char* fs_src = 
     GL_UTILS_SHDR_VERSION
+    GL_UTILS_SHDR_FRAG_OUTPUTS
     GL_UTILS_SHDR_SOURCE
     (
       layout(location = 0) uniform vec2 u_aa_radius;
       in vec4 v_col;
       in noperspective vec4 v_line_params;
-      out vec4 frag_color;
       void main()
       {
         float u = v_line_params.x;
@@ -194,6 +300,7 @@ cpu_lines_init_device( void )
 
         frag_color = v_col;
         frag_color.a *= min( au, av );
+        write_overdraw();
       }
     );
 
@@ -221,30 +328,86 @@ cpu_lines_init_device( void )
   glDeleteShader( fragment_shader );
 
   // Record information from the glsl program so that we can communicate data back to it.
-  device->attribs.clip_pos    = glGetAttribLocation( device->program_id, "clip_pos" );
+  device->attribs.clip_pos    = glGetAttribLocation( device->program_id,
+                                 device->format == CPU_LINES_FORMAT_COMPACT ? "ndc_pos" : "clip_pos" );
   device->attribs.col         = glGetAttribLocation( device->program_id, "col" );
   device->attribs.line_params = glGetAttribLocation( device->program_id, "line_params" );
+  device->attribs.clip_zw     = glGetAttribLocation( device->program_id, "clip_zw" );
 
   device->uniforms.aa_radius  = glGetUniformLocation( device->program_id, "u_aa_radius" );
   
   // Setup the storage on the gpu
   GLuint binding_idx = 0;
   glCreateVertexArrays( 1, &device->vao );
-  glCreateBuffers( 1, &device->vbo );
-  glNamedBufferStorage( device->vbo, MAX_VERTS * sizeof(cpu_lines_vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT );
+  // Sized to the data on each update, except in streaming mode.
+  size_t vbo_size = GL_UTILS_BUFFER_MIN_SIZE;
+  if( device->stream_segments )
+  {
+    // One spare vertex per slot, as the expansion wants the capacity to exceed its output.
+    uint32_t n_slot_vertices = (device->indexed ? 4 : 6) * device->stream_segments + 1;
+    vbo_size = (size_t)CPU_LINES_STREAM_SLOTS * n_slot_vertices * device->vertex_size;
+  }
+  if( device->zero_copy && gl_utils_stream_buffer_init( &device->stream, vbo_size ) )
+  {
+    // Frames (or chunks, when streaming) are written to successive regions of the buffer, which the draws select with
+    // their first vertex.
+    device->vbo = device->stream.buffer;
+  }
+  else
+  {
+    device->zero_copy = false;
+    device->stream_segments = 0;
+    gl_utils_buffer_init( &device->buffer );
+    device->vbo = device->buffer.buffer;
+    device->quad_buf = malloc( device->buffer.size );
+  }
 
-  glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo, 0, sizeof(cpu_lines_vertex_t) );
+  glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo, 0, device->vertex_size );
+
+  if( device->indexed )
+  {
+    uint32_t n_indices = 6 * CPU_LINES_INDEX_BATCH_QUADS;
+    uint16_t* indices = malloc( n_indices * sizeof(uint16_t) );
+    for( uint32_t i = 0; i < CPU_LINES_INDEX_BATCH_QUADS; ++i )
+    {
+      uint16_t base = (uint16_t)(4 * i);
+      uint16_t* dst = indices + 6 * i;
+      dst[0] = base + 0; dst[1] = base + 1; dst[2] = base + 2;
+      dst[3] = base + 1; dst[4] = base + 2; dst[5] = base + 3;
+    }
+    glCreateBuffers( 1, &device->ibo );
+    glNamedBufferStorage( device->ibo, n_indices * sizeof(uint16_t), indices, 0 );
+    glVertexArrayElementBuffer( device->vao, device->ibo );
+    free( indices );
+  }
+  cpu_lines__update_memory_stats( device );
 
   glEnableVertexArrayAttrib( device->vao, device->attribs.clip_pos );
   glEnableVertexArrayAttrib( device->vao, device->attribs.col );
   glEnableVertexArrayAttrib( device->vao, device->attribs.line_params );
 
-  glVertexArrayAttribFormat( device->vao, device->attribs.clip_pos, 
-                                          4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, clip_pos) );
-  glVertexArrayAttribFormat( device->vao, device->attribs.col, 
-                                          4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, col) );
-  glVertexArrayAttribFormat( device->vao, device->attribs.line_params, 
-                                          4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, line_params) );
+  if( device->format == CPU_LINES_FORMAT_COMPACT )
+  {
+    glEnableVertexArrayAttrib( device->vao, device->attribs.clip_zw );
+    glVertexArrayAttribFormat( device->vao, device->attribs.clip_pos, 
+                                            2, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_compact_vertex_t, ndc_pos) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.col, 
+                                            4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(cpu_lines_compact_vertex_t, col) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.line_params, 
+                                            4, GL_HALF_FLOAT, GL_FALSE, offsetof(cpu_lines_compact_vertex_t, line_params) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.clip_zw, 
+                                            2, GL_HALF_FLOAT, GL_FALSE, offsetof(cpu_lines_compact_vertex_t, clip_zw) );
+    glVertexArrayAttribBinding( device->vao, device->attribs.clip_zw, binding_idx );
+  }
+  else
+  {
+    glVertexArrayAttribFormat( device->vao, device->attribs.clip_pos, 
+                                            4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, clip_pos) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.col, 
+                                            4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, col) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.line_params, 
+                                            4, GL_FLOAT, GL_FALSE, offsetof(cpu_lines_vertex_t, line_params) );
+  }
 
   glVertexArrayAttribBinding( device->vao, device->attribs.clip_pos, binding_idx );
   glVertexArrayAttribBinding( device->vao, device->attribs.col, binding_idx );
@@ -257,45 +420,446 @@ void cpu_lines_term_device( void** device_in )
 {
   cpu_lines_device_t* device = *device_in;
   glDeleteProgram( device->program_id );
-  glDeleteBuffers( 1, &device->vbo );
+  if( device->zero_copy ) { gl_utils_stream_buffer_term( &device->stream ); }
+  else                    { gl_utils_buffer_term( &device->buffer ); }
+  if( device->ibo ) { glDeleteBuffers( 1, &device->ibo ); }
   glDeleteVertexArrays( 1, &device->vao );
+  worker_pool_destroy( &device->pool );
   free( device->quad_buf );
+  free( device->shadow_buf );
+  free( device->chunk_counts );
+  free( device->run_chunk_counts );
+  free( device->dirty_chunks );
+  free( device->run_buf );
+  cpu_lines_expand_scratch_term( &device->expand_scratch );
   free( device );
   *device_in = NULL;
 }
 
+static void
+cpu_lines__expand( cpu_lines_device_t* device, const cpu_lines_expand_options_t* options,
+                   const vertex_t* line_buf, uint32_t line_buf_len,
+                   void* quad_buf, uint32_t* quad_buf_len, uint32_t quad_buf_cap,
+                   msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  if( device->format == CPU_LINES_FORMAT_COMPACT )
+  {
+    cpu_lines_expand_compact_parallel( device->pool, options, line_buf, line_buf_len,
+                                       quad_buf, quad_buf_len, quad_buf_cap, mvp, viewport_size, aa_radius );
+  }
+  else
+  {
+    cpu_lines_expand_parallel( device->pool, options, line_buf, line_buf_len,
+                               quad_buf, quad_buf_len, quad_buf_cap, mvp, viewport_size, aa_radius );
+  }
+}
+
+// Marks the chunks to expand again: the ones holding any of the given ranges of vertices or, without ranges, the ones
+// whose segments differ from the shadow copy.
+static bool
+cpu_lines__find_changed_chunks( cpu_lines_device_t* device, const vertex_t* data, uint32_t n_segments,
+                                const line_range_t* ranges, int32_t n_ranges )
+{
+  uint32_t n_chunks = (n_segments + CPU_LINES_EXPAND_CHUNK_SEGMENTS - 1) / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  bool changed = false;
+  if( !ranges )
+  {
+    for( uint32_t chunk_idx = 0; chunk_idx < n_chunks; ++chunk_idx )
+    {
+      uint32_t first = chunk_idx * CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+      uint32_t count = msh_min( n_segments - first, (uint32_t)CPU_LINES_EXPAND_CHUNK_SEGMENTS );
+      device->dirty_chunks[chunk_idx] =
+        memcmp( data + 2 * first, device->shadow_buf + 2 * first, 2 * count * sizeof(vertex_t) ) != 0;
+      changed |= device->dirty_chunks[chunk_idx];
+    }
+    return changed;
+  }
+
+  memset( device->dirty_chunks, 0, n_chunks );
+  for( int32_t i = 0; i < n_ranges; ++i )
+  {
+    if( !ranges[i].count || ranges[i].first / 2 >= n_segments ) { continue; }
+    uint32_t first_chunk = ranges[i].first / 2 / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+    uint32_t last_segment = msh_min( (ranges[i].first + ranges[i].count - 1) / 2, n_segments - 1 );
+    uint32_t last_chunk = last_segment / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+    memset( device->dirty_chunks + first_chunk, 1, last_chunk - first_chunk + 1 );
+    changed = true;
+  }
+  return changed;
+}
+
+// Expands again the runs of chunks marked by cpu_lines__find_changed_chunks, into 'quad_buf', which already holds the
+// output of the last expansion. The view is unchanged, so the output of the other chunks stays valid, provided the runs
+// produce as many segments as before - otherwise everything after them would move, and this returns 0 for a full
+// expansion. Runs are expanded aside and checked before anything is written, so a failed attempt leaves the output as
+// it was.
+static int32_t
+cpu_lines__update_changed_chunks_in_place( cpu_lines_device_t* device, const vertex_t* data, uint32_t n_segments,
+                                           const cpu_lines_expand_options_t* options, uint8_t* quad_buf,
+                                           msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius,
+                                           uint64_t* written_bytes )
+{
+  uint32_t n_quad_vertices = device->indexed ? 4 : 6;
+  uint32_t n_chunks = (n_segments + CPU_LINES_EXPAND_CHUNK_SEGMENTS - 1) / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  cpu_lines_expand_options_t run_options = *options;
+  run_options.chunk_counts = device->run_chunk_counts;
+
+  // 'dst_segment' counts the output segments of the chunks before 'chunk_idx'.
+  uint32_t dst_segment = 0;
+  uint32_t chunk_idx = 0;
+  while( chunk_idx < n_chunks )
+  {
+    if( !device->dirty_chunks[chunk_idx] )
+    {
+      dst_segment += device->chunk_counts[chunk_idx++];
+      continue;
+    }
+    uint32_t run_end = chunk_idx + 1;
+    while( run_end < n_chunks && device->dirty_chunks[run_end] ) { run_end++; }
+
+    uint32_t first = chunk_idx * CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+    uint32_t count = msh_min( run_end * CPU_LINES_EXPAND_CHUNK_SEGMENTS, n_segments ) - first;
+    uint32_t n_run_segments = 0;
+    for( uint32_t i = chunk_idx; i < run_end; ++i ) { n_run_segments += device->chunk_counts[i]; }
+
+    uint32_t run_cap = n_quad_vertices * count + 1;
+    if( (size_t)run_cap * device->vertex_size > device->run_buf_size )
+    {
+      device->run_buf_size = msh_max( (size_t)run_cap * device->vertex_size, 2 * device->run_buf_size );
+      device->run_buf = realloc( device->run_buf, device->run_buf_size );
+      cpu_lines__update_memory_stats( device );
+    }
+    uint32_t quad_buf_len = 0;
+    cpu_lines__expand( device, &run_options, data + 2 * first, 2 * count, device->run_buf, &quad_buf_len, run_cap,
+                       mvp, viewport_size, aa_radius );
+    if( quad_buf_len != n_quad_vertices * n_run_segments ) { return 0; }
+
+    size_t dst_offset = (size_t)n_quad_vertices * dst_segment * device->vertex_size;
+    size_t run_size = quad_buf_len * device->vertex_size;
+    memcpy( quad_buf + dst_offset, device->run_buf, run_size );
+    glNamedBufferSubData( device->vbo, dst_offset, run_size, quad_buf + dst_offset );
+    memcpy( device->chunk_counts + chunk_idx, device->run_chunk_counts, (run_end - chunk_idx) * sizeof(uint32_t) );
+    if( device->cache ) { memcpy( device->shadow_buf + 2 * first, data + 2 * first, 2 * count * sizeof(vertex_t) ); }
+    *written_bytes += run_size;
+    dst_segment += n_run_segments;
+    chunk_idx = run_end;
+  }
+  return 1;
+}
+
+// Same as cpu_lines__update_changed_chunks_in_place, but for the mapped ring, where the previous frame may still be
+// drawing from its region. The output goes to the newly reserved region at 'offset' instead: unchanged chunks are
+// copied over from the previous region on the GPU, and only the changed runs are expanded, so nothing waits for the
+// GPU. As the output is rebuilt anyway, runs may produce a different number of segments. Returns 0 - with nothing
+// written - if the previous region may already have been reused; '*quad_buf_len' receives the new output size.
+static int32_t
+cpu_lines__update_changed_chunks_copy( cpu_lines_device_t* device, const vertex_t* data, uint32_t n_segments,
+                                       const cpu_lines_expand_options_t* options, size_t offset, size_t prev_offset,
+                                       msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius,
+                                       uint32_t* quad_buf_len, uint64_t* written_bytes )
+{
+  gl_utils_stream_region_t* prev_region =
+    gl_utils_stream_buffer_find_previous( &device->stream, prev_offset,
+                                          (size_t)device->expanded_quad_buf_len * device->vertex_size );
+  if( !prev_region ) { return 0; }
+
+  uint32_t n_quad_vertices = device->indexed ? 4 : 6;
+  size_t segment_size = n_quad_vertices * device->vertex_size;
+  uint32_t n_chunks = (n_segments + CPU_LINES_EXPAND_CHUNK_SEGMENTS - 1) / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  cpu_lines_expand_options_t run_options = *options;
+  run_options.chunk_counts = device->run_chunk_counts;
+
+  // Output segments of the chunks before 'chunk_idx', in the previous and the new region.
+  uint32_t src_segment = 0;
+  uint32_t dst_segment = 0;
+  uint32_t chunk_idx = 0;
+  while( chunk_idx < n_chunks )
+  {
+    bool dirty = device->dirty_chunks[chunk_idx];
+    uint32_t run_end = chunk_idx + 1;
+    while( run_end < n_chunks && device->dirty_chunks[run_end] == dirty ) { run_end++; }
+    uint32_t n_run_segments = 0;
+    for( uint32_t i = chunk_idx; i < run_end; ++i ) { n_run_segments += device->chunk_counts[i]; }
+
+    if( !dirty )
+    {
+      if( n_run_segments )
+      {
+        glCopyNamedBufferSubData( device->stream.buffer, device->stream.buffer,
+                                  prev_offset + src_segment * segment_size, offset + dst_segment * segment_size,
+                                  n_run_segments * segment_size );
+      }
+      src_segment += n_run_segments;
+      dst_segment += n_run_segments;
+      chunk_idx = run_end;
+      continue;
+    }
+
+    // Culled chunks take at most the room of all their segments, which the region has for every chunk.
+    uint32_t first = chunk_idx * CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+    uint32_t count = msh_min( run_end * CPU_LINES_EXPAND_CHUNK_SEGMENTS, n_segments ) - first;
+    uint32_t run_len = 0;
+    cpu_lines__expand( device, &run_options, data + 2 * first, 2 * count,
+                       device->stream.mapped + offset + dst_segment * segment_size, &run_len,
+                       n_quad_vertices * count + 1, mvp, viewport_size, aa_radius );
+
+    memcpy( device->chunk_counts + chunk_idx, device->run_chunk_counts, (run_end - chunk_idx) * sizeof(uint32_t) );
+    if( device->cache ) { memcpy( device->shadow_buf + 2 * first, data + 2 * first, 2 * count * sizeof(vertex_t) ); }
+    *written_bytes += run_len * device->vertex_size;
+    src_segment += n_run_segments;
+    dst_segment += run_len / n_quad_vertices;
+    chunk_idx = run_end;
+  }
+  gl_utils_stream_buffer_refence( prev_region );
+  *quad_buf_len = n_quad_vertices * dst_segment;
+  return 1;
+}
+
 uint32_t
-cpu_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
-                  uniform_data_t* uniform_data )
+cpu_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                         const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
   cpu_lines_device_t* device = device_in;
+  (void) elem_size; // The expansion reads vertex_t.
   
   // Assign uniforms form the outside
   device->uniform_data = uniform_data;
 
-  // Pass data to the line expansion
+  // Pass data to the line expansion. Chunks are spread over the worker pool, which is joined before the upload.
   msh_mat4_t mvp_mat;       memcpy( mvp_mat.data, uniform_data->mvp, 16 * sizeof(float) );
   msh_vec2_t viewport_size; memcpy( viewport_size.data, uniform_data->viewport, 2 * sizeof(float) );
   msh_vec2_t aa_radius;     memcpy( aa_radius.data, uniform_data->aa_radius, 2 * sizeof(float) );
+  cpu_lines_expand_options_t options = { .kernel = CPU_LINES_KERNEL_AUTO, .indexed = device->indexed,
+                                         .cull = device->cull, .scratch = &device->expand_scratch };
+  uint32_t n_segments = (uint32_t)n_elems / 2;
+  uint32_t n_vertices = (device->indexed ? 4 : 6) * n_segments;
+  if( device->stream_segments )
+  {
+    // Expanded chunk by chunk while rendering; the count only bounds the vertices drawn.
+    device->stream_data = data;
+    device->stream_len = n_elems;
+    device->mem_stats.uploaded_bytes = 0;
+    device->mem_stats.stalls = 0;
+    return n_vertices;
+  }
+
+  uint32_t n_chunks = (n_segments + CPU_LINES_EXPAND_CHUNK_SEGMENTS - 1) / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  if( n_chunks > device->chunk_counts_cap )
+  {
+    device->chunk_counts_cap = n_chunks;
+    device->chunk_counts = realloc( device->chunk_counts, n_chunks * sizeof(uint32_t) );
+    device->run_chunk_counts = realloc( device->run_chunk_counts, n_chunks * sizeof(uint32_t) );
+    device->dirty_chunks = realloc( device->dirty_chunks, n_chunks );
+  }
+  if( device->cache && n_elems > device->shadow_cap )
+  {
+    device->shadow_cap = n_elems;
+    device->shadow_buf = realloc( device->shadow_buf, n_elems * sizeof(vertex_t) );
+    cpu_lines__update_memory_stats( device );
+  }
+
+  if( !cpu_lines__fit_buffers( device, n_vertices ) )
+  {
+    fprintf( stderr, "[CPU Lines] Not enough memory to expand %u segments\n", n_segments );
+    return 0;
+  }
+
+  void* quad_buf = device->quad_buf;
+  uint32_t quad_buf_cap = (uint32_t)(device->buffer.size / device->vertex_size);
+  size_t prev_offset = (size_t)device->first_vertex * device->vertex_size;
+
+  // With the view and input size of the last full expansion, only the changed chunks - those holding the given
+  // ranges, or differing from the shadow copy when caching - have to be expanded again.
+  float uniforms[20];
+  memcpy( uniforms,      mvp_mat.data,       16 * sizeof(float) );
+  memcpy( uniforms + 16, viewport_size.data, 2 * sizeof(float) );
+  memcpy( uniforms + 18, aa_radius.data,     2 * sizeof(float) );
+  bool reuse_chunks = device->expansion_valid && n_elems == device->expanded_len &&
+                      !memcmp( uniforms, device->expanded_uniforms, sizeof(uniforms) ) && (ranges || device->cache);
+  memcpy( device->expanded_uniforms, uniforms, sizeof(uniforms) );
+  bool changed = true;
+  if( reuse_chunks )
+  {
+    profiler_trace_begin( "expand" );
+    changed = cpu_lines__find_changed_chunks( device, data, n_segments, ranges, n_ranges );
+    profiler_trace_end();
+  }
+
+  // Nothing changed, so the previous quads are drawn again. In the ring they have to be in the latest reservation,
+  // which stays guarded until the next one; otherwise they are copied into a new region like changed output.
+  if( reuse_chunks && !changed &&
+      (!device->zero_copy ||
+       gl_utils_stream_buffer_is_latest( &device->stream, prev_offset,
+                                         (size_t)device->expanded_quad_buf_len * device->vertex_size )) )
+  {
+    device->mem_stats.uploaded_bytes = 0;
+    device->mem_stats.stalls = 0;
+    return device->expanded_quad_buf_len;
+  }
+
+  size_t offset = 0;
+  uint64_t n_stalls = device->stream.n_stalls;
+  if( device->zero_copy )
+  {
+    // Reserve room for every segment, culled or not; what the expansion leaves unused is given back afterwards.
+    quad_buf_cap = n_vertices + 1;
+    profiler_trace_begin( "wait" );
+    quad_buf = gl_utils_stream_buffer_reserve( &device->stream, quad_buf_cap * device->vertex_size,
+                                               device->vertex_size, &offset );
+    profiler_trace_end();
+  }
+  device->mem_stats.stalls = device->stream.n_stalls - n_stalls;
+  device->mem_stats.total_stalls += device->mem_stats.stalls;
+
   uint32_t quad_buf_len = 0;
-  cpu_lines_expand( data, n_elems, device->quad_buf, &quad_buf_len, MAX_VERTS, mvp_mat, viewport_size, aa_radius );
+  if( reuse_chunks )
+  {
+    uint64_t written_bytes = 0;
+    profiler_trace_begin( "expand" );
+    quad_buf_len = device->expanded_quad_buf_len;
+    int32_t reused = device->zero_copy
+                   ? cpu_lines__update_changed_chunks_copy( device, data, n_segments, &options, offset, prev_offset,
+                                                            mvp_mat, viewport_size, aa_radius, &quad_buf_len,
+                                                            &written_bytes )
+                   : cpu_lines__update_changed_chunks_in_place( device, data, n_segments, &options, quad_buf,
+                                                                mvp_mat, viewport_size, aa_radius, &written_bytes );
+    profiler_trace_end();
+    if( reused )
+    {
+      if( device->zero_copy )
+      {
+        gl_utils_stream_buffer_commit( &device->stream, quad_buf_len * device->vertex_size );
+        device->first_vertex = (GLint)(offset / device->vertex_size);
+      }
+      device->mem_stats.uploaded_bytes = written_bytes;
+      device->mem_stats.total_uploaded_bytes += written_bytes;
+      device->expanded_quad_buf_len = quad_buf_len;
+      return quad_buf_len;
+    }
+  }
+
+  options.chunk_counts = device->chunk_counts;
+  profiler_trace_begin( "expand" );
+  cpu_lines__expand( device, &options, data, n_elems, quad_buf, &quad_buf_len, quad_buf_cap,
+                     mvp_mat, viewport_size, aa_radius );
+  profiler_trace_end();
   
-  // Copy data to gpu
-  glNamedBufferSubData( device->vbo, 0, quad_buf_len * sizeof(cpu_lines_vertex_t), device->quad_buf );
+  // Copy data to gpu, unless it was written to mapped memory already
+  if( device->zero_copy )
+  {
+    gl_utils_stream_buffer_commit( &device->stream, quad_buf_len * device->vertex_size );
+    device->first_vertex = (GLint)(offset / device->vertex_size);
+  }
+  else
+  {
+    profiler_trace_begin( "upload" );
+    glNamedBufferSubData( device->vbo, 0, quad_buf_len * device->vertex_size, device->quad_buf );
+    profiler_trace_end();
+  }
+  device->mem_stats.uploaded_bytes = quad_buf_len * device->vertex_size;
+  device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
+
+  if( device->cache ) { memcpy( device->shadow_buf, data, n_elems * sizeof(vertex_t) ); }
+  device->expanded_len = n_elems;
+  device->expansion_valid = true;
+  device->expanded_quad_buf_len = quad_buf_len;
   
   return quad_buf_len;
 }
 
-void
-cpu_lines_render( const void* device_in, const int32_t count )
+uint32_t
+cpu_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                  uniform_data_t* uniform_data )
+{
+  return cpu_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+cpu_lines_memory_stats( const void* device_in )
 {
   const cpu_lines_device_t* device = device_in;
+  return device->mem_stats;
+}
+
+static void
+cpu_lines__draw_quads( const cpu_lines_device_t* device, GLint first_vertex, uint32_t count )
+{
+  if( device->indexed )
+  {
+    // 'count' is the number of vertices, 4 per quad.
+    uint32_t n_quads = count / 4;
+    for( uint32_t first = 0; first < n_quads; first += CPU_LINES_INDEX_BATCH_QUADS )
+    {
+      uint32_t n_batch = msh_min( n_quads - first, (uint32_t)CPU_LINES_INDEX_BATCH_QUADS );
+      glDrawElementsBaseVertex( GL_TRIANGLES, 6 * n_batch, GL_UNSIGNED_SHORT, NULL, first_vertex + 4 * first );
+    }
+  }
+  else
+  {
+    glDrawArrays( GL_TRIANGLES, first_vertex, count );
+  }
+}
+
+// Expands and draws one chunk at a time. Draws are queued, so the GPU works on a chunk while the next one is being
+// expanded; reserving a region only waits when the chunk that last used it is still being drawn. The expansion of
+// each chunk is traced as an "update", so that it is not counted as drawing.
+static void
+cpu_lines__render_streaming( cpu_lines_device_t* device )
+{
+  const uniform_data_t* uniform_data = device->uniform_data;
+  msh_mat4_t mvp_mat;       memcpy( mvp_mat.data, uniform_data->mvp, 16 * sizeof(float) );
+  msh_vec2_t viewport_size; memcpy( viewport_size.data, uniform_data->viewport, 2 * sizeof(float) );
+  msh_vec2_t aa_radius;     memcpy( aa_radius.data, uniform_data->aa_radius, 2 * sizeof(float) );
+  cpu_lines_expand_options_t options = { .kernel = CPU_LINES_KERNEL_AUTO, .indexed = device->indexed,
+                                         .cull = device->cull, .scratch = &device->expand_scratch };
+
+  uint32_t n_quad_vertices = device->indexed ? 4 : 6;
+  uint32_t n_segments = (uint32_t)device->stream_len / 2;
+  for( uint32_t first = 0; first < n_segments; first += device->stream_segments )
+  {
+    uint32_t count = msh_min( n_segments - first, device->stream_segments );
+    uint32_t quad_buf_cap = n_quad_vertices * count + 1;
+    size_t offset = 0;
+    uint64_t n_stalls = device->stream.n_stalls;
+    profiler_trace_begin( "update" );
+    profiler_trace_begin( "wait" );
+    void* quad_buf = gl_utils_stream_buffer_reserve( &device->stream, quad_buf_cap * device->vertex_size,
+                                                     device->vertex_size, &offset );
+    profiler_trace_end();
+    device->mem_stats.stalls += device->stream.n_stalls - n_stalls;
+    device->mem_stats.total_stalls += device->stream.n_stalls - n_stalls;
+
+    uint32_t quad_buf_len = 0;
+    profiler_trace_begin( "expand" );
+    cpu_lines__expand( device, &options, device->stream_data + 2 * first, 2 * count, quad_buf, &quad_buf_len,
+                       quad_buf_cap, mvp_mat, viewport_size, aa_radius );
+    profiler_trace_end();
+    gl_utils_stream_buffer_commit( &device->stream, quad_buf_len * device->vertex_size );
+    profiler_trace_end();
+
+    cpu_lines__draw_quads( device, (GLint)(offset / device->vertex_size), quad_buf_len );
+    device->mem_stats.uploaded_bytes += quad_buf_len * device->vertex_size;
+    device->mem_stats.total_uploaded_bytes += quad_buf_len * device->vertex_size;
+  }
+}
+
+void
+cpu_lines_render( void* device_in, const int32_t count )
+{
+  cpu_lines_device_t* device = device_in;
 
   glUseProgram( device->program_id );
   glUniform2fv( device->uniforms.aa_radius, 1, device->uniform_data->aa_radius );
 
   glBindVertexArray( device->vao );
-  glDrawArrays( GL_TRIANGLES, 0, count );
+  if( device->stream_segments )
+  {
+    cpu_lines__render_streaming( device );
+  }
+  else
+  {
+    cpu_lines__draw_quads( device, device->first_vertex, count );
+  }
 
   glBindVertexArray( 0 );
   glUseProgram( 0 );
@@ -0,0 +1,330 @@
+#define MSH_STD_INCLUDE_LIBC_HEADERS
+#define MSH_STD_IMPLEMENTATION
+#define MSH_ARGPARSE_IMPLEMENTATION
+#define MSH_VEC_MATH_IMPLEMENTATION
+
+#include "extern/msh_std.h"
+#include "extern/msh_argparse.h"
+#include "extern/msh_vec_math.h"
+
+#include "lines_common.h"
+
+#define WORKER_POOL_IMPLEMENTATION
+#include "worker_pool.h"
+
+#define CPU_LINES_EXPAND_IMPLEMENTATION
+#include "cpu_lines_expand.h"
+
+#define WORKLOAD_IMPLEMENTATION
+#include "workload.h"
+
+// Microbenchmark of the cpu line expansion kernel, independent of any driver. For each segment count, line width and
+// projection we time the expansion with cold caches (a large scratch buffer is written between the runs, so that
+// neither the input nor the output are cached) and with warm caches (the same input expanded back to back), and report
+// the median throughput. Every kernel supported by the cpu is measured, and the output of the vectorized ones is checked
+// against the scalar kernel. Each kernel runs single-threaded, and again split over a worker pool when more than one
+// thread is available. With --compact the packed vertex format is measured instead, comparing only the positions, and
+// with --indexed the 4 vertex per segment output used with an index buffer. --cull adds the view culling pass; all
+// generated segments are on screen, so this measures the cost of the test alone, unless --zoom magnifies the view so that
+// most of them fall outside of it.
+
+#define N_WIDTHS 3
+#define N_TRANSFORMS 2
+
+static const float bench_widths[N_WIDTHS] = { 1.0f, 4.0f, 16.0f };
+static const char* bench_transform_names[N_TRANSFORMS] = { "ortho", "perspective" };
+
+typedef struct bench_result
+{
+    uint32_t n_segments;
+    float width;
+    const char* transform;
+    cpu_lines_kernel_t kernel;
+    int32_t n_threads;
+    double max_difference;
+    double cold_ms;
+    double warm_ms;
+} bench_result_t;
+
+static int
+compare_doubles( const void* a, const void* b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double
+median( double* values, int32_t n_values )
+{
+    qsort( values, n_values, sizeof(double), compare_doubles );
+    return values[n_values / 2];
+}
+
+static void
+evict_caches( uint8_t* scratch, size_t scratch_size )
+{
+    // Write every cache line, so that whatever was cached before gets evicted.
+    for( size_t i = 0; i < scratch_size; i += 64 ) { scratch[i] += 1; }
+}
+
+// Largest difference between two expansions, relative to the magnitude of the scalar result.
+static double
+max_difference( const cpu_lines_vertex_t* reference, const cpu_lines_vertex_t* quad_buf, uint32_t quad_buf_len )
+{
+    const float* a = (const float*)reference;
+    const float* b = (const float*)quad_buf;
+    size_t n_floats = (size_t)quad_buf_len * sizeof(cpu_lines_vertex_t) / sizeof(float);
+    double result = 0.0;
+    for( size_t i = 0; i < n_floats; ++i )
+    {
+        result = msh_max( result, fabs( (double)a[i] - b[i] ) / msh_max( fabs( (double)a[i] ), 1.0 ) );
+    }
+    return result;
+}
+
+static double
+max_compact_difference( const cpu_lines_compact_vertex_t* reference, const cpu_lines_compact_vertex_t* quad_buf,
+                        uint32_t quad_buf_len )
+{
+    double result = 0.0;
+    for( uint32_t i = 0; i < quad_buf_len; ++i )
+    {
+        for( int32_t k = 0; k < 2; ++k )
+        {
+            double a = reference[i].ndc_pos.data[k], b = quad_buf[i].ndc_pos.data[k];
+            result = msh_max( result, fabs( a - b ) / msh_max( fabs( a ), 1.0 ) );
+        }
+    }
+    return result;
+}
+
+static void
+expand( worker_pool_t* pool, const cpu_lines_expand_options_t* options, bool compact,
+        const vertex_t* line_buf, uint32_t line_buf_len,
+        void* quad_buf, uint32_t* quad_buf_len, uint32_t quad_buf_cap,
+        msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+    if( compact )
+    {
+        cpu_lines_expand_compact_parallel( pool, options, line_buf, line_buf_len, quad_buf, quad_buf_len,
+                                           quad_buf_cap, mvp, viewport_size, aa_radius );
+    }
+    else
+    {
+        cpu_lines_expand_parallel( pool, options, line_buf, line_buf_len, quad_buf, quad_buf_len, quad_buf_cap,
+                                   mvp, viewport_size, aa_radius );
+    }
+}
+
+static double
+time_expand( worker_pool_t* pool, const cpu_lines_expand_options_t* options, bool compact, const vertex_t* line_buf,
+             uint32_t line_buf_len, void* quad_buf, uint32_t quad_buf_cap,
+             msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+    uint32_t quad_buf_len = 0;
+    uint64_t t1 = msh_time_now();
+    expand( pool, options, compact, line_buf, line_buf_len, quad_buf, &quad_buf_len, quad_buf_cap,
+            mvp, viewport_size, aa_radius );
+    uint64_t t2 = msh_time_now();
+    return msh_time_diff_ms( t2, t1 );
+}
+
+int32_t
+main( int32_t argc, char** argv )
+{
+    uint32_t min_segments = 1000;
+    uint32_t max_segments = 1000000;
+    uint32_t seed = 1;
+    int32_t n_repeats = 15;
+    int32_t viewport[2] = { 1024, 512 };
+    int32_t cache_flush_mib = 64;
+    int32_t n_threads = 0;
+    bool compact = false;
+    bool indexed = false;
+    bool cull = false;
+    float zoom = 1.0f;
+    char* output_filename = NULL;
+
+    msh_argparse_t parser = {0};
+    msh_ap_init( &parser, "cpu_lines_bench", "Throughput of the cpu line expansion kernel, with cold and warm caches" );
+    msh_ap_add_unsigned_int_argument( &parser, "--min_segments", NULL, "Smallest segment count; counts grow 10x up to --max_segments", &min_segments, 1 );
+    msh_ap_add_unsigned_int_argument( &parser, "--max_segments", NULL, "Largest segment count", &max_segments, 1 );
+    msh_ap_add_unsigned_int_argument( &parser, "--seed", NULL, "Seed of the random segments", &seed, 1 );
+    msh_ap_add_int_argument( &parser, "--repeats", NULL, "Number of timed runs per configuration", &n_repeats, 1 );
+    msh_ap_add_int_argument( &parser, "--viewport", NULL, "Viewport size in pixels", &viewport[0], 2 );
+    msh_ap_add_int_argument( &parser, "--cache_flush_mib", NULL, "Size of the buffer written to evict the caches", &cache_flush_mib, 1 );
+    msh_ap_add_int_argument( &parser, "--threads", NULL, "Threads of the multithreaded runs (0 uses all cores)", &n_threads, 1 );
+    msh_ap_add_bool_argument( &parser, "--compact", NULL, "Measure the compact vertex format", &compact, 0 );
+    msh_ap_add_bool_argument( &parser, "--indexed", NULL, "Measure the 4 vertex per segment output of indexed drawing", &indexed, 0 );
+    msh_ap_add_bool_argument( &parser, "--cull", NULL, "Cull segments outside of the view before expanding", &cull, 0 );
+    msh_ap_add_float_argument( &parser, "--zoom", NULL, "Magnification of the view around its center", &zoom, 1 );
+    msh_ap_add_string_argument( &parser, "--output", "-o", "Write results as csv", &output_filename, 1 );
+    if( !msh_ap_parse( &parser, argc, argv ) )
+    {
+        return EXIT_FAILURE;
+    }
+    if( !min_segments || min_segments > max_segments || n_repeats < 1 || zoom <= 0.0f )
+    {
+        fprintf( stderr, "[Bench] Invalid segment range, repeat count or zoom\n" );
+        return EXIT_FAILURE;
+    }
+
+    msh_vec2_t viewport_size = msh_vec2( viewport[0], viewport[1] );
+    msh_vec2_t aa_radius = msh_vec2( 2.0f, 2.0f );
+    float aspect_ratio = viewport_size.x / viewport_size.y;
+
+    // Same view as the demo application - camera at distance 6 looking at the z = 0 plane, and an orthographic
+    // projection covering roughly the same region of that plane.
+    float eye_distance = 6.0f;
+    msh_mat4_t view = msh_look_at( msh_vec3( 0.0f, 0.0f, eye_distance ), msh_vec3_zeros(), msh_vec3_posy() );
+    msh_mat4_t proj[N_TRANSFORMS];
+    float half_height = eye_distance * tanf( msh_deg2rad( 30.0f ) );
+    proj[0] = msh_ortho( -half_height * aspect_ratio, half_height * aspect_ratio, -half_height, half_height, 0.01f, 100.0f );
+    proj[1] = msh_perspective( msh_deg2rad( 60.0f ), aspect_ratio, 0.01f, 100.0f );
+    msh_mat4_t zoom_mat = msh_mat4_identity();
+    zoom_mat.data[0] = zoom_mat.data[5] = zoom;
+
+    uint32_t line_buf_cap = 2 * max_segments;
+    uint32_t quad_buf_cap = 3 * line_buf_cap + 1;
+    vertex_t* line_buf = malloc( line_buf_cap * sizeof(vertex_t) );
+    size_t vertex_size = compact ? sizeof(cpu_lines_compact_vertex_t) : sizeof(cpu_lines_vertex_t);
+    size_t vertices_per_segment = indexed ? 4 : 6;
+    void* quad_buf = malloc( quad_buf_cap * vertex_size );
+    void* reference_buf = malloc( quad_buf_cap * vertex_size );
+    size_t scratch_size = (size_t)cache_flush_mib * 1024 * 1024;
+    uint8_t* scratch = calloc( scratch_size, 1 );
+    double* samples = malloc( n_repeats * sizeof(double) );
+    if( !line_buf || !quad_buf || !reference_buf || !scratch || !samples )
+    {
+        fprintf( stderr, "[Bench] Failed to allocate buffers for %u segments\n", max_segments );
+        return EXIT_FAILURE;
+    }
+
+    // Single-threaded runs go without a pool.
+    worker_pool_t* pools[2] = { NULL, worker_pool_create( n_threads ) };
+    int32_t n_pools = worker_pool_thread_count( pools[1] ) > 1 ? 2 : 1;
+    // Kept across runs, as the engine keeps it across frames.
+    cpu_lines_expand_scratch_t expand_scratch = {0};
+
+    int32_t n_results = 0;
+    bench_result_t* results = NULL;
+    for( uint64_t n = min_segments; n <= max_segments; n *= 10 ) { n_results++; }
+    n_results *= N_WIDTHS * N_TRANSFORMS * (CPU_LINES_N_KERNELS - 1) * n_pools;
+    results = calloc( n_results, sizeof(bench_result_t) );
+
+    printf( "Best kernel: %s\n", cpu_lines_kernel_names[cpu_lines_best_kernel()] );
+    printf( "%-12s %6s %-12s %-8s %7s %12s %12s %12s %12s %12s\n", "Segments", "Width", "Transform", "Kernel", "Threads",
+            "Cold [Mseg/s]", "Cold [GB/s]", "Warm [Mseg/s]", "Warm [GB/s]", "Max diff" );
+    int32_t result_idx = 0;
+    for( uint64_t segment_count = min_segments; segment_count <= max_segments; segment_count *= 10 )
+    {
+        uint32_t n_segments = (uint32_t)segment_count;
+        for( int32_t width_idx = 0; width_idx < N_WIDTHS; ++width_idx )
+        {
+            for( int32_t transform_idx = 0; transform_idx < N_TRANSFORMS; ++transform_idx )
+            {
+                msh_mat4_t mvp = msh_mat4_mul( zoom_mat, msh_mat4_mul( proj[transform_idx], view ) );
+
+                workload_desc_t workload =
+                {
+                    .n_segments = n_segments,
+                    .seed = seed,
+                    .length = { WORKLOAD_DIST_UNIFORM, 5.0f, 50.0f },
+                    .width = { WORKLOAD_DIST_CONSTANT, bench_widths[width_idx], 0.0f },
+                    .coverage = 1.0f,
+                    .view_half_extent = msh_vec2( half_height * aspect_ratio, half_height ),
+                    .viewport_size = viewport_size
+                };
+                uint32_t line_buf_len = 0;
+                workload_generate( &workload, line_buf, &line_buf_len, line_buf_cap );
+
+                uint32_t reference_len = 0;
+                cpu_lines_expand_options_t reference_options = { .kernel = CPU_LINES_KERNEL_SCALAR, .indexed = indexed,
+                                                                  .cull = cull };
+                expand( NULL, &reference_options, compact, line_buf, line_buf_len,
+                        reference_buf, &reference_len, quad_buf_cap, mvp, viewport_size, aa_radius );
+
+                for( int32_t kernel_idx = CPU_LINES_KERNEL_SCALAR; kernel_idx < CPU_LINES_N_KERNELS; ++kernel_idx )
+                {
+                    cpu_lines_kernel_t kernel = (cpu_lines_kernel_t)kernel_idx;
+                    if( !cpu_lines_kernel_supported( kernel ) ) { continue; }
+                    cpu_lines_expand_options_t options = { .kernel = kernel, .indexed = indexed, .cull = cull,
+                                                           .scratch = &expand_scratch };
+
+                    for( int32_t pool_idx = 0; pool_idx < n_pools; ++pool_idx )
+                    {
+                        worker_pool_t* pool = pools[pool_idx];
+
+                        for( int32_t i = 0; i < n_repeats; ++i )
+                        {
+                            evict_caches( scratch, scratch_size );
+                            samples[i] = time_expand( pool, &options, compact, line_buf, line_buf_len,
+                                                      quad_buf, quad_buf_cap, mvp, viewport_size, aa_radius );
+                        }
+                        double cold_ms = median( samples, n_repeats );
+
+                        time_expand( pool, &options, compact, line_buf, line_buf_len,
+                                     quad_buf, quad_buf_cap, mvp, viewport_size, aa_radius );
+                        for( int32_t i = 0; i < n_repeats; ++i )
+                        {
+                            samples[i] = time_expand( pool, &options, compact, line_buf, line_buf_len,
+                                                      quad_buf, quad_buf_cap, mvp, viewport_size, aa_radius );
+                        }
+                        double warm_ms = median( samples, n_repeats );
+                        double difference = compact ? max_compact_difference( reference_buf, quad_buf, reference_len )
+                                                    : max_difference( reference_buf, quad_buf, reference_len );
+
+                        // Bytes moved per segment - two input vertices read, four or six output vertices written.
+                        double bytes = (double)n_segments * (2 * sizeof(vertex_t) + vertices_per_segment * vertex_size);
+                        double cold_s = msh_max( cold_ms, 1e-6 ) * 1e-3;
+                        double warm_s = msh_max( warm_ms, 1e-6 ) * 1e-3;
+                        printf( "%-12u %6.1f %-12s %-8s %7d %12.2f %12.2f %12.2f %12.2f %12.2e\n", n_segments,
+                                bench_widths[width_idx], bench_transform_names[transform_idx], cpu_lines_kernel_names[kernel],
+                                worker_pool_thread_count( pool ), n_segments / cold_s * 1e-6, bytes / cold_s * 1e-9,
+                                n_segments / warm_s * 1e-6, bytes / warm_s * 1e-9, difference );
+
+                        results[result_idx++] = (bench_result_t){ .n_segments = n_segments, .width = bench_widths[width_idx],
+                                                                  .transform = bench_transform_names[transform_idx],
+                                                                  .kernel = kernel,
+                                                                  .n_threads = worker_pool_thread_count( pool ),
+                                                                  .max_difference = difference,
+                                                                  .cold_ms = cold_ms, .warm_ms = warm_ms };
+                    }
+                }
+            }
+        }
+    }
+
+    int32_t exit_code = EXIT_SUCCESS;
+    if( output_filename )
+    {
+        FILE* fp = fopen( output_filename, "w" );
+        if( fp )
+        {
+            fprintf( fp, "segments,width,transform,kernel,threads,cold_ms,warm_ms,bytes_per_segment,max_difference\n" );
+            for( int32_t i = 0; i < result_idx; ++i )
+            {
+                fprintf( fp, "%u,%.1f,%s,%s,%d,%.6f,%.6f,%zu,%g\n", results[i].n_segments, results[i].width,
+                         results[i].transform, cpu_lines_kernel_names[results[i].kernel], results[i].n_threads,
+                         results[i].cold_ms, results[i].warm_ms,
+                         2 * sizeof(vertex_t) + vertices_per_segment * vertex_size, results[i].max_difference );
+            }
+            fclose( fp );
+        }
+        else
+        {
+            fprintf( stderr, "[Bench] Failed to open %s for writing\n", output_filename );
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    worker_pool_destroy( &pools[1] );
+    cpu_lines_expand_scratch_term( &expand_scratch );
+    free( results );
+    free( samples );
+    free( scratch );
+    free( reference_buf );
+    free( quad_buf );
+    free( line_buf );
+    return exit_code;
+}
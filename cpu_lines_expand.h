@@ -0,0 +1,1131 @@
+#ifndef CPU_LINES_EXPAND_H
+#define CPU_LINES_EXPAND_H
+
+// Expansion of line segments into screen-aligned quads, used by cpu_lines.h. Kept apart from the engine itself,
+// so that it can be built and measured without an OpenGL context (see cpu_lines_bench.c).
+//
+// Besides the scalar reference kernel, on x86 there are SSE (4 segments per iteration) and AVX2 (8 segments) kernels.
+// cpu_lines_expand() picks the widest one the cpu supports at runtime. The vector kernels gather endpoints into
+// SoA registers, normalize with rsqrt refined by a Newton-Raphson step, and scatter the results back into the
+// interleaved vertex layout; they match the scalar kernel up to rounding.
+
+// NOTE(maciej): We need a fatter vertices to communicate all required info. 
+//               It is possible to pack this info more tightly and then unpack on shader side, but this is a reference 
+//               implementation, so we don't care if we sacrifice performance for clarity.
+typedef struct cpu_lines_vertex
+{
+  msh_vec4_t clip_pos;
+  msh_vec4_t col;
+  msh_vec4_t line_params;
+} cpu_lines_vertex_t;
+
+// Packed alternative to cpu_lines_vertex_t, half the size. The position is stored after the perspective divide, so
+// that x and y keep full precision while z and w can go to half floats - w only matters for clipping and
+// perspective-correct interpolation, and z only for clipping, as depth testing is off. Colors are RGBA8, line params
+// half floats.
+typedef struct cpu_lines_compact_vertex
+{
+  msh_vec2_t ndc_pos;
+  uint16_t clip_zw[2];
+  uint8_t col[4];
+  uint16_t line_params[4];
+} cpu_lines_compact_vertex_t;
+
+typedef enum cpu_lines_kernel
+{
+  CPU_LINES_KERNEL_AUTO,
+  CPU_LINES_KERNEL_SCALAR,
+  CPU_LINES_KERNEL_SSE,
+  CPU_LINES_KERNEL_AVX2,
+  CPU_LINES_N_KERNELS
+} cpu_lines_kernel_t;
+
+extern const char* cpu_lines_kernel_names[CPU_LINES_N_KERNELS];
+
+// Segments expanded by one task of cpu_lines_expand_parallel(). 1024 segments produce 288 KiB of vertices, which fits
+// in the L2 cache of most cores. Multiple of 8, so that only the last chunk runs the narrower tail of a vector kernel.
+#ifndef CPU_LINES_EXPAND_CHUNK_SEGMENTS
+#define CPU_LINES_EXPAND_CHUNK_SEGMENTS 1024
+#endif
+
+void cpu_lines_expand( const vertex_t* line_buf, uint32_t line_buf_len,
+                       cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
+                       msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius );
+void cpu_lines_expand_kernel( cpu_lines_kernel_t kernel, const vertex_t* line_buf, uint32_t line_buf_len,
+                              cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
+                              msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius );
+// Working memory of culling - an output offset per chunk and a visibility state per segment. Callers that expand
+// every frame keep one, so that it is only reallocated when the input outgrows it. Zero-initialized before first use;
+// cpu_lines_expand_scratch_term() frees it.
+typedef struct cpu_lines_expand_scratch
+{
+  uint32_t* chunk_offsets;
+  uint8_t* visibility;
+  uint32_t chunk_offsets_cap;
+  uint32_t visibility_cap;
+} cpu_lines_expand_scratch_t;
+
+void cpu_lines_expand_scratch_term( cpu_lines_expand_scratch_t* scratch );
+
+typedef struct cpu_lines_expand_options
+{
+  cpu_lines_kernel_t kernel;
+  // Each segment produces its 4 corners (a0, a1, b0, b1) once, to be drawn as triangles (0, 1, 2) and (1, 2, 3),
+  // instead of 6 vertices of two triangles.
+  bool indexed;
+  // Skip segments outside of the view frustum, and clip the ones crossing the near plane before expanding them.
+  // The output then holds only the visible segments, in input order.
+  bool cull;
+  // Optional; receives the number of segments written for each chunk of CPU_LINES_EXPAND_CHUNK_SEGMENTS input
+  // segments, so that callers can locate the output of a part of the input and expand it again later.
+  uint32_t* chunk_counts;
+  // Optional; without it, culling allocates its working memory on every call.
+  cpu_lines_expand_scratch_t* scratch;
+} cpu_lines_expand_options_t;
+
+// Splits the segments into chunks expanded by the pool's threads; returns once all of them are done. Requires
+// worker_pool.h; a NULL pool expands on the calling thread, and NULL options select the best kernel and nothing else.
+void cpu_lines_expand_parallel( worker_pool_t* pool, const cpu_lines_expand_options_t* options,
+                                const vertex_t* line_buf, uint32_t line_buf_len,
+                                cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len,
+                                uint32_t quad_buf_cap, msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius );
+void cpu_lines_expand_compact_parallel( worker_pool_t* pool, const cpu_lines_expand_options_t* options,
+                                        const vertex_t* line_buf, uint32_t line_buf_len,
+                                        cpu_lines_compact_vertex_t* quad_buf, uint32_t *quad_buf_len,
+                                        uint32_t quad_buf_cap, msh_mat4_t mvp, msh_vec2_t viewport_size,
+                                        msh_vec2_t aa_radius );
+int32_t cpu_lines_kernel_supported( cpu_lines_kernel_t kernel );
+cpu_lines_kernel_t cpu_lines_best_kernel( void );
+
+#endif /* CPU_LINES_EXPAND_H */
+
+#ifdef CPU_LINES_EXPAND_IMPLEMENTATION
+
+// Kernels are written once with an 'affine' flag, and instantiated for both values through forced inlining.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define CPU_LINES_FORCE_INLINE __forceinline
+#else
+#define CPU_LINES_FORCE_INLINE __attribute__((always_inline)) inline
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_LINES_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CPU_LINES_TARGET_AVX2
+#else
+#define CPU_LINES_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#endif
+#endif
+
+const char* cpu_lines_kernel_names[CPU_LINES_N_KERNELS] = { "auto", "scalar", "sse", "avx2" };
+
+// Where each of the 4 distinct corners of a quad (0 - a0, 1 - a1, 2 - b0, 3 - b1) goes in the output. Triangles
+// repeat a1 and b0 - a0, a1, b0, a1, b0, b1; indexed quads store every corner once.
+typedef struct cpu_lines__quad_layout
+{
+  uint32_t n_vertices;
+  int32_t slots[4][2];
+} cpu_lines__quad_layout_t;
+
+static const cpu_lines__quad_layout_t cpu_lines__triangles_layout = { 6, { { 0, -1 }, { 1, 3 }, { 2, 4 }, { 5, -1 } } };
+static const cpu_lines__quad_layout_t cpu_lines__indexed_layout   = { 4, { { 0, -1 }, { 1, -1 }, { 2, -1 }, { 3, -1 } } };
+
+// Orthographic projections, and affine transforms in general, leave w at 1. The kernels then skip the last row of the
+// transform, the perspective divide and the multiplication by w that reverts it.
+static inline int32_t
+cpu_lines__is_affine( const msh_mat4_t* mvp )
+{
+  const float* m = mvp->data;
+  return m[3] == 0.0f && m[7] == 0.0f && m[11] == 0.0f && m[15] == 1.0f;
+}
+
+// Same as msh_mat4_vec4_mul with w = 1, which is not inlined and would copy the matrix for every endpoint.
+static inline msh_vec4_t
+cpu_lines__transform_point( const float* m, msh_vec3_t p, const int32_t affine )
+{
+  return msh_vec4( m[0] * p.x + m[4] * p.y + m[ 8] * p.z + m[12],
+                   m[1] * p.x + m[5] * p.y + m[ 9] * p.z + m[13],
+                   m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14],
+                   affine ? 1.0f : m[3] * p.x + m[7] * p.y + m[11] * p.z + m[15] );
+}
+
+static CPU_LINES_FORCE_INLINE void
+cpu_lines__expand_segment( const vertex_t* src_v0, cpu_lines_vertex_t* dst, const cpu_lines__quad_layout_t* layout,
+                           msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius, const int32_t affine )
+{
+  const vertex_t* src_v1 = src_v0 + 1;
+  float width = viewport_size.x;
+  float height = viewport_size.y;
+  float aspect_ratio = height / width;
+
+  // Move vertices from model space to clip space
+  msh_vec4_t clip_a0 = cpu_lines__transform_point( mvp.data, src_v0->pos, affine );
+  msh_vec4_t clip_b0 = cpu_lines__transform_point( mvp.data, src_v1->pos, affine );
+  msh_vec4_t clip_a1;
+  msh_vec4_t clip_b1;
+
+  // Perspective divide to create vertex location in normalized device coordinates. With affine transforms w is the
+  // constant 1, and the multiplications by w below fold away as well.
+  msh_vec2_t ndc_a = affine ? msh_vec2(clip_a0.x, clip_a0.y)
+                            : msh_vec2_scalar_div( msh_vec2(clip_a0.x, clip_a0.y), clip_a0.w );
+  msh_vec2_t ndc_b = affine ? msh_vec2(clip_b0.x, clip_b0.y)
+                            : msh_vec2_scalar_div( msh_vec2(clip_b0.x, clip_b0.y), clip_b0.w );
+
+  // Calculate the line vector in viewport space, as well as the direction of the line (corrected for aspect ratio)
+  msh_vec2_t line_vector = msh_vec2_sub( ndc_b, ndc_a );
+  msh_vec2_t viewport_line_vector = msh_vec2_mul( line_vector, viewport_size );
+  msh_vec2_t dir = msh_vec2_normalize( msh_vec2( line_vector.x, line_vector.y * aspect_ratio ) );
+
+  // Calculate vectors modifying the vertex positions in 
+  float      extension_length = aa_radius.y;
+  float      line_width_a     = msh_max( 1.0f, src_v0->width ) + aa_radius.x;
+  float      line_width_b     = msh_max( 1.0f, src_v1->width ) + aa_radius.x;
+  float      line_length      = msh_vec2_norm( viewport_line_vector ) + 2.0f * extension_length;
+  msh_vec2_t normal           = msh_vec2( -dir.y, dir.x );
+  msh_vec2_t normal_a         = msh_vec2_mul( msh_vec2( line_width_a / width, line_width_a / height), normal );
+  msh_vec2_t normal_b         = msh_vec2_mul( msh_vec2( line_width_b / width, line_width_b / height), normal );
+  msh_vec2_t extension        = msh_vec2_mul( msh_vec2( extension_length / width, extension_length / height), dir );
+
+  // Calculate the four corners of a quad in clip space (revert w division after adding correct vectors to input position)
+  clip_a1 = msh_vec4( (ndc_a.x - normal_a.x - extension.x) * clip_a0.w,
+                      (ndc_a.y - normal_a.y - extension.y) * clip_a0.w,
+                      clip_a0.z,
+                      clip_a0.w );
+  clip_a0 = msh_vec4( (ndc_a.x + normal_a.x - extension.x) * clip_a0.w,
+                      (ndc_a.y + normal_a.y - extension.y) * clip_a0.w,
+                      clip_a0.z,
+                      clip_a0.w );
+
+  clip_b1 = msh_vec4( (ndc_b.x - normal_b.x + extension.x) * clip_b0.w,
+                      (ndc_b.y - normal_b.y + extension.y) * clip_b0.w,
+                      clip_b0.z,
+                      clip_b0.w );
+  clip_b0 = msh_vec4( (ndc_b.x + normal_b.x + extension.x) * clip_b0.w,
+                      (ndc_b.y + normal_b.y + extension.y) * clip_b0.w,
+                      clip_b0.z,
+                      clip_b0.w );
+
+  // Adjust colors in case line width is smaller than 1 pixels, to simulate a partial coverage.
+  float alpha_a = msh_min( src_v0->col.w * src_v0->width, 1.0f );
+  float alpha_b = msh_min( src_v0->col.w * src_v1->width, 1.0f );
+
+  // Communicate the new data to the buffer - either as 2 triangles, or as 4 corners drawn with an index buffer.
+  // Note the additional "line_params" attribute that communicates the correct data to the glsl program
+  cpu_lines_vertex_t corners[4];
+  corners[0].clip_pos = clip_a0;
+  corners[0].col = msh_vec4( src_v0->col.x, src_v0->col.y, src_v0->col.z, alpha_a );
+  corners[0].line_params = msh_vec4( -line_width_a, -0.5*line_length, line_width_a, 0.5*line_length );
+
+  corners[1].clip_pos = clip_a1;
+  corners[1].col = msh_vec4( src_v0->col.x, src_v0->col.y, src_v0->col.z, alpha_a );
+  corners[1].line_params = msh_vec4( line_width_a, -0.5*line_length, line_width_a, 0.5*line_length );
+
+  corners[2].clip_pos = clip_b0;
+  corners[2].col = msh_vec4( src_v1->col.x, src_v1->col.x, src_v1->col.z, alpha_b );
+  corners[2].line_params = msh_vec4( -line_width_b, 0.5*line_length, line_width_b, 0.5*line_length );
+
+  corners[3].clip_pos = clip_b1;
+  corners[3].col = msh_vec4( src_v1->col.x, src_v1->col.x, src_v1->col.z, alpha_b );
+  corners[3].line_params = msh_vec4( line_width_b, 0.5*line_length, line_width_b, 0.5*line_length );
+
+  for( int32_t v = 0; v < 4; ++v )
+  {
+    for( int32_t s = 0; s < 2; ++s )
+    {
+      int32_t slot = layout->slots[v][s];
+      if( slot >= 0 ) { dst[slot] = corners[v]; }
+    }
+  }
+}
+
+static CPU_LINES_FORCE_INLINE void
+cpu_lines__expand_scalar_impl( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                               const cpu_lines__quad_layout_t* layout,
+                               msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius, const int32_t affine )
+{
+  for( uint32_t i = 0; i < n_segments; ++i )
+  {
+    cpu_lines__expand_segment( line_buf + 2 * i, quad_buf + layout->n_vertices * i, layout,
+                               mvp, viewport_size, aa_radius, affine );
+  }
+}
+
+static void
+cpu_lines__expand_scalar( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                          const cpu_lines__quad_layout_t* layout,
+                          msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius, int32_t affine )
+{
+  if( affine ) { cpu_lines__expand_scalar_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 1 ); }
+  else         { cpu_lines__expand_scalar_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 0 ); }
+}
+
+#ifdef CPU_LINES_X86
+
+// Loads 4 segments, transposing them so that each register holds a single component of 4 endpoints.
+// Components are x, y, z, width of the positions and r, g, b, a of the colors.
+static inline void
+cpu_lines__sse_load_segments( const vertex_t* src, __m128 a_pos[4], __m128 a_col[4], __m128 b_pos[4], __m128 b_col[4] )
+{
+  for( int32_t k = 0; k < 4; ++k )
+  {
+    const float* a = (const float*)(src + 2 * k);
+    const float* b = (const float*)(src + 2 * k + 1);
+    a_pos[k] = _mm_loadu_ps( a );
+    a_col[k] = _mm_loadu_ps( a + 4 );
+    b_pos[k] = _mm_loadu_ps( b );
+    b_col[k] = _mm_loadu_ps( b + 4 );
+  }
+  _MM_TRANSPOSE4_PS( a_pos[0], a_pos[1], a_pos[2], a_pos[3] );
+  _MM_TRANSPOSE4_PS( a_col[0], a_col[1], a_col[2], a_col[3] );
+  _MM_TRANSPOSE4_PS( b_pos[0], b_pos[1], b_pos[2], b_pos[3] );
+  _MM_TRANSPOSE4_PS( b_col[0], b_col[1], b_col[2], b_col[3] );
+}
+
+// Writes one of the 4 distinct corners of 4 quads from SoA registers into every slot it occupies.
+static inline void
+cpu_lines__sse_store_vertex( int32_t v, __m128 clip[4], __m128 col[4], __m128 params[4], cpu_lines_vertex_t* dst,
+                             const cpu_lines__quad_layout_t* layout )
+{
+  _MM_TRANSPOSE4_PS( clip[0], clip[1], clip[2], clip[3] );
+  _MM_TRANSPOSE4_PS( col[0], col[1], col[2], col[3] );
+  _MM_TRANSPOSE4_PS( params[0], params[1], params[2], params[3] );
+  for( int32_t k = 0; k < 4; ++k )
+  {
+    for( int32_t s = 0; s < 2; ++s )
+    {
+      int32_t slot = layout->slots[v][s];
+      if( slot < 0 ) { continue; }
+      float* out = (float*)(dst + layout->n_vertices * k + slot);
+      _mm_storeu_ps( out,     clip[k] );
+      _mm_storeu_ps( out + 4, col[k] );
+      _mm_storeu_ps( out + 8, params[k] );
+    }
+  }
+}
+
+static inline __m128
+cpu_lines__sse_transform( const float* m, int32_t row, __m128 x, __m128 y, __m128 z )
+{
+  return _mm_add_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[row] ), x ), _mm_mul_ps( _mm_set1_ps( m[4 + row] ), y ) ),
+                     _mm_add_ps( _mm_mul_ps( _mm_set1_ps( m[8 + row] ), z ), _mm_set1_ps( m[12 + row] ) ) );
+}
+
+// Multiplies by w, which is the constant 1 for affine transforms.
+static inline __m128
+cpu_lines__sse_mul_w( __m128 x, __m128 w, const int32_t affine )
+{
+  return affine ? x : _mm_mul_ps( x, w );
+}
+
+static CPU_LINES_FORCE_INLINE void
+cpu_lines__expand_sse_impl( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                            const cpu_lines__quad_layout_t* layout, msh_mat4_t mvp, msh_vec2_t viewport_size,
+                            msh_vec2_t aa_radius, const int32_t affine )
+{
+  const float* m = mvp.data;
+  const __m128 one          = _mm_set1_ps( 1.0f );
+  const __m128 half         = _mm_set1_ps( 0.5f );
+  const __m128 three_halves = _mm_set1_ps( 1.5f );
+  const __m128 sign_mask    = _mm_set1_ps( -0.0f );
+  const __m128 width        = _mm_set1_ps( viewport_size.x );
+  const __m128 height       = _mm_set1_ps( viewport_size.y );
+  const __m128 inv_width    = _mm_set1_ps( 1.0f / viewport_size.x );
+  const __m128 inv_height   = _mm_set1_ps( 1.0f / viewport_size.y );
+  const __m128 aspect_ratio = _mm_set1_ps( viewport_size.y / viewport_size.x );
+  const __m128 aa_width     = _mm_set1_ps( aa_radius.x );
+  const __m128 extension    = _mm_set1_ps( aa_radius.y );
+
+  uint32_t n_vector = n_segments & ~3u;
+  for( uint32_t i = 0; i < n_vector; i += 4 )
+  {
+    const vertex_t* src = line_buf + 2 * i;
+    __m128 a_pos[4], a_col[4], b_pos[4], b_col[4];
+    cpu_lines__sse_load_segments( src, a_pos, a_col, b_pos, b_col );
+
+    // Clip space positions and perspective divide
+    __m128 clip_ax = cpu_lines__sse_transform( m, 0, a_pos[0], a_pos[1], a_pos[2] );
+    __m128 clip_ay = cpu_lines__sse_transform( m, 1, a_pos[0], a_pos[1], a_pos[2] );
+    __m128 clip_az = cpu_lines__sse_transform( m, 2, a_pos[0], a_pos[1], a_pos[2] );
+    __m128 clip_aw = affine ? one : cpu_lines__sse_transform( m, 3, a_pos[0], a_pos[1], a_pos[2] );
+    __m128 clip_bx = cpu_lines__sse_transform( m, 0, b_pos[0], b_pos[1], b_pos[2] );
+    __m128 clip_by = cpu_lines__sse_transform( m, 1, b_pos[0], b_pos[1], b_pos[2] );
+    __m128 clip_bz = cpu_lines__sse_transform( m, 2, b_pos[0], b_pos[1], b_pos[2] );
+    __m128 clip_bw = affine ? one : cpu_lines__sse_transform( m, 3, b_pos[0], b_pos[1], b_pos[2] );
+    __m128 inv_aw = affine ? one : _mm_div_ps( one, clip_aw );
+    __m128 inv_bw = affine ? one : _mm_div_ps( one, clip_bw );
+    __m128 ndc_ax = cpu_lines__sse_mul_w( clip_ax, inv_aw, affine );
+    __m128 ndc_ay = cpu_lines__sse_mul_w( clip_ay, inv_aw, affine );
+    __m128 ndc_bx = cpu_lines__sse_mul_w( clip_bx, inv_bw, affine );
+    __m128 ndc_by = cpu_lines__sse_mul_w( clip_by, inv_bw, affine );
+
+    // Line direction, corrected for aspect ratio, and its length in pixels
+    __m128 line_x = _mm_sub_ps( ndc_bx, ndc_ax );
+    __m128 line_y = _mm_sub_ps( ndc_by, ndc_ay );
+    __m128 dir_x  = line_x;
+    __m128 dir_y  = _mm_mul_ps( line_y, aspect_ratio );
+    __m128 len_sq = _mm_add_ps( _mm_mul_ps( dir_x, dir_x ), _mm_mul_ps( dir_y, dir_y ) );
+    __m128 inv_len = _mm_rsqrt_ps( len_sq );
+    inv_len = _mm_mul_ps( inv_len, _mm_sub_ps( three_halves, _mm_mul_ps( _mm_mul_ps( half, len_sq ),
+                                                                         _mm_mul_ps( inv_len, inv_len ) ) ) );
+    dir_x = _mm_mul_ps( dir_x, inv_len );
+    dir_y = _mm_mul_ps( dir_y, inv_len );
+    __m128 px_x = _mm_mul_ps( line_x, width );
+    __m128 px_y = _mm_mul_ps( line_y, height );
+    __m128 line_length = _mm_add_ps( _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( px_x, px_x ), _mm_mul_ps( px_y, px_y ) ) ),
+                                     _mm_add_ps( extension, extension ) );
+
+    // Offsets of the quad corners in ndc
+    __m128 line_width_a = _mm_add_ps( _mm_max_ps( one, a_pos[3] ), aa_width );
+    __m128 line_width_b = _mm_add_ps( _mm_max_ps( one, b_pos[3] ), aa_width );
+    __m128 normal_x = _mm_xor_ps( dir_y, sign_mask );
+    __m128 normal_y = dir_x;
+    __m128 normal_ax = _mm_mul_ps( _mm_mul_ps( line_width_a, inv_width ), normal_x );
+    __m128 normal_ay = _mm_mul_ps( _mm_mul_ps( line_width_a, inv_height ), normal_y );
+    __m128 normal_bx = _mm_mul_ps( _mm_mul_ps( line_width_b, inv_width ), normal_x );
+    __m128 normal_by = _mm_mul_ps( _mm_mul_ps( line_width_b, inv_height ), normal_y );
+    __m128 ext_x = _mm_mul_ps( _mm_mul_ps( extension, inv_width ), dir_x );
+    __m128 ext_y = _mm_mul_ps( _mm_mul_ps( extension, inv_height ), dir_y );
+
+    __m128 clip[4][4], col[2][4], params[4][4];
+    __m128 base_ax = _mm_sub_ps( ndc_ax, ext_x ), base_ay = _mm_sub_ps( ndc_ay, ext_y );
+    __m128 base_bx = _mm_add_ps( ndc_bx, ext_x ), base_by = _mm_add_ps( ndc_by, ext_y );
+    clip[0][0] = cpu_lines__sse_mul_w( _mm_add_ps( base_ax, normal_ax ), clip_aw, affine );
+    clip[0][1] = cpu_lines__sse_mul_w( _mm_add_ps( base_ay, normal_ay ), clip_aw, affine );
+    clip[1][0] = cpu_lines__sse_mul_w( _mm_sub_ps( base_ax, normal_ax ), clip_aw, affine );
+    clip[1][1] = cpu_lines__sse_mul_w( _mm_sub_ps( base_ay, normal_ay ), clip_aw, affine );
+    clip[2][0] = cpu_lines__sse_mul_w( _mm_add_ps( base_bx, normal_bx ), clip_bw, affine );
+    clip[2][1] = cpu_lines__sse_mul_w( _mm_add_ps( base_by, normal_by ), clip_bw, affine );
+    clip[3][0] = cpu_lines__sse_mul_w( _mm_sub_ps( base_bx, normal_bx ), clip_bw, affine );
+    clip[3][1] = cpu_lines__sse_mul_w( _mm_sub_ps( base_by, normal_by ), clip_bw, affine );
+    clip[0][2] = clip[1][2] = clip_az;
+    clip[0][3] = clip[1][3] = clip_aw;
+    clip[2][2] = clip[3][2] = clip_bz;
+    clip[2][3] = clip[3][3] = clip_bw;
+
+    // Colors follow the scalar kernel exactly, including taking the alpha of both ends from the first vertex and
+    // the second end's green from its red channel.
+    col[0][0] = a_col[0];
+    col[0][1] = a_col[1];
+    col[0][2] = a_col[2];
+    col[0][3] = _mm_min_ps( _mm_mul_ps( a_col[3], a_pos[3] ), one );
+    col[1][0] = b_col[0];
+    col[1][1] = b_col[0];
+    col[1][2] = b_col[2];
+    col[1][3] = _mm_min_ps( _mm_mul_ps( a_col[3], b_pos[3] ), one );
+
+    __m128 half_length = _mm_mul_ps( half, line_length );
+    __m128 neg_half_length = _mm_xor_ps( half_length, sign_mask );
+    params[0][0] = _mm_xor_ps( line_width_a, sign_mask );
+    params[1][0] = line_width_a;
+    params[2][0] = _mm_xor_ps( line_width_b, sign_mask );
+    params[3][0] = line_width_b;
+    params[0][1] = params[1][1] = neg_half_length;
+    params[2][1] = params[3][1] = half_length;
+    params[0][2] = params[1][2] = line_width_a;
+    params[2][2] = params[3][2] = line_width_b;
+    params[0][3] = params[1][3] = params[2][3] = params[3][3] = half_length;
+
+    for( int32_t v = 0; v < 4; ++v )
+    {
+      __m128 col_v[4] = { col[v >> 1][0], col[v >> 1][1], col[v >> 1][2], col[v >> 1][3] };
+      cpu_lines__sse_store_vertex( v, clip[v], col_v, params[v], quad_buf + layout->n_vertices * i, layout );
+    }
+  }
+
+  cpu_lines__expand_scalar( line_buf + 2 * n_vector, n_segments - n_vector, quad_buf + layout->n_vertices * n_vector,
+                            layout, mvp, viewport_size, aa_radius, affine );
+}
+
+static void
+cpu_lines__expand_sse( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                       const cpu_lines__quad_layout_t* layout, msh_mat4_t mvp, msh_vec2_t viewport_size,
+                       msh_vec2_t aa_radius, int32_t affine )
+{
+  if( affine ) { cpu_lines__expand_sse_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 1 ); }
+  else         { cpu_lines__expand_sse_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 0 ); }
+}
+
+CPU_LINES_TARGET_AVX2 static inline __m256
+cpu_lines__avx2_combine( __m128 lo, __m128 hi )
+{
+  return _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+}
+
+CPU_LINES_TARGET_AVX2 static inline __m256
+cpu_lines__avx2_transform( const float* m, int32_t row, __m256 x, __m256 y, __m256 z )
+{
+  // Matrix entries are broadcast from memory as needed; keeping all 16 in registers would spill everything else.
+  return _mm256_fmadd_ps( _mm256_broadcast_ss( m + row ), x,
+                          _mm256_fmadd_ps( _mm256_broadcast_ss( m + 4 + row ), y,
+                                           _mm256_fmadd_ps( _mm256_broadcast_ss( m + 8 + row ), z,
+                                                            _mm256_broadcast_ss( m + 12 + row ) ) ) );
+}
+
+// 256-bit shuffles operate within each 128-bit half, so this transposes segments 0-3 in the low and 4-7 in the high
+// half at once, same as _MM_TRANSPOSE4_PS.
+CPU_LINES_TARGET_AVX2 static inline void
+cpu_lines__avx2_transpose4( __m256 r[4] )
+{
+  __m256 t0 = _mm256_unpacklo_ps( r[0], r[1] );
+  __m256 t1 = _mm256_unpacklo_ps( r[2], r[3] );
+  __m256 t2 = _mm256_unpackhi_ps( r[0], r[1] );
+  __m256 t3 = _mm256_unpackhi_ps( r[2], r[3] );
+  r[0] = _mm256_shuffle_ps( t0, t1, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+  r[1] = _mm256_shuffle_ps( t0, t1, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+  r[2] = _mm256_shuffle_ps( t2, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+  r[3] = _mm256_shuffle_ps( t2, t3, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+}
+
+// Counterpart of cpu_lines__sse_store_vertex for 8 quads.
+CPU_LINES_TARGET_AVX2 static inline void
+cpu_lines__avx2_store_vertex( int32_t v, const __m256 clip[4], const __m256 col[4], const __m256 params[4],
+                              cpu_lines_vertex_t* dst, const cpu_lines__quad_layout_t* layout )
+{
+  __m256 c[4] = { clip[0], clip[1], clip[2], clip[3] };
+  __m256 k[4] = { col[0], col[1], col[2], col[3] };
+  __m256 p[4] = { params[0], params[1], params[2], params[3] };
+  cpu_lines__avx2_transpose4( c );
+  cpu_lines__avx2_transpose4( k );
+  cpu_lines__avx2_transpose4( p );
+  for( int32_t j = 0; j < 4; ++j )
+  {
+    for( int32_t s = 0; s < 2; ++s )
+    {
+      int32_t slot = layout->slots[v][s];
+      if( slot < 0 ) { continue; }
+      float* lo = (float*)(dst + layout->n_vertices * j + slot);
+      float* hi = (float*)(dst + layout->n_vertices * (j + 4) + slot);
+      _mm_storeu_ps( lo,     _mm256_castps256_ps128( c[j] ) );
+      _mm_storeu_ps( lo + 4, _mm256_castps256_ps128( k[j] ) );
+      _mm_storeu_ps( lo + 8, _mm256_castps256_ps128( p[j] ) );
+      _mm_storeu_ps( hi,     _mm256_extractf128_ps( c[j], 1 ) );
+      _mm_storeu_ps( hi + 4, _mm256_extractf128_ps( k[j], 1 ) );
+      _mm_storeu_ps( hi + 8, _mm256_extractf128_ps( p[j], 1 ) );
+    }
+  }
+}
+
+CPU_LINES_TARGET_AVX2 static inline __m256
+cpu_lines__avx2_mul_w( __m256 x, __m256 w, const int32_t affine )
+{
+  return affine ? x : _mm256_mul_ps( x, w );
+}
+
+// Same as the sse kernel, with 8 segments per iteration. Loads go through the 4-wide transposes, one half of the
+// registers at a time.
+CPU_LINES_TARGET_AVX2 static CPU_LINES_FORCE_INLINE void
+cpu_lines__expand_avx2_impl( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                             const cpu_lines__quad_layout_t* layout, msh_mat4_t mvp, msh_vec2_t viewport_size,
+                             msh_vec2_t aa_radius, const int32_t affine )
+{
+  const float* m = mvp.data;
+  const __m256 one          = _mm256_set1_ps( 1.0f );
+  const __m256 half         = _mm256_set1_ps( 0.5f );
+  const __m256 three_halves = _mm256_set1_ps( 1.5f );
+  const __m256 sign_mask    = _mm256_set1_ps( -0.0f );
+  const __m256 width        = _mm256_set1_ps( viewport_size.x );
+  const __m256 height       = _mm256_set1_ps( viewport_size.y );
+  const __m256 inv_width    = _mm256_set1_ps( 1.0f / viewport_size.x );
+  const __m256 inv_height   = _mm256_set1_ps( 1.0f / viewport_size.y );
+  const __m256 aspect_ratio = _mm256_set1_ps( viewport_size.y / viewport_size.x );
+  const __m256 aa_width     = _mm256_set1_ps( aa_radius.x );
+  const __m256 extension    = _mm256_set1_ps( aa_radius.y );
+
+  uint32_t n_vector = n_segments & ~7u;
+  for( uint32_t i = 0; i < n_vector; i += 8 )
+  {
+    const vertex_t* src = line_buf + 2 * i;
+    __m128 a_pos_lo[4], a_col_lo[4], b_pos_lo[4], b_col_lo[4];
+    __m128 a_pos_hi[4], a_col_hi[4], b_pos_hi[4], b_col_hi[4];
+    cpu_lines__sse_load_segments( src,     a_pos_lo, a_col_lo, b_pos_lo, b_col_lo );
+    cpu_lines__sse_load_segments( src + 8, a_pos_hi, a_col_hi, b_pos_hi, b_col_hi );
+    __m256 a_pos[4], a_col[4], b_pos[4], b_col[4];
+    for( int32_t k = 0; k < 4; ++k )
+    {
+      a_pos[k] = cpu_lines__avx2_combine( a_pos_lo[k], a_pos_hi[k] );
+      a_col[k] = cpu_lines__avx2_combine( a_col_lo[k], a_col_hi[k] );
+      b_pos[k] = cpu_lines__avx2_combine( b_pos_lo[k], b_pos_hi[k] );
+      b_col[k] = cpu_lines__avx2_combine( b_col_lo[k], b_col_hi[k] );
+    }
+
+    // Clip space positions and perspective divide
+    __m256 clip_ax = cpu_lines__avx2_transform( m, 0, a_pos[0], a_pos[1], a_pos[2] );
+    __m256 clip_ay = cpu_lines__avx2_transform( m, 1, a_pos[0], a_pos[1], a_pos[2] );
+    __m256 clip_az = cpu_lines__avx2_transform( m, 2, a_pos[0], a_pos[1], a_pos[2] );
+    __m256 clip_aw = affine ? one : cpu_lines__avx2_transform( m, 3, a_pos[0], a_pos[1], a_pos[2] );
+    __m256 clip_bx = cpu_lines__avx2_transform( m, 0, b_pos[0], b_pos[1], b_pos[2] );
+    __m256 clip_by = cpu_lines__avx2_transform( m, 1, b_pos[0], b_pos[1], b_pos[2] );
+    __m256 clip_bz = cpu_lines__avx2_transform( m, 2, b_pos[0], b_pos[1], b_pos[2] );
+    __m256 clip_bw = affine ? one : cpu_lines__avx2_transform( m, 3, b_pos[0], b_pos[1], b_pos[2] );
+    __m256 inv_aw = affine ? one : _mm256_div_ps( one, clip_aw );
+    __m256 inv_bw = affine ? one : _mm256_div_ps( one, clip_bw );
+    __m256 ndc_ax = cpu_lines__avx2_mul_w( clip_ax, inv_aw, affine );
+    __m256 ndc_ay = cpu_lines__avx2_mul_w( clip_ay, inv_aw, affine );
+    __m256 ndc_bx = cpu_lines__avx2_mul_w( clip_bx, inv_bw, affine );
+    __m256 ndc_by = cpu_lines__avx2_mul_w( clip_by, inv_bw, affine );
+
+    // Line direction, corrected for aspect ratio, and its length in pixels
+    __m256 line_x = _mm256_sub_ps( ndc_bx, ndc_ax );
+    __m256 line_y = _mm256_sub_ps( ndc_by, ndc_ay );
+    __m256 dir_x  = line_x;
+    __m256 dir_y  = _mm256_mul_ps( line_y, aspect_ratio );
+    __m256 len_sq = _mm256_fmadd_ps( dir_x, dir_x, _mm256_mul_ps( dir_y, dir_y ) );
+    __m256 inv_len = _mm256_rsqrt_ps( len_sq );
+    inv_len = _mm256_mul_ps( inv_len, _mm256_fnmadd_ps( _mm256_mul_ps( half, len_sq ),
+                                                        _mm256_mul_ps( inv_len, inv_len ), three_halves ) );
+    dir_x = _mm256_mul_ps( dir_x, inv_len );
+    dir_y = _mm256_mul_ps( dir_y, inv_len );
+    __m256 px_x = _mm256_mul_ps( line_x, width );
+    __m256 px_y = _mm256_mul_ps( line_y, height );
+    __m256 line_length = _mm256_add_ps( _mm256_sqrt_ps( _mm256_fmadd_ps( px_x, px_x, _mm256_mul_ps( px_y, px_y ) ) ),
+                                        _mm256_add_ps( extension, extension ) );
+
+    // Offsets of the quad corners in ndc
+    __m256 line_width_a = _mm256_add_ps( _mm256_max_ps( one, a_pos[3] ), aa_width );
+    __m256 line_width_b = _mm256_add_ps( _mm256_max_ps( one, b_pos[3] ), aa_width );
+    __m256 normal_x = _mm256_xor_ps( dir_y, sign_mask );
+    __m256 normal_y = dir_x;
+    __m256 normal_ax = _mm256_mul_ps( _mm256_mul_ps( line_width_a, inv_width ), normal_x );
+    __m256 normal_ay = _mm256_mul_ps( _mm256_mul_ps( line_width_a, inv_height ), normal_y );
+    __m256 normal_bx = _mm256_mul_ps( _mm256_mul_ps( line_width_b, inv_width ), normal_x );
+    __m256 normal_by = _mm256_mul_ps( _mm256_mul_ps( line_width_b, inv_height ), normal_y );
+    __m256 ext_x = _mm256_mul_ps( _mm256_mul_ps( extension, inv_width ), dir_x );
+    __m256 ext_y = _mm256_mul_ps( _mm256_mul_ps( extension, inv_height ), dir_y );
+
+    __m256 clip[4][4], col[2][4], params[4][4];
+    __m256 base_ax = _mm256_sub_ps( ndc_ax, ext_x ), base_ay = _mm256_sub_ps( ndc_ay, ext_y );
+    __m256 base_bx = _mm256_add_ps( ndc_bx, ext_x ), base_by = _mm256_add_ps( ndc_by, ext_y );
+    clip[0][0] = cpu_lines__avx2_mul_w( _mm256_add_ps( base_ax, normal_ax ), clip_aw, affine );
+    clip[0][1] = cpu_lines__avx2_mul_w( _mm256_add_ps( base_ay, normal_ay ), clip_aw, affine );
+    clip[1][0] = cpu_lines__avx2_mul_w( _mm256_sub_ps( base_ax, normal_ax ), clip_aw, affine );
+    clip[1][1] = cpu_lines__avx2_mul_w( _mm256_sub_ps( base_ay, normal_ay ), clip_aw, affine );
+    clip[2][0] = cpu_lines__avx2_mul_w( _mm256_add_ps( base_bx, normal_bx ), clip_bw, affine );
+    clip[2][1] = cpu_lines__avx2_mul_w( _mm256_add_ps( base_by, normal_by ), clip_bw, affine );
+    clip[3][0] = cpu_lines__avx2_mul_w( _mm256_sub_ps( base_bx, normal_bx ), clip_bw, affine );
+    clip[3][1] = cpu_lines__avx2_mul_w( _mm256_sub_ps( base_by, normal_by ), clip_bw, affine );
+    clip[0][2] = clip[1][2] = clip_az;
+    clip[0][3] = clip[1][3] = clip_aw;
+    clip[2][2] = clip[3][2] = clip_bz;
+    clip[2][3] = clip[3][3] = clip_bw;
+
+    col[0][0] = a_col[0];
+    col[0][1] = a_col[1];
+    col[0][2] = a_col[2];
+    col[0][3] = _mm256_min_ps( _mm256_mul_ps( a_col[3], a_pos[3] ), one );
+    col[1][0] = b_col[0];
+    col[1][1] = b_col[0];
+    col[1][2] = b_col[2];
+    col[1][3] = _mm256_min_ps( _mm256_mul_ps( a_col[3], b_pos[3] ), one );
+
+    __m256 half_length = _mm256_mul_ps( half, line_length );
+    __m256 neg_half_length = _mm256_xor_ps( half_length, sign_mask );
+    params[0][0] = _mm256_xor_ps( line_width_a, sign_mask );
+    params[1][0] = line_width_a;
+    params[2][0] = _mm256_xor_ps( line_width_b, sign_mask );
+    params[3][0] = line_width_b;
+    params[0][1] = params[1][1] = neg_half_length;
+    params[2][1] = params[3][1] = half_length;
+    params[0][2] = params[1][2] = line_width_a;
+    params[2][2] = params[3][2] = line_width_b;
+    params[0][3] = params[1][3] = params[2][3] = params[3][3] = half_length;
+
+    for( int32_t v = 0; v < 4; ++v )
+    {
+      cpu_lines__avx2_store_vertex( v, clip[v], col[v >> 1], params[v], quad_buf + layout->n_vertices * i, layout );
+    }
+  }
+
+  cpu_lines__expand_sse( line_buf + 2 * n_vector, n_segments - n_vector, quad_buf + layout->n_vertices * n_vector,
+                         layout, mvp, viewport_size, aa_radius, affine );
+}
+
+CPU_LINES_TARGET_AVX2 static void
+cpu_lines__expand_avx2( const vertex_t* line_buf, uint32_t n_segments, cpu_lines_vertex_t* quad_buf,
+                        const cpu_lines__quad_layout_t* layout, msh_mat4_t mvp, msh_vec2_t viewport_size,
+                        msh_vec2_t aa_radius, int32_t affine )
+{
+  if( affine ) { cpu_lines__expand_avx2_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 1 ); }
+  else         { cpu_lines__expand_avx2_impl( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, 0 ); }
+}
+
+static int32_t
+cpu_lines__has_avx2( void )
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  int32_t info[4];
+  __cpuid( info, 0 );
+  if( info[0] < 7 ) { return 0; }
+  __cpuid( info, 1 );
+  int32_t has_fma = ((info[2] >> 12) & 1) && ((info[2] >> 29) & 1);
+  int32_t has_os_avx = ((info[2] >> 27) & 1) && ((_xgetbv( 0 ) & 0x6) == 0x6);
+  __cpuidex( info, 7, 0 );
+  int32_t has_avx2 = (info[1] >> 5) & 1;
+  return has_fma && has_os_avx && has_avx2;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) && __builtin_cpu_supports( "f16c" );
+#endif
+}
+
+#endif /* CPU_LINES_X86 */
+
+int32_t
+cpu_lines_kernel_supported( cpu_lines_kernel_t kernel )
+{
+  switch( kernel )
+  {
+    case CPU_LINES_KERNEL_AUTO:
+    case CPU_LINES_KERNEL_SCALAR:
+      return 1;
+#ifdef CPU_LINES_X86
+    // SSE is part of the x86-64 baseline; on 32-bit x86 we assume it as well.
+    case CPU_LINES_KERNEL_SSE:
+      return 1;
+    case CPU_LINES_KERNEL_AVX2:
+    {
+      static int32_t has_avx2 = -1;
+      if( has_avx2 < 0 ) { has_avx2 = cpu_lines__has_avx2(); }
+      return has_avx2;
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+cpu_lines_kernel_t
+cpu_lines_best_kernel( void )
+{
+  if( cpu_lines_kernel_supported( CPU_LINES_KERNEL_AVX2 ) ) { return CPU_LINES_KERNEL_AVX2; }
+  if( cpu_lines_kernel_supported( CPU_LINES_KERNEL_SSE ) )  { return CPU_LINES_KERNEL_SSE; }
+  return CPU_LINES_KERNEL_SCALAR;
+}
+
+static void
+cpu_lines__expand_segments( cpu_lines_kernel_t kernel, const vertex_t* line_buf, uint32_t n_segments,
+                            cpu_lines_vertex_t* quad_buf, const cpu_lines__quad_layout_t* layout,
+                            msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  int32_t affine = cpu_lines__is_affine( &mvp );
+  switch( kernel )
+  {
+#ifdef CPU_LINES_X86
+    case CPU_LINES_KERNEL_AVX2:
+      cpu_lines__expand_avx2( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, affine );
+      break;
+    case CPU_LINES_KERNEL_SSE:
+      cpu_lines__expand_sse( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, affine );
+      break;
+#endif
+    default:
+      cpu_lines__expand_scalar( line_buf, n_segments, quad_buf, layout, mvp, viewport_size, aa_radius, affine );
+      break;
+  }
+}
+
+static void
+cpu_lines__pack_vertices( const cpu_lines_vertex_t* src, uint32_t n_vertices, cpu_lines_compact_vertex_t* dst )
+{
+  for( uint32_t i = 0; i < n_vertices; ++i )
+  {
+    const cpu_lines_vertex_t* v = src + i;
+    cpu_lines_compact_vertex_t* c = dst + i;
+    c->ndc_pos = msh_vec2( v->clip_pos.x / v->clip_pos.w, v->clip_pos.y / v->clip_pos.w );
+    c->clip_zw[0] = lines_float_to_half( v->clip_pos.z );
+    c->clip_zw[1] = lines_float_to_half( v->clip_pos.w );
+    for( int32_t k = 0; k < 4; ++k )
+    {
+      c->col[k] = lines_float_to_unorm8( v->col.data[k] );
+      c->line_params[k] = lines_float_to_half( v->line_params.data[k] );
+    }
+  }
+}
+
+#ifdef CPU_LINES_X86
+// Same as cpu_lines__pack_vertices, with the hardware float to half conversion that comes with AVX2 capable cpus.
+CPU_LINES_TARGET_AVX2 static void
+cpu_lines__pack_vertices_f16c( const cpu_lines_vertex_t* src, uint32_t n_vertices, cpu_lines_compact_vertex_t* dst )
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps( 1.0f );
+  const __m128 scale = _mm_set1_ps( 255.0f );
+  const __m128 half = _mm_set1_ps( 0.5f );
+  for( uint32_t i = 0; i < n_vertices; ++i )
+  {
+    const float* v = (const float*)(src + i);
+    cpu_lines_compact_vertex_t* c = dst + i;
+    __m128 clip_pos = _mm_loadu_ps( v );
+    __m128 col = _mm_loadu_ps( v + 4 );
+    __m128 line_params = _mm_loadu_ps( v + 8 );
+
+    __m128 ndc = _mm_div_ps( clip_pos, _mm_shuffle_ps( clip_pos, clip_pos, _MM_SHUFFLE( 3, 3, 3, 3 ) ) );
+    _mm_storel_pi( (__m64*)c->ndc_pos.data, ndc );
+
+    __m128i clip_pos_half = _mm_cvtps_ph( clip_pos, _MM_FROUND_TO_NEAREST_INT );
+    uint32_t clip_zw = (uint32_t)_mm_extract_epi32( clip_pos_half, 1 );
+    memcpy( c->clip_zw, &clip_zw, sizeof(clip_zw) );
+
+    __m128i col_i = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_min_ps( _mm_max_ps( col, zero ), one ), scale ), half ) );
+    col_i = _mm_packus_epi16( _mm_packus_epi32( col_i, col_i ), col_i );
+    uint32_t col_u8 = (uint32_t)_mm_cvtsi128_si32( col_i );
+    memcpy( c->col, &col_u8, sizeof(col_u8) );
+
+    _mm_storel_epi64( (__m128i*)c->line_params, _mm_cvtps_ph( line_params, _MM_FROUND_TO_NEAREST_INT ) );
+  }
+}
+#endif
+
+typedef struct cpu_lines__expand_job
+{
+  cpu_lines_kernel_t kernel;
+  bool cull;
+  const vertex_t* line_buf;
+  uint32_t n_segments;
+  cpu_lines_vertex_t* quad_buf;
+  cpu_lines_compact_vertex_t* compact_buf;
+  const cpu_lines__quad_layout_t* layout;
+  uint32_t* chunk_offsets;
+  uint32_t* chunk_counts;
+  uint8_t* visibility;
+  cpu_lines_expand_scratch_t* scratch;
+  msh_mat4_t mvp;
+  msh_vec2_t viewport_size;
+  msh_vec2_t aa_radius;
+} cpu_lines__expand_job_t;
+
+enum
+{
+  CPU_LINES__HIDDEN,
+  CPU_LINES__VISIBLE,
+  CPU_LINES__CLIPPED
+};
+
+// Tells whether any of the segment can be visible. Segments crossing the near plane are CLIPPED - 'dst' then receives
+// the segment with the endpoint behind the plane moved onto it, and is left untouched otherwise. Clip-space planes are
+// moved out by the largest offset the expansion applies to an endpoint, so that segments just outside the viewport
+// still contribute their width and anti-aliasing.
+static inline uint8_t
+cpu_lines__clip_segment( const cpu_lines__expand_job_t* job, const vertex_t* src, vertex_t* dst )
+{
+  msh_vec4_t clip_a = cpu_lines__transform_point( job->mvp.data, src[0].pos, 0 );
+  msh_vec4_t clip_b = cpu_lines__transform_point( job->mvp.data, src[1].pos, 0 );
+
+  // Distances to the near plane, z = -w.
+  float dist_a = clip_a.z + clip_a.w;
+  float dist_b = clip_b.z + clip_b.w;
+  if( dist_a < 0.0f && dist_b < 0.0f ) { return CPU_LINES__HIDDEN; }
+
+  uint8_t state = CPU_LINES__VISIBLE;
+  float max_width = msh_max( src[0].width, src[1].width );
+  if( dist_a < 0.0f || dist_b < 0.0f )
+  {
+    state = CPU_LINES__CLIPPED;
+    dst[0] = src[0];
+    dst[1] = src[1];
+    // Clip space is an affine function of the model space position, so the intersection can be interpolated in either.
+    float t = dist_a / (dist_a - dist_b);
+    int32_t k = dist_a < 0.0f ? 0 : 1;
+    dst[k].pos   = msh_vec3_lerp( src[0].pos, src[1].pos, t );
+    dst[k].width = src[0].width + t * (src[1].width - src[0].width);
+    dst[k].col   = msh_vec4_lerp( src[0].col, src[1].col, t );
+    msh_vec4_t clip = msh_vec4_lerp( clip_a, clip_b, t );
+    if( k == 0 ) { clip_a = clip; } else { clip_b = clip; }
+    max_width = msh_max( dst[0].width, dst[1].width );
+  }
+
+  float offset = msh_max( 1.0f, max_width ) + job->aa_radius.x + job->aa_radius.y;
+  float scale_x = 1.0f + offset / job->viewport_size.x;
+  float scale_y = 1.0f + offset / job->viewport_size.y;
+  if( (clip_a.x >  scale_x * clip_a.w && clip_b.x >  scale_x * clip_b.w) ||
+      (clip_a.x < -scale_x * clip_a.w && clip_b.x < -scale_x * clip_b.w) ||
+      (clip_a.y >  scale_y * clip_a.w && clip_b.y >  scale_y * clip_b.w) ||
+      (clip_a.y < -scale_y * clip_a.w && clip_b.y < -scale_y * clip_b.w) ||
+      (clip_a.z >  clip_a.w && clip_b.z > clip_b.w) )
+  {
+    return CPU_LINES__HIDDEN;
+  }
+  return state;
+}
+
+// Expands 'n_segments' consecutive segments into the output, starting at the quad with index 'dst_segment'.
+static void
+cpu_lines__emit_segments( const cpu_lines__expand_job_t* job, const vertex_t* line_buf, uint32_t n_segments,
+                          uint32_t dst_segment )
+{
+  uint32_t n_vertices = job->layout->n_vertices;
+  if( !job->compact_buf )
+  {
+    cpu_lines__expand_segments( job->kernel, line_buf, n_segments, job->quad_buf + n_vertices * dst_segment,
+                                job->layout, job->mvp, job->viewport_size, job->aa_radius );
+    return;
+  }
+
+  // Compact vertices are expanded in small batches into a buffer on the stack, which stays in L1 while packing.
+  enum { BATCH_SEGMENTS = 32 };
+  cpu_lines_vertex_t batch[6 * BATCH_SEGMENTS];
+  for( uint32_t i = 0; i < n_segments; i += BATCH_SEGMENTS )
+  {
+    uint32_t n_batch = msh_min( n_segments - i, (uint32_t)BATCH_SEGMENTS );
+    cpu_lines_compact_vertex_t* dst = job->compact_buf + n_vertices * (dst_segment + i);
+    cpu_lines__expand_segments( job->kernel, line_buf + 2 * i, n_batch, batch,
+                                job->layout, job->mvp, job->viewport_size, job->aa_radius );
+#ifdef CPU_LINES_X86
+    if( job->kernel == CPU_LINES_KERNEL_AVX2 )
+    {
+      cpu_lines__pack_vertices_f16c( batch, n_vertices * n_batch, dst );
+      continue;
+    }
+#endif
+    cpu_lines__pack_vertices( batch, n_vertices * n_batch, dst );
+  }
+}
+
+#ifdef CPU_LINES_X86
+// Classifies 4 segments at once, with the same tests as cpu_lines__clip_segment. The rare segments crossing the near
+// plane are passed on to the scalar version, as they need clipping before the remaining tests.
+static inline void
+cpu_lines__sse_cull_segments( const cpu_lines__expand_job_t* job, const vertex_t* src, uint8_t* visibility )
+{
+  const float* m = job->mvp.data;
+  __m128 a_pos[4], a_col[4], b_pos[4], b_col[4];
+  cpu_lines__sse_load_segments( src, a_pos, a_col, b_pos, b_col );
+  __m128 clip_ax = cpu_lines__sse_transform( m, 0, a_pos[0], a_pos[1], a_pos[2] );
+  __m128 clip_ay = cpu_lines__sse_transform( m, 1, a_pos[0], a_pos[1], a_pos[2] );
+  __m128 clip_az = cpu_lines__sse_transform( m, 2, a_pos[0], a_pos[1], a_pos[2] );
+  __m128 clip_aw = cpu_lines__sse_transform( m, 3, a_pos[0], a_pos[1], a_pos[2] );
+  __m128 clip_bx = cpu_lines__sse_transform( m, 0, b_pos[0], b_pos[1], b_pos[2] );
+  __m128 clip_by = cpu_lines__sse_transform( m, 1, b_pos[0], b_pos[1], b_pos[2] );
+  __m128 clip_bz = cpu_lines__sse_transform( m, 2, b_pos[0], b_pos[1], b_pos[2] );
+  __m128 clip_bw = cpu_lines__sse_transform( m, 3, b_pos[0], b_pos[1], b_pos[2] );
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one  = _mm_set1_ps( 1.0f );
+  __m128 behind_a = _mm_cmplt_ps( _mm_add_ps( clip_az, clip_aw ), zero );
+  __m128 behind_b = _mm_cmplt_ps( _mm_add_ps( clip_bz, clip_bw ), zero );
+
+  __m128 offset = _mm_add_ps( _mm_max_ps( one, _mm_max_ps( a_pos[3], b_pos[3] ) ),
+                              _mm_set1_ps( job->aa_radius.x + job->aa_radius.y ) );
+  __m128 scale_x = _mm_add_ps( one, _mm_div_ps( offset, _mm_set1_ps( job->viewport_size.x ) ) );
+  __m128 scale_y = _mm_add_ps( one, _mm_div_ps( offset, _mm_set1_ps( job->viewport_size.y ) ) );
+  __m128 limit_ax = _mm_mul_ps( scale_x, clip_aw );
+  __m128 limit_bx = _mm_mul_ps( scale_x, clip_bw );
+  __m128 limit_ay = _mm_mul_ps( scale_y, clip_aw );
+  __m128 limit_by = _mm_mul_ps( scale_y, clip_bw );
+  __m128 hidden = _mm_and_ps( behind_a, behind_b );
+  hidden = _mm_or_ps( hidden, _mm_and_ps( _mm_cmpgt_ps( clip_ax, limit_ax ), _mm_cmpgt_ps( clip_bx, limit_bx ) ) );
+  hidden = _mm_or_ps( hidden, _mm_and_ps( _mm_cmplt_ps( clip_ax, _mm_sub_ps( zero, limit_ax ) ),
+                                          _mm_cmplt_ps( clip_bx, _mm_sub_ps( zero, limit_bx ) ) ) );
+  hidden = _mm_or_ps( hidden, _mm_and_ps( _mm_cmpgt_ps( clip_ay, limit_ay ), _mm_cmpgt_ps( clip_by, limit_by ) ) );
+  hidden = _mm_or_ps( hidden, _mm_and_ps( _mm_cmplt_ps( clip_ay, _mm_sub_ps( zero, limit_ay ) ),
+                                          _mm_cmplt_ps( clip_by, _mm_sub_ps( zero, limit_by ) ) ) );
+  hidden = _mm_or_ps( hidden, _mm_and_ps( _mm_cmpgt_ps( clip_az, clip_aw ), _mm_cmpgt_ps( clip_bz, clip_bw ) ) );
+
+  int32_t hidden_mask = _mm_movemask_ps( hidden );
+  int32_t crossing_mask = _mm_movemask_ps( _mm_xor_ps( behind_a, behind_b ) );
+  for( int32_t k = 0; k < 4; ++k )
+  {
+    if( crossing_mask & (1 << k) )
+    {
+      vertex_t clipped[2];
+      visibility[k] = cpu_lines__clip_segment( job, src + 2 * k, clipped );
+    }
+    else
+    {
+      visibility[k] = (hidden_mask & (1 << k)) ? CPU_LINES__HIDDEN : CPU_LINES__VISIBLE;
+    }
+  }
+}
+#endif
+
+// Without culling every segment expands into the same number of vertices, so the output offset of a chunk follows
+// directly from its index. With culling, a first pass tests the segments of every chunk and counts the visible ones,
+// and the offsets are their prefix sums. Either way chunks never touch each other's part of the quad buffer.
+static void
+cpu_lines__cull_chunk( void* user_data, uint32_t chunk_idx )
+{
+  const cpu_lines__expand_job_t* job = user_data;
+  uint32_t first = chunk_idx * CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  uint32_t count = msh_min( job->n_segments - first, (uint32_t)CPU_LINES_EXPAND_CHUNK_SEGMENTS );
+  uint32_t i = first;
+#ifdef CPU_LINES_X86
+  if( job->kernel != CPU_LINES_KERNEL_SCALAR )
+  {
+    for( ; i + 4 <= first + count; i += 4 )
+    {
+      cpu_lines__sse_cull_segments( job, job->line_buf + 2 * i, job->visibility + i );
+    }
+  }
+#endif
+  vertex_t clipped[2];
+  for( ; i < first + count; ++i )
+  {
+    job->visibility[i] = cpu_lines__clip_segment( job, job->line_buf + 2 * i, clipped );
+  }
+
+  uint32_t n_visible = 0;
+  for( i = first; i < first + count; ++i ) { n_visible += job->visibility[i] != CPU_LINES__HIDDEN; }
+  job->chunk_offsets[chunk_idx] = n_visible;
+}
+
+static void
+cpu_lines__expand_chunk( void* user_data, uint32_t chunk_idx )
+{
+  const cpu_lines__expand_job_t* job = user_data;
+  uint32_t first = chunk_idx * CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  uint32_t count = msh_min( job->n_segments - first, (uint32_t)CPU_LINES_EXPAND_CHUNK_SEGMENTS );
+  if( !job->cull )
+  {
+    cpu_lines__emit_segments( job, job->line_buf + 2 * first, count, first );
+    return;
+  }
+
+  // Visible segments are gathered into small batches, so that the vectorized kernels still see full groups of
+  // segments when only a few scattered ones remain.
+  enum { BATCH_SEGMENTS = 64 };
+  vertex_t batch[2 * BATCH_SEGMENTS];
+  uint32_t n_batch = 0;
+  uint32_t dst_segment = job->chunk_offsets[chunk_idx];
+  for( uint32_t i = first; i < first + count; ++i )
+  {
+    uint8_t state = job->visibility[i];
+    if( state == CPU_LINES__HIDDEN ) { continue; }
+    if( state == CPU_LINES__CLIPPED ) { cpu_lines__clip_segment( job, job->line_buf + 2 * i, batch + 2 * n_batch ); }
+    else { memcpy( batch + 2 * n_batch, job->line_buf + 2 * i, 2 * sizeof(vertex_t) ); }
+    if( ++n_batch == BATCH_SEGMENTS )
+    {
+      cpu_lines__emit_segments( job, batch, n_batch, dst_segment );
+      dst_segment += n_batch;
+      n_batch = 0;
+    }
+  }
+  cpu_lines__emit_segments( job, batch, n_batch, dst_segment );
+}
+
+void
+cpu_lines_expand_scratch_term( cpu_lines_expand_scratch_t* scratch )
+{
+  free( scratch->chunk_offsets );
+  free( scratch->visibility );
+  memset( scratch, 0, sizeof(cpu_lines_expand_scratch_t) );
+}
+
+// Grows geometrically, so that slowly growing inputs do not reallocate every frame.
+static void
+cpu_lines__fit_scratch( cpu_lines_expand_scratch_t* scratch, uint32_t n_chunks, uint32_t n_segments )
+{
+  if( n_chunks > scratch->chunk_offsets_cap )
+  {
+    scratch->chunk_offsets_cap = msh_max( n_chunks, 2 * scratch->chunk_offsets_cap );
+    scratch->chunk_offsets = realloc( scratch->chunk_offsets, scratch->chunk_offsets_cap * sizeof(uint32_t) );
+  }
+  if( n_segments > scratch->visibility_cap )
+  {
+    scratch->visibility_cap = msh_max( n_segments, 2 * scratch->visibility_cap );
+    scratch->visibility = realloc( scratch->visibility, scratch->visibility_cap );
+  }
+}
+
+static void
+cpu_lines__run_expand_job( worker_pool_t* pool, cpu_lines__expand_job_t* job, uint32_t line_buf_len,
+                           uint32_t *quad_buf_len, uint32_t quad_buf_cap )
+{
+  *quad_buf_len = 0;
+  if( (uint64_t)(line_buf_len / 2) * job->layout->n_vertices >= quad_buf_cap )
+  {
+    fprintf(stderr, "Not enough space to generate quads from line\n" );
+    return;
+  }
+
+  if( job->kernel == CPU_LINES_KERNEL_AUTO || !cpu_lines_kernel_supported( job->kernel ) )
+  {
+    job->kernel = cpu_lines_best_kernel();
+  }
+
+  job->n_segments = line_buf_len / 2;
+  uint32_t n_chunks = (job->n_segments + CPU_LINES_EXPAND_CHUNK_SEGMENTS - 1) / CPU_LINES_EXPAND_CHUNK_SEGMENTS;
+  uint32_t n_output_segments = job->n_segments;
+  cpu_lines_expand_scratch_t local_scratch = {0};
+  cpu_lines_expand_scratch_t* scratch = job->scratch ? job->scratch : &local_scratch;
+  if( job->cull )
+  {
+    cpu_lines__fit_scratch( scratch, msh_max( n_chunks, 1u ), msh_max( job->n_segments, 1u ) );
+    job->chunk_offsets = scratch->chunk_offsets;
+    job->visibility = scratch->visibility;
+    worker_pool_run( pool, cpu_lines__cull_chunk, job, n_chunks );
+    if( job->chunk_counts ) { memcpy( job->chunk_counts, job->chunk_offsets, n_chunks * sizeof(uint32_t) ); }
+    n_output_segments = 0;
+    for( uint32_t i = 0; i < n_chunks; ++i )
+    {
+      uint32_t n_visible = job->chunk_offsets[i];
+      job->chunk_offsets[i] = n_output_segments;
+      n_output_segments += n_visible;
+    }
+  }
+  else if( job->chunk_counts )
+  {
+    for( uint32_t i = 0; i < n_chunks; ++i )
+    {
+      job->chunk_counts[i] = msh_min( job->n_segments - i * CPU_LINES_EXPAND_CHUNK_SEGMENTS,
+                                      (uint32_t)CPU_LINES_EXPAND_CHUNK_SEGMENTS );
+    }
+  }
+  worker_pool_run( pool, cpu_lines__expand_chunk, job, n_chunks );
+  cpu_lines_expand_scratch_term( &local_scratch );
+  job->chunk_offsets = NULL;
+  job->visibility = NULL;
+  *quad_buf_len = job->layout->n_vertices * n_output_segments;
+}
+
+static const cpu_lines_expand_options_t cpu_lines__default_options = { .kernel = CPU_LINES_KERNEL_AUTO };
+
+void
+cpu_lines_expand_parallel( worker_pool_t* pool, const cpu_lines_expand_options_t* options, const vertex_t* line_buf,
+                           uint32_t line_buf_len, cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len,
+                           uint32_t quad_buf_cap, msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  if( !options ) { options = &cpu_lines__default_options; }
+  cpu_lines__expand_job_t job = { .kernel = options->kernel, .cull = options->cull, .line_buf = line_buf,
+                                  .quad_buf = quad_buf, .chunk_counts = options->chunk_counts,
+                                  .scratch = options->scratch,
+                                  .layout = options->indexed ? &cpu_lines__indexed_layout : &cpu_lines__triangles_layout,
+                                  .mvp = mvp, .viewport_size = viewport_size, .aa_radius = aa_radius };
+  cpu_lines__run_expand_job( pool, &job, line_buf_len, quad_buf_len, quad_buf_cap );
+}
+
+void
+cpu_lines_expand_compact_parallel( worker_pool_t* pool, const cpu_lines_expand_options_t* options,
+                                   const vertex_t* line_buf, uint32_t line_buf_len,
+                                   cpu_lines_compact_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
+                                   msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  if( !options ) { options = &cpu_lines__default_options; }
+  cpu_lines__expand_job_t job = { .kernel = options->kernel, .cull = options->cull, .line_buf = line_buf,
+                                  .compact_buf = quad_buf, .chunk_counts = options->chunk_counts,
+                                  .scratch = options->scratch,
+                                  .layout = options->indexed ? &cpu_lines__indexed_layout : &cpu_lines__triangles_layout,
+                                  .mvp = mvp, .viewport_size = viewport_size, .aa_radius = aa_radius };
+  cpu_lines__run_expand_job( pool, &job, line_buf_len, quad_buf_len, quad_buf_cap );
+}
+
+void
+cpu_lines_expand_kernel( cpu_lines_kernel_t kernel, const vertex_t* line_buf, uint32_t line_buf_len,
+                         cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
+                         msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  cpu_lines_expand_options_t options = { .kernel = kernel };
+  cpu_lines_expand_parallel( NULL, &options, line_buf, line_buf_len, quad_buf, quad_buf_len, quad_buf_cap,
+                             mvp, viewport_size, aa_radius );
+}
+
+void
+cpu_lines_expand( const vertex_t* line_buf, uint32_t line_buf_len,
+                  cpu_lines_vertex_t* quad_buf, uint32_t *quad_buf_len, uint32_t quad_buf_cap,
+                  msh_mat4_t mvp, msh_vec2_t viewport_size, msh_vec2_t aa_radius )
+{
+  cpu_lines_expand_kernel( CPU_LINES_KERNEL_AUTO, line_buf, line_buf_len, quad_buf, quad_buf_len, quad_buf_cap,
+                           mvp, viewport_size, aa_radius );
+}
+
+#endif /*CPU_LINES_EXPAND_IMPLEMENTATION*/
@@ -4,8 +4,11 @@
 void* geom_shdr_lines_init_device( void );
 uint32_t geom_shdr_lines_update( void* device, const void* data, int32_t n_elems, int32_t elem_size,
                                  uniform_data_t* uniform_data );
-void geom_shdr_lines_render( const void* device, const int32_t count );
+uint32_t geom_shdr_lines_update_ranges( void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                        const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data );
+void geom_shdr_lines_render( void* device, const int32_t count );
 void geom_shdr_lines_term_device( void** device );
+memory_stats_t geom_shdr_lines_memory_stats( const void* device );
 
 #endif /* GEOMETRY_SHADER_LINES_H */
 
@@ -15,8 +18,9 @@ void geom_shdr_lines_term_device( void** device );
 typedef struct geom_shader_lines_device
 {
   GLuint program_id;
+  GLuint affine_program_id;
   GLuint vao;
-  GLuint vbo;
+  gl_utils_buffer_t vbo;
 
   struct geom_shader_lines_uniform_locations
   {
@@ -32,15 +36,18 @@ typedef struct geom_shader_lines_device
   } attribs;
   
   uniform_data_t* uniform_data;
+
+  memory_stats_t mem_stats;
 } geom_shader_lines_device_t;
 
 void*
 geom_shdr_lines_init_device( void )
 {
   geom_shader_lines_device_t* device = malloc( sizeof(geom_shader_lines_device_t ) );
+  memset( device, 0, sizeof(geom_shader_lines_device_t) );
 
+  // Vertex and geometry stages are compiled in two variants, see GL_UTILS_SHDR_AFFINE
   const char* vs_src = 
-    GL_UTILS_SHDR_VERSION
     GL_UTILS_SHDR_SOURCE(
       layout(location = 0) in vec4 pos_width;
       layout(location = 1) in vec4 col;
@@ -54,12 +61,11 @@ geom_shdr_lines_init_device( void )
       {
         v_col = col;
         v_line_width = pos_width.w;
-        gl_Position = u_mvp * vec4(pos_width.xyz, 1.0);
+        gl_Position = project( u_mvp, pos_width.xyz );
       }
     );
 
   const char* gs_src = 
-    GL_UTILS_SHDR_VERSION
     GL_UTILS_SHDR_SOURCE(
       layout(lines) in;
       layout(triangle_strip, max_vertices = 4) out;
@@ -82,8 +88,8 @@ geom_shdr_lines_init_device( void )
         float u_height       = u_viewport_size[1];
         float u_aspect_ratio = u_height / u_width;
 
-        vec2 ndc_a = gl_in[0].gl_Position.xy / gl_in[0].gl_Position.w;
-        vec2 ndc_b = gl_in[1].gl_Position.xy / gl_in[1].gl_Position.w;
+        vec2 ndc_a = to_ndc( gl_in[0].gl_Position );
+        vec2 ndc_b = to_ndc( gl_in[1].gl_Position );
 
         vec2 line_vector = ndc_b - ndc_a;
         vec2 viewport_line_vector = line_vector * u_viewport_size;
@@ -104,14 +110,14 @@ geom_shdr_lines_init_device( void )
         g_v = line_length * 0.5;
         g_line_width = line_width_a;
         g_line_length = line_length * 0.5;
-        gl_Position = vec4( (ndc_a + normal_a - extension) * gl_in[0].gl_Position.w, gl_in[0].gl_Position.zw );
+        gl_Position = from_ndc( ndc_a + normal_a - extension, gl_in[0].gl_Position.zw );
         EmitVertex();
         
         g_u = -line_width_a;
         g_v = line_length * 0.5;
         g_line_width = line_width_a;
         g_line_length = line_length * 0.5;
-        gl_Position = vec4( (ndc_a - normal_a - extension) * gl_in[0].gl_Position.w, gl_in[0].gl_Position.zw );
+        gl_Position = from_ndc( ndc_a - normal_a - extension, gl_in[0].gl_Position.zw );
         EmitVertex();
         
         g_col = vec4( v_col[0].rgb, v_col[0].a * min( v_line_width[0], 1.0f ) );
@@ -119,14 +125,14 @@ geom_shdr_lines_init_device( void )
         g_v = -line_length * 0.5;
         g_line_width = line_width_b;
         g_line_length = line_length * 0.5;
-        gl_Position = vec4( (ndc_b + normal_b + extension) * gl_in[1].gl_Position.w, gl_in[1].gl_Position.zw );
+        gl_Position = from_ndc( ndc_b + normal_b + extension, gl_in[1].gl_Position.zw );
         EmitVertex();
         
         g_u = -line_width_b;
         g_v = -line_length * 0.5;
         g_line_width = line_width_b;
         g_line_length = line_length * 0.5;
-        gl_Position = vec4( (ndc_b - normal_b + extension) * gl_in[1].gl_Position.w, gl_in[1].gl_Position.zw );
+        gl_Position = from_ndc( ndc_b - normal_b + extension, gl_in[1].gl_Position.zw );
         EmitVertex();
         
         EndPrimitive();
@@ -135,6 +141,7 @@ geom_shdr_lines_init_device( void )
   
   const char* fs_src = 
     GL_UTILS_SHDR_VERSION
+    GL_UTILS_SHDR_FRAG_OUTPUTS
     GL_UTILS_SHDR_SOURCE(
       layout(location = 2) uniform vec2 u_aa_radius;
       
@@ -144,7 +151,6 @@ geom_shdr_lines_init_device( void )
       in noperspective float g_line_width;
       in noperspective float g_line_length;
 
-      out vec4 frag_color;
       void main()
       {
         /* We render a quad that is fattened by r, giving total width of the line to be w+r. We want smoothing to happen
@@ -157,37 +163,18 @@ geom_shdr_lines_init_device( void )
         float av = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[1]) / g_line_length), 1.0, abs(g_v / g_line_length) );
         frag_color = g_col;
         frag_color.a *= min(av, au);
+        write_overdraw();
       }
     );
 
-  GLuint vertex_shader = glCreateShader( GL_VERTEX_SHADER );
   GLuint fragment_shader = glCreateShader( GL_FRAGMENT_SHADER );
-  GLuint geometry_shader = glCreateShader( GL_GEOMETRY_SHADER );
-
-  glShaderSource( vertex_shader, 1, &vs_src, 0 );
-  glCompileShader( vertex_shader );
-  gl_utils_assert_shader_compiled( vertex_shader, "VERTEX_SHADER" );
 
   glShaderSource( fragment_shader, 1, &fs_src, 0 );
   glCompileShader( fragment_shader );
   gl_utils_assert_shader_compiled( fragment_shader, "FRAGMENT_SHADER" );
 
-  glShaderSource( geometry_shader, 1, &gs_src, 0 );
-  glCompileShader( geometry_shader );
-  gl_utils_assert_shader_compiled( geometry_shader, "GEOMETRY_SHADER" );
-
-  device->program_id = glCreateProgram();
-  glAttachShader( device->program_id, vertex_shader );
-  glAttachShader( device->program_id, geometry_shader );
-  glAttachShader( device->program_id, fragment_shader );
-  glLinkProgram( device->program_id );
-  gl_utils_assert_program_linked( device->program_id );
-  
-  glDetachShader( device->program_id, vertex_shader );
-  glDetachShader( device->program_id, geometry_shader );
-  glDetachShader( device->program_id, fragment_shader );
-  glDeleteShader( vertex_shader );
-  glDeleteShader( geometry_shader );
+  device->program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_PROJECTIVE, NULL, vs_src, gs_src, fragment_shader );
+  device->affine_program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_AFFINE, NULL, vs_src, gs_src, fragment_shader );
   glDeleteShader( fragment_shader );
 
   device->attribs.pos_width = glGetAttribLocation( device->program_id, "pos_width" );
@@ -199,10 +186,10 @@ geom_shdr_lines_init_device( void )
 
   GLuint  binding_idx = 0;
   glCreateVertexArrays( 1, &device->vao );
-  glCreateBuffers( 1, &device->vbo );
-  glNamedBufferStorage( device->vbo, MAX_VERTS * sizeof(vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT );
+  gl_utils_buffer_init( &device->vbo );
+  device->mem_stats.gpu_buffer_bytes = device->vbo.size;
 
-  glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo, 0, sizeof(vertex_t) );
+  glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo.buffer, 0, sizeof(vertex_t) );
 
   glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width );
   glEnableVertexArrayAttrib( device->vao, device->attribs.col );
@@ -220,28 +207,52 @@ geom_shdr_lines_term_device( void** device_in )
 {
   geom_shader_lines_device_t* device = *device_in;
   glDeleteProgram( device->program_id );
-  glDeleteBuffers( 1, &device->vbo );
+  glDeleteProgram( device->affine_program_id );
+  gl_utils_buffer_term( &device->vbo );
   glDeleteVertexArrays( 1, &device->vao );
   free( device );
   *device_in = NULL;
 }
 
 uint32_t
-geom_shdr_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size, 
-                        uniform_data_t* uniform_data )
+geom_shdr_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                               const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
   geom_shader_lines_device_t* device = device_in;
   device->uniform_data = uniform_data;
-  glNamedBufferSubData( device->vbo, 0, n_elems*elem_size, data );
+  device->mem_stats.uploaded_bytes = 0;
+  profiler_trace_begin( "upload" );
+  if( gl_utils_buffer_upload( &device->vbo, data, n_elems, elem_size, ranges, n_ranges,
+                              &device->mem_stats.uploaded_bytes ) )
+  {
+    glVertexArrayVertexBuffer( device->vao, 0, device->vbo.buffer, 0, sizeof(vertex_t) );
+    device->mem_stats.gpu_buffer_bytes = device->vbo.size;
+  }
+  profiler_trace_end();
+  device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
   return n_elems;
 }
 
+uint32_t
+geom_shdr_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size, 
+                        uniform_data_t* uniform_data )
+{
+  return geom_shdr_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+geom_shdr_lines_memory_stats( const void* device_in )
+{
+  const geom_shader_lines_device_t* device = device_in;
+  return device->mem_stats;
+}
+
 void
-geom_shdr_lines_render( const void* device_in, const int32_t count )
+geom_shdr_lines_render( void* device_in, const int32_t count )
 {
   const geom_shader_lines_device_t* device = device_in;
   
-  glUseProgram( device->program_id);
+  glUseProgram( gl_utils_is_affine( device->uniform_data->mvp ) ? device->affine_program_id : device->program_id );
 
   glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, device->uniform_data->mvp );
   glUniform2fv( device->uniforms.viewport_size, 1, device->uniform_data->viewport );
@@ -4,8 +4,11 @@
 void* gl_lines_init_device( void );
 uint32_t gl_lines_update( void* device, const void* data, int32_t n_elems, int32_t elem_size,
                          uniform_data_t* uniform_data );
-void gl_lines_render( const void* device, const int32_t count );
+uint32_t gl_lines_update_ranges( void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data );
+void gl_lines_render( void* device, const int32_t count );
 void gl_lines_term_device( void** device );
+memory_stats_t gl_lines_memory_stats( const void* device );
 
 //TODO(maciej): Terminate device!
 
@@ -17,7 +20,7 @@ typedef struct gl_lines_device
 {
     GLuint program_id;
     GLuint vao;
-    GLuint vbo;
+    gl_utils_buffer_t vbo;
     
     struct gl_lines_uniform_locations
     {
@@ -34,6 +37,7 @@ typedef struct gl_lines_device
     vertex_t* vertex_data;
     int32_t vertex_data_len;
     
+    memory_stats_t mem_stats;
 } gl_lines_device_t;
 
 void*
@@ -61,12 +65,13 @@ gl_lines_init_device(void)
     
     const char* fs_src =
         GL_UTILS_SHDR_VERSION
+        GL_UTILS_SHDR_FRAG_OUTPUTS
         GL_UTILS_SHDR_SOURCE(
                              in vec4 v_col;
-                             out vec4 frag_color;
                              void main()
                              {
                                  frag_color = v_col;
+                                 write_overdraw();
                              }
                              );
     
@@ -99,10 +104,10 @@ gl_lines_init_device(void)
     
     GLuint binding_idx = 0;
     glCreateVertexArrays( 1, &device->vao );
-    glCreateBuffers( 1, &device->vbo );
-    glNamedBufferStorage( device->vbo, MAX_VERTS * sizeof(vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT );
+    gl_utils_buffer_init( &device->vbo );
+    device->mem_stats.gpu_buffer_bytes = device->vbo.size;
     
-    glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo, 0, sizeof(vertex_t) );
+    glVertexArrayVertexBuffer( device->vao, binding_idx, device->vbo.buffer, 0, sizeof(vertex_t) );
     
     glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width );
     glEnableVertexArrayAttrib( device->vao, device->attribs.col );
@@ -121,14 +126,15 @@ gl_lines_term_device( void** device_in )
 {
     gl_lines_device_t* device = *device_in;
     glDeleteProgram( device->program_id );
-    glDeleteBuffers( 1, &device->vbo );
+    gl_utils_buffer_term( &device->vbo );
     glDeleteVertexArrays( 1, &device->vao );
     free( device );
     *device_in = NULL;
 }
 
 uint32_t
-gl_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size, uniform_data_t* uniform_data )
+gl_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                        const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
     gl_lines_device_t* device = device_in;
     
@@ -136,13 +142,35 @@ gl_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t ele
     device->vertex_data     = (vertex_t*)data;
     device->vertex_data_len = n_elems;
     
-    glNamedBufferSubData( device->vbo, 0, n_elems*elem_size, data );
+    device->mem_stats.uploaded_bytes = 0;
+    profiler_trace_begin( "upload" );
+    if( gl_utils_buffer_upload( &device->vbo, data, n_elems, elem_size, ranges, n_ranges,
+                                &device->mem_stats.uploaded_bytes ) )
+    {
+        glVertexArrayVertexBuffer( device->vao, 0, device->vbo.buffer, 0, sizeof(vertex_t) );
+        device->mem_stats.gpu_buffer_bytes = device->vbo.size;
+    }
+    profiler_trace_end();
+    device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
     
     return n_elems;
 }
 
+uint32_t
+gl_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size, uniform_data_t* uniform_data )
+{
+    return gl_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+gl_lines_memory_stats( const void* device_in )
+{
+    const gl_lines_device_t* device = device_in;
+    return device->mem_stats;
+}
+
 void
-gl_lines_render( const void* device_in, const int32_t count )
+gl_lines_render( void* device_in, const int32_t count )
 {
     const gl_lines_device_t* device = device_in;
     
@@ -4,6 +4,39 @@
 #define GL_UTILS_SHDR_VERSION "#version 450\n"
 #define GL_UTILS_SHDR_SOURCE(x) #x
 
+// Fragment shader outputs shared by all methods. Location 1 is only attached in overdraw mode, where it accumulates
+// the number of fragments and the number of fragments with zero coverage; otherwise these writes are dropped.
+#define GL_UTILS_SHDR_FRAG_OUTPUTS \
+    "layout(location = 0) out vec4 frag_color;\n" \
+    "layout(location = 1) out vec4 frag_overdraw;\n" \
+    "void write_overdraw() { frag_overdraw = vec4( 1.0, frag_color.a < (0.5 / 255.0) ? 1.0 : 0.0, 0.0, 0.0 ); }\n"
+
+// Projection variants of the vertex processing stages, which go to clip space and back through project(), to_ndc()
+// and from_ndc(). The affine variant is meant for projections that leave w at 1, like the orthographic camera - it
+// transforms with the upper 3x4 part of the matrix, and drops the divide by w and the multiplication that undoes it.
+#define GL_UTILS_SHDR_PROJECTIVE \
+    "vec4 project( mat4 mvp, vec3 pos ) { return mvp * vec4( pos, 1.0 ); }\n" \
+    "vec2 to_ndc( vec4 clip_pos ) { return clip_pos.xy / clip_pos.w; }\n" \
+    "vec4 from_ndc( vec2 ndc_pos, vec2 zw ) { return vec4( ndc_pos * zw.y, zw ); }\n"
+
+#define GL_UTILS_SHDR_AFFINE \
+    "vec4 project( mat4 mvp, vec3 pos ) { return vec4( mat4x3( mvp ) * vec4( pos, 1.0 ), 1.0 ); }\n" \
+    "vec2 to_ndc( vec4 clip_pos ) { return clip_pos.xy; }\n" \
+    "vec4 from_ndc( vec2 ndc_pos, vec2 zw ) { return vec4( ndc_pos, zw.x, 1.0 ); }\n"
+
+
+int32_t
+gl_utils_has_extension( const char* name )
+{
+    GLint n_extensions = 0;
+    glGetIntegerv( GL_NUM_EXTENSIONS, &n_extensions );
+    for( GLint i = 0; i < n_extensions; ++i )
+    {
+        const char* extension = (const char*)glGetStringi( GL_EXTENSIONS, i );
+        if( extension && !strcmp( extension, name ) ) { return 1; }
+    }
+    return 0;
+}
 
 void
 gl_utils_assert_shader_compiled( GLuint shader_id, const char* name )
@@ -45,6 +78,435 @@ gl_utils_assert_program_linked( GLuint program_id )
     }
 }
 
+// True when the column-major 'mvp' has (0, 0, 0, 1) as its last row, so that w stays 1 for every point.
+int32_t
+gl_utils_is_affine( const float* mvp )
+{
+    return mvp[3] == 0.0f && mvp[7] == 0.0f && mvp[11] == 0.0f && mvp[15] == 1.0f;
+}
+
+// Compiles the vertex and, when given, geometry shader with the version, 'projection' and 'input' (optional, e.g. the
+// declarations of how the data is read) in front of their sources, and links them with an already compiled fragment
+// shader. Sources passed here must not have their own #version.
+GLuint
+gl_utils_create_program_variant( const char* projection, const char* input, const char* vs_src, const char* gs_src,
+                                 GLuint fragment_shader )
+{
+    GLuint program_id = glCreateProgram();
+    GLuint shaders[2] = { 0, 0 };
+    const GLenum types[2] = { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER };
+    const char* names[2] = { "VERTEX_SHADER", "GEOMETRY_SHADER" };
+    const char* srcs[2] = { vs_src, gs_src };
+    for( int32_t i = 0; i < 2; ++i )
+    {
+        if( !srcs[i] ) { continue; }
+        const char* strings[4] = { GL_UTILS_SHDR_VERSION, projection, input ? input : "", srcs[i] };
+        shaders[i] = glCreateShader( types[i] );
+        glShaderSource( shaders[i], 4, strings, 0 );
+        glCompileShader( shaders[i] );
+        gl_utils_assert_shader_compiled( shaders[i], names[i] );
+        glAttachShader( program_id, shaders[i] );
+    }
+    glAttachShader( program_id, fragment_shader );
+    glLinkProgram( program_id );
+    gl_utils_assert_program_linked( program_id );
+
+    glDetachShader( program_id, fragment_shader );
+    for( int32_t i = 0; i < 2; ++i )
+    {
+        if( !shaders[i] ) { continue; }
+        glDetachShader( program_id, shaders[i] );
+        glDeleteShader( shaders[i] );
+    }
+    return program_id;
+}
+
+// Buffer storage is sized to the data instead of up front. Capacities start at GL_UTILS_BUFFER_MIN_SIZE and double
+// until the data fits; after GL_UTILS_BUFFER_SHRINK_UPDATES consecutive updates that use less than a quarter of the
+// capacity, it is halved while that still leaves twice the data size.
+#define GL_UTILS_BUFFER_MIN_SIZE (64 * 1024)
+#define GL_UTILS_BUFFER_SHRINK_UPDATES 120
+
+size_t
+gl_utils_next_capacity( size_t capacity, size_t size, uint32_t* n_low_use_updates )
+{
+    size_t new_capacity = msh_max( capacity, (size_t)GL_UTILS_BUFFER_MIN_SIZE );
+    while( new_capacity < size ) { new_capacity *= 2; }
+    if( new_capacity != capacity || 4 * size >= capacity )
+    {
+        *n_low_use_updates = 0;
+        return new_capacity;
+    }
+    if( ++(*n_low_use_updates) < GL_UTILS_BUFFER_SHRINK_UPDATES ) { return capacity; }
+
+    *n_low_use_updates = 0;
+    while( new_capacity / 2 >= GL_UTILS_BUFFER_MIN_SIZE && 2 * size <= new_capacity / 2 ) { new_capacity /= 2; }
+    return new_capacity;
+}
+
+// Buffer with immutable storage for data that is replaced with glNamedBufferSubData on every update. Storage cannot
+// be resized, so gl_utils_buffer_fit() creates a new buffer object when the capacity changes - the contents are not
+// kept, and vertex array or texture bindings have to be updated.
+typedef struct gl_utils_buffer
+{
+    GLuint buffer;
+    size_t size;
+    // Bytes written by the last gl_utils_buffer_upload(), which later partial uploads build on.
+    size_t used;
+    uint32_t n_low_use_updates;
+} gl_utils_buffer_t;
+
+// Returns 1 when the buffer object was replaced.
+int32_t
+gl_utils_buffer_fit( gl_utils_buffer_t* buf, size_t size )
+{
+    size_t capacity = gl_utils_next_capacity( buf->size, size, &buf->n_low_use_updates );
+    if( capacity == buf->size ) { return 0; }
+    // Draws still reading the old storage keep it alive until they are done.
+    if( buf->buffer ) { glDeleteBuffers( 1, &buf->buffer ); }
+    glCreateBuffers( 1, &buf->buffer );
+    glNamedBufferStorage( buf->buffer, capacity, NULL, GL_DYNAMIC_STORAGE_BIT );
+    buf->size = capacity;
+    return 1;
+}
+
+// Resizes the buffer to 'n_elems' elements of 'elem_size' bytes and uploads them. With 'ranges' set, only those
+// elements, and the ones past the previous upload, differ from what the buffer holds, and only they are sent - unless
+// the buffer had to be replaced. Adds the bytes sent to 'uploaded_bytes'. Returns 1 when the buffer was replaced.
+int32_t
+gl_utils_buffer_upload( gl_utils_buffer_t* buf, const void* data, uint32_t n_elems, size_t elem_size,
+                        const line_range_t* ranges, int32_t n_ranges, uint64_t* uploaded_bytes )
+{
+    size_t size = (size_t)n_elems * elem_size;
+    int32_t replaced = gl_utils_buffer_fit( buf, size );
+    size_t n_kept = (replaced || !ranges) ? 0 : msh_min( buf->used, size ) / elem_size;
+    for( int32_t i = 0; n_kept && i < n_ranges; ++i )
+    {
+        size_t begin = msh_min( (size_t)ranges[i].first, n_kept ) * elem_size;
+        size_t end = msh_min( (size_t)ranges[i].first + ranges[i].count, n_kept ) * elem_size;
+        if( begin == end ) { continue; }
+        glNamedBufferSubData( buf->buffer, begin, end - begin, (const uint8_t*)data + begin );
+        *uploaded_bytes += end - begin;
+    }
+    size_t tail = n_kept * elem_size;
+    if( size > tail )
+    {
+        glNamedBufferSubData( buf->buffer, tail, size - tail, (const uint8_t*)data + tail );
+        *uploaded_bytes += size - tail;
+    }
+    buf->used = size;
+    return replaced;
+}
+
+void
+gl_utils_buffer_init( gl_utils_buffer_t* buf )
+{
+    memset( buf, 0, sizeof(gl_utils_buffer_t) );
+    gl_utils_buffer_fit( buf, 0 );
+}
+
+void
+gl_utils_buffer_term( gl_utils_buffer_t* buf )
+{
+    if( buf->buffer ) { glDeleteBuffers( 1, &buf->buffer ); }
+    memset( buf, 0, sizeof(gl_utils_buffer_t) );
+}
+
+// Persistently mapped buffer that the CPU writes into while the GPU still reads earlier contents, without copies.
+// Space is handed out as a ring of variable-sized regions. Each region is guarded by a fence, issued when the next
+// region is reserved - after the draws reading it - and its memory is reused only once that fence has signaled.
+#define GL_UTILS_STREAM_MAX_REGIONS 8
+
+// Frames of data that rings sized with gl_utils_stream_buffer_reserve_frame() hold, so that writing a frame only
+// waits when the GPU is that many frames behind.
+#define GL_UTILS_STREAM_FRAMES 3
+
+typedef struct gl_utils_stream_region
+{
+    GLsync fence;
+    size_t begin;
+    size_t end;
+} gl_utils_stream_region_t;
+
+typedef struct gl_utils_stream_buffer
+{
+    GLuint buffer;
+    uint8_t* mapped;
+    size_t size;
+    size_t head;
+
+    // Regions the GPU may still read, oldest first. The newest one gets its fence on the next reservation.
+    gl_utils_stream_region_t regions[GL_UTILS_STREAM_MAX_REGIONS];
+    int32_t first_region;
+    int32_t n_regions;
+
+    // Reservations that had to wait for the GPU.
+    uint64_t n_stalls;
+
+    uint32_t n_low_use_updates;
+} gl_utils_stream_buffer_t;
+
+int32_t
+gl_utils_stream_buffer_init( gl_utils_stream_buffer_t* stream, size_t size )
+{
+    memset( stream, 0, sizeof(gl_utils_stream_buffer_t) );
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers( 1, &stream->buffer );
+    glNamedBufferStorage( stream->buffer, size, NULL, flags );
+    stream->mapped = glMapNamedBufferRange( stream->buffer, 0, size, flags );
+    if( !stream->mapped )
+    {
+        fprintf( stderr, "[GL] Failed to persistently map a buffer of %zu bytes\n", size );
+        glDeleteBuffers( 1, &stream->buffer );
+        memset( stream, 0, sizeof(gl_utils_stream_buffer_t) );
+        return 0;
+    }
+    stream->size = size;
+    return 1;
+}
+
+void
+gl_utils_stream_buffer_term( gl_utils_stream_buffer_t* stream )
+{
+    for( int32_t i = 0; i < stream->n_regions; ++i )
+    {
+        GLsync fence = stream->regions[(stream->first_region + i) % GL_UTILS_STREAM_MAX_REGIONS].fence;
+        if( fence ) { glDeleteSync( fence ); }
+    }
+    if( stream->buffer )
+    {
+        glUnmapNamedBuffer( stream->buffer );
+        glDeleteBuffers( 1, &stream->buffer );
+    }
+    memset( stream, 0, sizeof(gl_utils_stream_buffer_t) );
+}
+
+// Waits for the region's fence, issuing it first if needed, and deletes it. Returns whether the GPU was still using
+// the region.
+static int32_t
+gl_utils__stream_buffer_wait( gl_utils_stream_region_t* region )
+{
+    if( !region->fence ) { region->fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 ); }
+    int32_t waited = 0;
+    for( ;; )
+    {
+        GLenum status = glClientWaitSync( region->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 );
+        if( status == GL_ALREADY_SIGNALED ) { break; }
+        waited = 1;
+        if( status == GL_CONDITION_SATISFIED ) { break; }
+        if( status == GL_WAIT_FAILED )
+        {
+            fprintf( stderr, "[GL] Waiting for a stream buffer fence failed\n" );
+            break;
+        }
+    }
+    glDeleteSync( region->fence );
+    region->fence = NULL;
+    return waited;
+}
+
+static int32_t
+gl_utils__stream_buffer_retire_oldest( gl_utils_stream_buffer_t* stream )
+{
+    int32_t waited = gl_utils__stream_buffer_wait( stream->regions + stream->first_region );
+    stream->first_region = (stream->first_region + 1) % GL_UTILS_STREAM_MAX_REGIONS;
+    stream->n_regions--;
+    return waited;
+}
+
+static int32_t
+gl_utils__stream_buffer_is_free( const gl_utils_stream_buffer_t* stream, size_t begin, size_t end )
+{
+    for( int32_t i = 0; i < stream->n_regions; ++i )
+    {
+        const gl_utils_stream_region_t* region =
+            stream->regions + (stream->first_region + i) % GL_UTILS_STREAM_MAX_REGIONS;
+        if( region->begin < end && begin < region->end ) { return 0; }
+    }
+    return 1;
+}
+
+// Returns 'size' writable bytes starting at a multiple of 'alignment', and their offset in the buffer. Waits for the
+// GPU if that memory may still be read. The region stays reserved until the GPU is done with the commands issued
+// before the next reservation; NULL if the buffer is too small altogether.
+void*
+gl_utils_stream_buffer_reserve( gl_utils_stream_buffer_t* stream, size_t size, size_t alignment, size_t* offset )
+{
+    if( size > stream->size ) { return NULL; }
+
+    if( stream->n_regions )
+    {
+        int32_t newest = (stream->first_region + stream->n_regions - 1) % GL_UTILS_STREAM_MAX_REGIONS;
+        if( !stream->regions[newest].fence )
+        {
+            stream->regions[newest].fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        }
+    }
+
+    size_t begin = (stream->head + alignment - 1) / alignment * alignment;
+    if( begin + size > stream->size ) { begin = 0; }
+    size_t end = begin + size;
+
+    int32_t stalled = 0;
+    while( stream->n_regions == GL_UTILS_STREAM_MAX_REGIONS ||
+           (stream->n_regions && !gl_utils__stream_buffer_is_free( stream, begin, end )) )
+    {
+        stalled |= gl_utils__stream_buffer_retire_oldest( stream );
+    }
+    stream->n_stalls += stalled;
+
+    int32_t idx = (stream->first_region + stream->n_regions) % GL_UTILS_STREAM_MAX_REGIONS;
+    stream->regions[idx] = (gl_utils_stream_region_t){ .fence = NULL, .begin = begin, .end = end };
+    stream->n_regions++;
+    stream->head = end;
+    *offset = begin;
+    return stream->mapped + begin;
+}
+
+// Gives back the unused end of the latest reservation, once the number of bytes actually written is known.
+void
+gl_utils_stream_buffer_commit( gl_utils_stream_buffer_t* stream, size_t used )
+{
+    if( !stream->n_regions ) { return; }
+    int32_t newest = (stream->first_region + stream->n_regions - 1) % GL_UTILS_STREAM_MAX_REGIONS;
+    gl_utils_stream_region_t* region = stream->regions + newest;
+    region->end = msh_min( region->begin + used, region->end );
+    stream->head = region->end;
+}
+
+// Finds the region reserved before the latest one that holds the 'size' bytes at 'offset', so that they can be copied
+// into the latest one on the GPU, without waiting for the draws still reading them. NULL if that memory may have been
+// handed out again. The region has to be fenced again once the copies are issued, see gl_utils_stream_buffer_refence().
+gl_utils_stream_region_t*
+gl_utils_stream_buffer_find_previous( gl_utils_stream_buffer_t* stream, size_t offset, size_t size )
+{
+    gl_utils_stream_region_t* found = NULL;
+    for( int32_t i = 0; i < stream->n_regions - 1; ++i )
+    {
+        gl_utils_stream_region_t* region = stream->regions + (stream->first_region + i) % GL_UTILS_STREAM_MAX_REGIONS;
+        if( region->begin <= offset && offset + size <= region->end ) { found = region; }
+    }
+    return found;
+}
+
+// Tells whether the latest reservation holds the 'size' bytes at 'offset'. Its fence only goes in with the next
+// reservation, so draws issued from it until then are still covered, without reserving anything new.
+int32_t
+gl_utils_stream_buffer_is_latest( const gl_utils_stream_buffer_t* stream, size_t offset, size_t size )
+{
+    if( !stream->n_regions ) { return 0; }
+    int32_t newest = (stream->first_region + stream->n_regions - 1) % GL_UTILS_STREAM_MAX_REGIONS;
+    const gl_utils_stream_region_t* region = stream->regions + newest;
+    return !region->fence && region->begin <= offset && offset + size <= region->end;
+}
+
+// Its fence went in before the copies out of it; the new one covers them too.
+void
+gl_utils_stream_buffer_refence( gl_utils_stream_region_t* region )
+{
+    if( region->fence ) { glDeleteSync( region->fence ); }
+    region->fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+// Resizes the ring to hold 'size' bytes, following gl_utils_next_capacity. Returns 1 when the buffer object was
+// replaced, which drops all regions; on failure 'mapped' is NULL afterwards. Unmapping and deleting storage that
+// draws still read from is fine - GL keeps it alive until they are done.
+int32_t
+gl_utils_stream_buffer_fit( gl_utils_stream_buffer_t* stream, size_t size )
+{
+    size_t capacity = gl_utils_next_capacity( stream->size, size, &stream->n_low_use_updates );
+    if( capacity == stream->size ) { return 0; }
+
+    uint64_t n_stalls = stream->n_stalls;
+    gl_utils_stream_buffer_term( stream );
+    gl_utils_stream_buffer_init( stream, capacity );
+    stream->n_stalls = n_stalls;
+    return 1;
+}
+
+// Reserves 'size' bytes for this frame's data, after resizing the ring to hold GL_UTILS_STREAM_FRAMES frames of that
+// size. 'replaced' (optional) tells whether the earlier frames were lost to a new buffer object. Returns NULL if the
+// ring could not be allocated.
+void*
+gl_utils_stream_buffer_reserve_frame( gl_utils_stream_buffer_t* stream, size_t size, size_t alignment, size_t* offset,
+                                      int32_t* replaced )
+{
+    int32_t fit_replaced = gl_utils_stream_buffer_fit( stream, GL_UTILS_STREAM_FRAMES * (size + alignment) );
+    if( replaced ) { *replaced = fit_replaced; }
+    if( !stream->mapped ) { return NULL; }
+    return gl_utils_stream_buffer_reserve( stream, size, alignment, offset );
+}
+
+// Converts elements of 'src_elem_size' bytes to the layout held by a buffer, e.g. packed_vertex_encode().
+typedef struct gl_utils_encoder
+{
+    void (*encode)( void* dst, const void* src, uint32_t n_elems, const void* user_data );
+    const void* user_data;
+    size_t src_elem_size;
+} gl_utils_encoder_t;
+
+static void
+gl_utils__write_elems( uint8_t* dst, const void* data, uint32_t first, uint32_t count, size_t elem_size,
+                       const gl_utils_encoder_t* encoder )
+{
+    if( encoder )
+    {
+        const uint8_t* src = (const uint8_t*)data + first * encoder->src_elem_size;
+        encoder->encode( dst + first * elem_size, src, count, encoder->user_data );
+    }
+    else
+    {
+        memcpy( dst + first * elem_size, (const uint8_t*)data + first * elem_size, (size_t)count * elem_size );
+    }
+}
+
+// Fills the region reserved at 'offset' with this frame's 'n_elems' elements of 'elem_size' bytes, given that the
+// previous frame left 'n_prev_elems' elements at 'prev_offset', and that only 'ranges' changed since then. Unchanged
+// elements are copied over on the GPU, which needs no wait for the draws still reading the previous frame; the changed
+// ones, and any past the previous count, are written from 'data' - through 'encoder' if given, otherwise as they are.
+// Without ranges, or with no previous elements, everything is written. Returns the number of bytes written.
+size_t
+gl_utils_stream_buffer_write( gl_utils_stream_buffer_t* stream, size_t offset, const void* data, uint32_t n_elems,
+                              size_t elem_size, const gl_utils_encoder_t* encoder,
+                              const line_range_t* ranges, int32_t n_ranges, size_t prev_offset, uint32_t n_prev_elems )
+{
+    uint8_t* dst = stream->mapped + offset;
+    size_t size = (size_t)n_elems * elem_size;
+
+    // Copying needs the previous frame to still be reserved - otherwise the reservation may have reused its memory,
+    // and nothing would keep later ones from doing so before the copies are done.
+    uint32_t n_kept = ranges ? msh_min( n_elems, n_prev_elems ) : 0;
+    gl_utils_stream_region_t* prev_region =
+        n_kept ? gl_utils_stream_buffer_find_previous( stream, prev_offset, (size_t)n_prev_elems * elem_size ) : NULL;
+    if( !prev_region ) { n_kept = 0; }
+
+    size_t written = 0;
+    uint32_t clean_begin = 0;
+    for( int32_t i = 0; n_kept && i < n_ranges; ++i )
+    {
+        uint32_t begin = msh_min( ranges[i].first, n_kept );
+        uint32_t end = msh_min( ranges[i].first + ranges[i].count, n_kept );
+        if( begin > clean_begin )
+        {
+            glCopyNamedBufferSubData( stream->buffer, stream->buffer, prev_offset + clean_begin * elem_size,
+                                      offset + clean_begin * elem_size, (size_t)(begin - clean_begin) * elem_size );
+        }
+        gl_utils__write_elems( dst, data, begin, end - begin, elem_size, encoder );
+        written += (size_t)(end - begin) * elem_size;
+        clean_begin = msh_max( clean_begin, end );
+    }
+    if( n_kept > clean_begin )
+    {
+        glCopyNamedBufferSubData( stream->buffer, stream->buffer, prev_offset + clean_begin * elem_size,
+                                  offset + clean_begin * elem_size, (size_t)(n_kept - clean_begin) * elem_size );
+    }
+    gl_utils__write_elems( dst, data, n_kept, n_elems - n_kept, elem_size, encoder );
+    written += size - (size_t)n_kept * elem_size;
+
+    if( prev_region ) { gl_utils_stream_buffer_refence( prev_region ); }
+    return written;
+}
+
 void gl_utils_debug_msg_call_back( GLenum src, GLenum type, GLuint id, GLenum severity,
                                   GLsizei length, GLchar const* msg,
                                   void const* user_params )
@@ -0,0 +1,172 @@
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+// Golden image comparisons. The framebuffer is read back as 8-bit RGB and compared against a reference image stored
+// as binary ppm. A pixel mismatches when any of its channels differs by more than 'tolerance'; a comparison passes
+// when the fraction of mismatching pixels is at most 'max_mismatch_fraction'. For failed comparisons a diff image is
+// produced, with mismatching pixels in red over a faded copy of the reference.
+
+typedef struct golden_image
+{
+    int32_t width;
+    int32_t height;
+    uint8_t* pixels;
+} golden_image_t;
+
+typedef struct golden_result
+{
+    int32_t size_matches;
+    uint64_t n_mismatched;
+    int32_t max_difference;
+} golden_result_t;
+
+int32_t golden_image_init( golden_image_t* image, int32_t width, int32_t height );
+void golden_image_term( golden_image_t* image );
+void golden_capture( golden_image_t* image );
+int32_t golden_read_ppm( golden_image_t* image, const char* filename );
+int32_t golden_write_ppm( const golden_image_t* image, const char* filename );
+golden_result_t golden_compare( const golden_image_t* reference, const golden_image_t* image, int32_t tolerance,
+                                golden_image_t* diff );
+void golden_make_filename( char* buf, size_t buf_size, const char* dir, const char* name, const char* suffix );
+
+#endif /* GOLDEN_H */
+
+#ifdef GOLDEN_IMPLEMENTATION
+
+int32_t
+golden_image_init( golden_image_t* image, int32_t width, int32_t height )
+{
+    image->width = width;
+    image->height = height;
+    image->pixels = calloc( (size_t)width * height * 3, 1 );
+    return image->pixels != NULL;
+}
+
+void
+golden_image_term( golden_image_t* image )
+{
+    free( image->pixels );
+    memset( image, 0, sizeof(golden_image_t) );
+}
+
+// Reads the currently bound framebuffer. OpenGL stores the bottom row first, ppm the top one.
+void
+golden_capture( golden_image_t* image )
+{
+    size_t row_size = (size_t)image->width * 3;
+    uint8_t* rows = malloc( row_size * image->height );
+    glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+    glReadPixels( 0, 0, image->width, image->height, GL_RGB, GL_UNSIGNED_BYTE, rows );
+    for( int32_t y = 0; y < image->height; ++y )
+    {
+        memcpy( image->pixels + y * row_size, rows + (image->height - 1 - y) * row_size, row_size );
+    }
+    free( rows );
+}
+
+static int32_t
+golden__read_ppm_int( FILE* fp, int32_t* value )
+{
+    int c = fgetc( fp );
+    while( c != EOF )
+    {
+        if( c == '#' ) { while( c != EOF && c != '\n' ) { c = fgetc( fp ); } }
+        else if( !isspace( c ) ) { break; }
+        c = fgetc( fp );
+    }
+    if( c == EOF ) { return 0; }
+    ungetc( c, fp );
+    return fscanf( fp, "%d", value ) == 1;
+}
+
+int32_t
+golden_read_ppm( golden_image_t* image, const char* filename )
+{
+    FILE* fp = fopen( filename, "rb" );
+    if( !fp )
+    {
+        fprintf( stderr, "[Golden] Failed to open %s\n", filename );
+        return 0;
+    }
+
+    char magic[2] = {0};
+    int32_t width = 0, height = 0, max_value = 0;
+    int32_t valid = fread( magic, 1, 2, fp ) == 2 && magic[0] == 'P' && magic[1] == '6' &&
+                    golden__read_ppm_int( fp, &width ) && golden__read_ppm_int( fp, &height ) &&
+                    golden__read_ppm_int( fp, &max_value ) && max_value == 255 &&
+                    width > 0 && height > 0;
+    // Single whitespace character separates the header from the pixel data.
+    if( valid ) { fgetc( fp ); }
+    valid = valid && golden_image_init( image, width, height );
+    valid = valid && fread( image->pixels, 3, (size_t)width * height, fp ) == (size_t)width * height;
+    fclose( fp );
+
+    if( !valid )
+    {
+        fprintf( stderr, "[Golden] %s is not a valid 8-bit binary ppm\n", filename );
+        golden_image_term( image );
+        return 0;
+    }
+    return 1;
+}
+
+int32_t
+golden_write_ppm( const golden_image_t* image, const char* filename )
+{
+    FILE* fp = fopen( filename, "wb" );
+    if( !fp )
+    {
+        fprintf( stderr, "[Golden] Failed to open %s for writing\n", filename );
+        return 0;
+    }
+    fprintf( fp, "P6\n%d %d\n255\n", image->width, image->height );
+    fwrite( image->pixels, 3, (size_t)image->width * image->height, fp );
+    fclose( fp );
+    return 1;
+}
+
+golden_result_t
+golden_compare( const golden_image_t* reference, const golden_image_t* image, int32_t tolerance,
+                golden_image_t* diff )
+{
+    golden_result_t result = {0};
+    if( reference->width != image->width || reference->height != image->height ) { return result; }
+    result.size_matches = 1;
+
+    size_t n_pixels = (size_t)image->width * image->height;
+    for( size_t i = 0; i < n_pixels; ++i )
+    {
+        const uint8_t* a = reference->pixels + 3 * i;
+        const uint8_t* b = image->pixels + 3 * i;
+        int32_t difference = 0;
+        for( int32_t c = 0; c < 3; ++c ) { difference = msh_max( difference, abs( (int32_t)a[c] - (int32_t)b[c] ) ); }
+        result.max_difference = msh_max( result.max_difference, difference );
+
+        int32_t mismatch = difference > tolerance;
+        result.n_mismatched += mismatch;
+        if( diff )
+        {
+            uint8_t* d = diff->pixels + 3 * i;
+            if( mismatch ) { d[0] = 255; d[1] = 0; d[2] = 0; }
+            else           { for( int32_t c = 0; c < 3; ++c ) { d[c] = 192 + a[c] / 4; } }
+        }
+    }
+    return result;
+}
+
+// Builds "<dir>/<name><suffix>", with the name lowercased and anything that is not alphanumeric replaced by '_'.
+void
+golden_make_filename( char* buf, size_t buf_size, const char* dir, const char* name, const char* suffix )
+{
+    char slug[128] = {0};
+    size_t len = 0;
+    for( const char* c = name; *c && len < sizeof(slug) - 1; ++c )
+    {
+        if( isalnum( *c ) ) { slug[len++] = tolower( *c ); }
+        else if( len && slug[len - 1] != '_' ) { slug[len++] = '_'; }
+    }
+    while( len && slug[len - 1] == '_' ) { slug[--len] = 0; }
+    snprintf( buf, buf_size, "%s/%s%s", dir, slug, suffix );
+}
+
+#endif /*GOLDEN_IMPLEMENTATION*/
@@ -0,0 +1,173 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Headless context for machines without a display. We ask EGL for a surfaceless display
+// (EGL_MESA_platform_surfaceless, which also covers llvmpipe), create a core 4.5 context without
+// any surface, and render into an offscreen framebuffer instead of the default one.
+
+typedef struct headless_context
+{
+    EGLDisplay display;
+    EGLContext context;
+    EGLConfig config;
+    EGLint context_attribs[9];
+
+    GLuint fbo;
+    GLuint color_rb;
+    int32_t width;
+    int32_t height;
+} headless_context_t;
+
+int32_t headless_init( headless_context_t* ctx, int32_t width, int32_t height, int32_t debug );
+void headless_bind_framebuffer( const headless_context_t* ctx );
+void headless_term( headless_context_t* ctx );
+
+// Second context sharing objects with the main one, to be made current on another thread (see async_upload.h).
+typedef struct headless_shared_context
+{
+    EGLDisplay display;
+    EGLContext context;
+} headless_shared_context_t;
+
+int32_t headless_create_shared_context( const headless_context_t* ctx, headless_shared_context_t* shared );
+int32_t headless_make_shared_context_current( void* shared, int32_t current );
+void headless_destroy_shared_context( headless_shared_context_t* shared );
+
+#endif /* HEADLESS_H */
+
+#ifdef HEADLESS_IMPLEMENTATION
+
+int32_t
+headless_init( headless_context_t* ctx, int32_t width, int32_t height, int32_t debug )
+{
+    memset( ctx, 0, sizeof(headless_context_t) );
+    ctx->width = width;
+    ctx->height = height;
+
+    // Prefer the surfaceless platform, as the default display might try to connect to X11/Wayland.
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+    ctx->display = EGL_NO_DISPLAY;
+    if( get_platform_display )
+    {
+        ctx->display = get_platform_display( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+    }
+    if( ctx->display == EGL_NO_DISPLAY )
+    {
+        ctx->display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+    }
+
+    EGLint major, minor;
+    if( ctx->display == EGL_NO_DISPLAY || !eglInitialize( ctx->display, &major, &minor ) )
+    {
+        fprintf( stderr, "[EGL] Failed to initialize display (0x%x)\n", eglGetError() );
+        return 0;
+    }
+
+    if( !eglBindAPI( EGL_OPENGL_API ) )
+    {
+        fprintf( stderr, "[EGL] OpenGL API is not supported\n" );
+        return 0;
+    }
+
+    const EGLint config_attribs[] =
+    {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint n_configs = 0;
+    eglChooseConfig( ctx->display, config_attribs, &config, 1, &n_configs );
+
+    const EGLint context_attribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 5,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_CONTEXT_OPENGL_DEBUG, debug ? EGL_TRUE : EGL_FALSE,
+        EGL_NONE
+    };
+    // Surfaceless displays might not expose any configs, in which case we rely on EGL_KHR_no_config_context.
+    ctx->config = n_configs ? config : EGL_NO_CONFIG_KHR;
+    memcpy( ctx->context_attribs, context_attribs, sizeof(context_attribs) );
+    ctx->context = eglCreateContext( ctx->display, ctx->config, EGL_NO_CONTEXT, context_attribs );
+    if( ctx->context == EGL_NO_CONTEXT )
+    {
+        fprintf( stderr, "[EGL] Failed to create OpenGL 4.5 context (0x%x)\n", eglGetError() );
+        return 0;
+    }
+
+    if( !eglMakeCurrent( ctx->display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx->context ) )
+    {
+        fprintf( stderr, "[EGL] Failed to make context current (0x%x)\n", eglGetError() );
+        return 0;
+    }
+
+    if( !gladLoadGLLoader( (GLADloadproc)eglGetProcAddress ) )
+    {
+        fprintf( stderr, "[EGL] Failed to load OpenGL functions\n" );
+        return 0;
+    }
+
+    // There is no default framebuffer, so everything is drawn into this one.
+    glCreateRenderbuffers( 1, &ctx->color_rb );
+    glNamedRenderbufferStorage( ctx->color_rb, GL_RGBA8, width, height );
+    glCreateFramebuffers( 1, &ctx->fbo );
+    glNamedFramebufferRenderbuffer( ctx->fbo, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, ctx->color_rb );
+    if( glCheckNamedFramebufferStatus( ctx->fbo, GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+    {
+        fprintf( stderr, "[EGL] Offscreen framebuffer is incomplete\n" );
+        return 0;
+    }
+    headless_bind_framebuffer( ctx );
+
+    return 1;
+}
+
+void
+headless_bind_framebuffer( const headless_context_t* ctx )
+{
+    glBindFramebuffer( GL_FRAMEBUFFER, ctx->fbo );
+}
+
+void
+headless_term( headless_context_t* ctx )
+{
+    glDeleteFramebuffers( 1, &ctx->fbo );
+    glDeleteRenderbuffers( 1, &ctx->color_rb );
+    eglMakeCurrent( ctx->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+    eglDestroyContext( ctx->display, ctx->context );
+    eglTerminate( ctx->display );
+    memset( ctx, 0, sizeof(headless_context_t) );
+}
+
+int32_t
+headless_create_shared_context( const headless_context_t* ctx, headless_shared_context_t* shared )
+{
+    shared->display = ctx->display;
+    shared->context = eglCreateContext( ctx->display, ctx->config, ctx->context, ctx->context_attribs );
+    if( shared->context == EGL_NO_CONTEXT )
+    {
+        fprintf( stderr, "[EGL] Failed to create shared context (0x%x)\n", eglGetError() );
+        return 0;
+    }
+    return 1;
+}
+
+int32_t
+headless_make_shared_context_current( void* shared_in, int32_t current )
+{
+    headless_shared_context_t* shared = shared_in;
+    return eglMakeCurrent( shared->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                           current ? shared->context : EGL_NO_CONTEXT ) == EGL_TRUE;
+}
+
+void
+headless_destroy_shared_context( headless_shared_context_t* shared )
+{
+    if( shared->context != EGL_NO_CONTEXT ) { eglDestroyContext( shared->display, shared->context ); }
+    memset( shared, 0, sizeof(headless_shared_context_t) );
+}
+
+#endif /*HEADLESS_IMPLEMENTATION*/
@@ -4,8 +4,26 @@
 void* instancing_lines_init_device( void );
 uint32_t instancing_lines_update( void* device, const void* data, int32_t n_elems, int32_t elem_size, 
                                   uniform_data_t* uniform_data );
-void instancing_lines_render( const void* device, const int32_t count );
+uint32_t instancing_lines_update_ranges( void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                         const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data );
+void instancing_lines_render( void* device, const int32_t count );
 void instancing_lines_term_device( void** );
+memory_stats_t instancing_lines_memory_stats( const void* device );
+
+// Upload the vertices as packed_vertex_t, read as integer attributes and decoded in the vertex shader. Off by default.
+// Takes effect for devices created afterwards.
+void instancing_lines_set_packed_input( bool packed );
+
+// Hand the uploads to 'worker' (see async_upload.h), and draw whatever upload completed last. Ranged updates upload
+// everything, and the input is not packed. NULL, the default, uploads in the update. Takes effect for devices created
+// afterwards.
+void instancing_lines_set_async_upload( async_upload_worker_t* worker );
+
+// Retained line sets (see line_set.h) in the input layout of 'device', drawn with the vertex array pointing at their
+// own buffer instead of the device's. Creating one returns NULL on failure.
+line_set_t* instancing_lines_create_line_set( const void* device, const void* data, int32_t n_elems,
+                                              int32_t elem_size );
+void instancing_lines_draw_line_set( const void* device, const line_set_t* set, uniform_data_t* uniform_data );
 
 #endif /* INSTANCING_LINES_H */
 
@@ -14,16 +32,31 @@ void instancing_lines_term_device( void** );
 typedef struct instancing_lines_device
 {
   GLuint program_id;
+  GLuint affine_program_id;
   GLuint vao;
-  GLuint line_vbo;
+  // Each update is written to the next region of the ring, which the vertex array then points at. Ranged updates
+  // copy the unchanged parts over from the previous one.
+  gl_utils_stream_buffer_t line_vbo;
+  size_t data_offset;
+  uint32_t n_data_elems;
   GLuint quad_vbo;
   GLuint quad_ebo;
+  size_t quad_buffer_bytes;
+
+  // Packed input keeps the bounds its vertices were encoded with, for ranged updates and the draw.
+  bool packed;
+  size_t buffer_elem_size;
+  packed_vertex_bounds_t bounds;
+
+  async_upload_stream_t* async_stream;
 
   struct instancing_lines_uniforms_locations
   {
     GLuint mvp;
     GLuint viewport_size;
     GLuint aa_radius;
+    GLuint bounds_origin;
+    GLuint bounds_extent;
   } uniforms;
 
   struct instancing_lines_attrib_locations
@@ -33,22 +66,53 @@ typedef struct instancing_lines_device
     GLuint col_0;
     GLuint pos_width_1;
     GLuint col_1;
+    GLuint data_0;
+    GLuint data_1;
   } attribs;
 
   uniform_data_t* uniform_data;
+
+  memory_stats_t mem_stats;
 } instancing_lines_device_t;
 
+static bool instancing_lines__packed = false;
+static async_upload_worker_t* instancing_lines__async_worker = NULL;
+
+void
+instancing_lines_set_packed_input( bool packed )
+{
+  instancing_lines__packed = packed;
+}
+
+void
+instancing_lines_set_async_upload( async_upload_worker_t* worker )
+{
+  instancing_lines__async_worker = worker;
+}
+
 void
 instancing_lines_create_shader_program( instancing_lines_device_t* device )
 {
-  const char* vs_src = 
-    GL_UTILS_SHDR_VERSION
+  // Either input provides the endpoints as line_pos_width_a/b and line_col_a/b
+  const char* input_src = device->packed ?
+    PACKED_VERTEX_SHDR_DECODE
+    "layout(location = 1) in uvec3 line_data_a;\n"
+    "layout(location = 3) in uvec3 line_data_b;\n"
+    "#define line_pos_width_a unpack_pos_width( line_data_a )\n"
+    "#define line_col_a unpack_col( line_data_a )\n"
+    "#define line_pos_width_b unpack_pos_width( line_data_b )\n"
+    "#define line_col_b unpack_col( line_data_b )\n" :
     GL_UTILS_SHDR_SOURCE(
-      layout(location = 0) in vec3 quad_pos;
       layout(location = 1) in vec4 line_pos_width_a;
       layout(location = 2) in vec4 line_col_a;
       layout(location = 3) in vec4 line_pos_width_b;
       layout(location = 4) in vec4 line_col_b;
+    );
+
+  // Vertex stage is compiled in two variants, see GL_UTILS_SHDR_AFFINE
+  const char* vs_src =
+    GL_UTILS_SHDR_SOURCE(
+      layout(location = 0) in vec3 quad_pos;
       
       layout(location = 0) uniform mat4 u_mvp;
       layout(location = 1) uniform vec2 u_viewport_size;
@@ -71,11 +135,11 @@ instancing_lines_create_shader_program( instancing_lines_device_t* device )
         colors[1].a *= min( 1.0, line_pos_width_b.w );
         v_col = colors[ int(quad_pos.x) ];
 
-        vec4 clip_pos_a = u_mvp * vec4( line_pos_width_a.xyz, 1.0f );
-        vec4 clip_pos_b = u_mvp * vec4( line_pos_width_b.xyz, 1.0f );
+        vec4 clip_pos_a = project( u_mvp, line_pos_width_a.xyz );
+        vec4 clip_pos_b = project( u_mvp, line_pos_width_b.xyz );
 
-        vec2 ndc_pos_0 = clip_pos_a.xy / clip_pos_a.w;
-        vec2 ndc_pos_1 = clip_pos_b.xy / clip_pos_b.w;
+        vec2 ndc_pos_0 = to_ndc( clip_pos_a );
+        vec2 ndc_pos_1 = to_ndc( clip_pos_b );
 
         vec2 line_vector          = ndc_pos_1 - ndc_pos_0;
         vec2 viewport_line_vector = line_vector * u_viewport_size;
@@ -100,12 +164,13 @@ instancing_lines_create_shader_program( instancing_lines_device_t* device )
         vec2 dir_y = quad_pos.y * ((1.0 - quad_pos.x) * normal_a + quad_pos.x * normal_b);
         vec2 dir_x = quad_pos.x * line_vector +  (2.0 * quad_pos.x - 1.0) * extension;
 
-        gl_Position = vec4( (ndc_pos_0 + dir_x + dir_y) * zw_part.y, zw_part );
+        gl_Position = from_ndc( ndc_pos_0 + dir_x + dir_y, zw_part );
       }
     );
   
   const char* fs_src = 
     GL_UTILS_SHDR_VERSION
+    GL_UTILS_SHDR_FRAG_OUTPUTS
     GL_UTILS_SHDR_SOURCE(
 
       layout(location = 2) uniform vec2 u_aa_radius;
@@ -116,7 +181,6 @@ instancing_lines_create_shader_program( instancing_lines_device_t* device )
       in noperspective float v_line_width;
       in noperspective float v_line_length;
 
-      out vec4 frag_color;
       
       void main()
       {
@@ -124,30 +188,20 @@ instancing_lines_create_shader_program( instancing_lines_device_t* device )
         float av = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[1]) / v_line_length), 1.0, abs( v_v / v_line_length ) );
         frag_color = v_col;
         frag_color.a *= min(av, au);
+        write_overdraw();
       }
     );
 
-  GLuint vertex_shader   = glCreateShader( GL_VERTEX_SHADER );
   GLuint fragment_shader = glCreateShader( GL_FRAGMENT_SHADER );
 
-  glShaderSource( vertex_shader, 1, &vs_src, 0 );
-  glCompileShader( vertex_shader );
-  gl_utils_assert_shader_compiled( vertex_shader, "VERTEX_SHADER" );
-
   glShaderSource( fragment_shader, 1, &fs_src, 0 );
   glCompileShader( fragment_shader );
   gl_utils_assert_shader_compiled( fragment_shader, "FRAGMENT_SHADER" );
 
-
-  device->program_id = glCreateProgram();
-  glAttachShader( device->program_id, vertex_shader );
-  glAttachShader( device->program_id, fragment_shader );
-  glLinkProgram( device->program_id );
-  gl_utils_assert_program_linked( device->program_id );
-
-  glDetachShader( device->program_id, vertex_shader );
-  glDetachShader( device->program_id, fragment_shader );
-  glDeleteShader( vertex_shader );
+  device->program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_PROJECTIVE, input_src, vs_src, NULL,
+                                                         fragment_shader );
+  device->affine_program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_AFFINE, input_src, vs_src, NULL,
+                                                                fragment_shader );
   glDeleteShader( fragment_shader );
 
   device->attribs.quad_pos    = glGetAttribLocation( device->program_id, "quad_pos" );
@@ -155,10 +209,14 @@ instancing_lines_create_shader_program( instancing_lines_device_t* device )
   device->attribs.col_0       = glGetAttribLocation( device->program_id, "line_col_a" );
   device->attribs.pos_width_1 = glGetAttribLocation( device->program_id, "line_pos_width_b" );
   device->attribs.col_1       = glGetAttribLocation( device->program_id, "line_col_b" );
+  device->attribs.data_0      = glGetAttribLocation( device->program_id, "line_data_a" );
+  device->attribs.data_1      = glGetAttribLocation( device->program_id, "line_data_b" );
 
   device->uniforms.mvp           = glGetUniformLocation( device->program_id, "u_mvp" );
   device->uniforms.aa_radius     = glGetUniformLocation( device->program_id, "u_aa_radius" );
   device->uniforms.viewport_size = glGetUniformLocation( device->program_id, "u_viewport_size" );
+  device->uniforms.bounds_origin = glGetUniformLocation( device->program_id, "u_bounds_origin" );
+  device->uniforms.bounds_extent = glGetUniformLocation( device->program_id, "u_bounds_extent" );
 }
 
 void
@@ -166,27 +224,35 @@ instancing_lines_setup_geometry_storage( instancing_lines_device_t* device )
 {
   GLuint  binding_idx = 0;
   glCreateVertexArrays( 1, &device->vao );
-  glCreateBuffers( 1, &device->line_vbo );
-  glNamedBufferStorage( device->line_vbo, MAX_VERTS * sizeof(vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT );
-
-  glVertexArrayVertexBuffer( device->vao, binding_idx, device->line_vbo, 0, 2 * sizeof(vertex_t) );
   glVertexArrayBindingDivisor( device->vao, binding_idx, 1 );
 
-  glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width_0 );
-  glEnableVertexArrayAttrib( device->vao, device->attribs.col_0 );
-  glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width_1 );
-  glEnableVertexArrayAttrib( device->vao, device->attribs.col_1 );
-
-  glVertexArrayAttribFormat( device->vao, device->attribs.pos_width_0, 4, GL_FLOAT, GL_FALSE, offsetof(vertex_t, pos_width) );
-  glVertexArrayAttribFormat( device->vao, device->attribs.col_0, 4, GL_FLOAT, GL_FALSE, offsetof(vertex_t, col) );
-  glVertexArrayAttribFormat( device->vao, device->attribs.pos_width_1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t) + offsetof(vertex_t, pos_width) );
-  glVertexArrayAttribFormat( device->vao, device->attribs.col_1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t) + offsetof(vertex_t, col) );
-
-  glVertexArrayAttribBinding( device->vao, device->attribs.pos_width_0, binding_idx );
-  glVertexArrayAttribBinding( device->vao, device->attribs.col_0, binding_idx );
-  glVertexArrayAttribBinding( device->vao, device->attribs.pos_width_1, binding_idx );
-  glVertexArrayAttribBinding( device->vao, device->attribs.col_1, binding_idx );
-
+  if( device->packed )
+  {
+    // Each instance reads two packed vertices, as three 32-bit words each.
+    glEnableVertexArrayAttrib( device->vao, device->attribs.data_0 );
+    glEnableVertexArrayAttrib( device->vao, device->attribs.data_1 );
+    glVertexArrayAttribIFormat( device->vao, device->attribs.data_0, 3, GL_UNSIGNED_INT, 0 );
+    glVertexArrayAttribIFormat( device->vao, device->attribs.data_1, 3, GL_UNSIGNED_INT, sizeof(packed_vertex_t) );
+    glVertexArrayAttribBinding( device->vao, device->attribs.data_0, binding_idx );
+    glVertexArrayAttribBinding( device->vao, device->attribs.data_1, binding_idx );
+  }
+  else
+  {
+    glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width_0 );
+    glEnableVertexArrayAttrib( device->vao, device->attribs.col_0 );
+    glEnableVertexArrayAttrib( device->vao, device->attribs.pos_width_1 );
+    glEnableVertexArrayAttrib( device->vao, device->attribs.col_1 );
+
+    glVertexArrayAttribFormat( device->vao, device->attribs.pos_width_0, 4, GL_FLOAT, GL_FALSE, offsetof(vertex_t, pos_width) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.col_0, 4, GL_FLOAT, GL_FALSE, offsetof(vertex_t, col) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.pos_width_1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t) + offsetof(vertex_t, pos_width) );
+    glVertexArrayAttribFormat( device->vao, device->attribs.col_1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex_t) + offsetof(vertex_t, col) );
+
+    glVertexArrayAttribBinding( device->vao, device->attribs.pos_width_0, binding_idx );
+    glVertexArrayAttribBinding( device->vao, device->attribs.col_0, binding_idx );
+    glVertexArrayAttribBinding( device->vao, device->attribs.pos_width_1, binding_idx );
+    glVertexArrayAttribBinding( device->vao, device->attribs.col_1, binding_idx );
+  }
 
   binding_idx++;
 
@@ -203,6 +269,8 @@ instancing_lines_setup_geometry_storage( instancing_lines_device_t* device )
 
   glNamedBufferStorage( device->quad_vbo, sizeof(quad), quad, GL_DYNAMIC_STORAGE_BIT );
   glNamedBufferStorage( device->quad_ebo, sizeof(ind), ind, GL_DYNAMIC_STORAGE_BIT );
+  device->quad_buffer_bytes = sizeof(quad) + sizeof(ind);
+  device->mem_stats.gpu_buffer_bytes = device->quad_buffer_bytes;
 
   glVertexArrayVertexBuffer( device->vao, binding_idx, device->quad_vbo, 0, 3*sizeof(float) );
   glVertexArrayElementBuffer( device->vao, device->quad_ebo );
@@ -217,6 +285,12 @@ instancing_lines_init_device( void )
 {
   instancing_lines_device_t* device = malloc( sizeof(instancing_lines_device_t) );
   memset( device, 0, sizeof(instancing_lines_device_t) );
+  device->packed = instancing_lines__packed && !instancing_lines__async_worker;
+  if( instancing_lines__async_worker )
+  {
+    device->async_stream = async_upload_stream_create( instancing_lines__async_worker );
+  }
+  device->buffer_elem_size = device->packed ? sizeof(packed_vertex_t) : sizeof(vertex_t);
   instancing_lines_create_shader_program( device );
   instancing_lines_setup_geometry_storage( device );
   return device;
@@ -227,7 +301,9 @@ instancing_lines_term_device( void** device_in )
 {
   instancing_lines_device_t* device = *device_in;
   glDeleteProgram( device->program_id );
-  glDeleteBuffers( 1, &device->line_vbo );
+  glDeleteProgram( device->affine_program_id );
+  gl_utils_stream_buffer_term( &device->line_vbo );
+  async_upload_stream_destroy( &device->async_stream );
   glDeleteBuffers( 1, &device->quad_vbo );
   glDeleteBuffers( 1, &device->quad_ebo );
   glDeleteVertexArrays( 1, &device->vao );
@@ -236,26 +312,127 @@ instancing_lines_term_device( void** device_in )
 }
 
 uint32_t
-instancing_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
-                         uniform_data_t* uniform_data )
+instancing_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                                const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
   instancing_lines_device_t* device = device_in;
   device->uniform_data = uniform_data;
-  glNamedBufferSubData( device->line_vbo, 0, n_elems*elem_size, data );
+  if( device->async_stream )
+  {
+    async_upload_submit( device->async_stream, data, n_elems, elem_size );
+    device->mem_stats.gpu_buffer_bytes = async_upload_buffer_bytes( device->async_stream ) + device->quad_buffer_bytes;
+    device->mem_stats.uploaded_bytes = (uint64_t)n_elems * elem_size;
+    device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
+    return n_elems;
+  }
+  size_t size = (size_t)n_elems * device->buffer_elem_size;
+  size_t offset = 0;
+  int32_t replaced = 0;
+  uint64_t n_stalls = device->line_vbo.n_stalls;
+  profiler_trace_begin( "wait" );
+  uint8_t* dst = gl_utils_stream_buffer_reserve_frame( &device->line_vbo, size, device->buffer_elem_size, &offset,
+                                                       &replaced );
+  profiler_trace_end();
+  device->mem_stats.stalls = device->line_vbo.n_stalls - n_stalls;
+  device->mem_stats.total_stalls += device->mem_stats.stalls;
+  device->mem_stats.gpu_buffer_bytes = device->line_vbo.size + device->quad_buffer_bytes;
+  uint32_t n_prev_elems = replaced ? 0 : device->n_data_elems;
+  device->n_data_elems = 0;
+  if( !dst )
+  {
+    fprintf( stderr, "[Instancing Lines] Failed to allocate %zu bytes of line data\n", size );
+    return 0;
+  }
+  profiler_trace_begin( "upload" );
+  gl_utils_encoder_t encoder = { packed_vertex_encode, &device->bounds, elem_size };
+  if( device->packed &&
+      !packed_vertex_update_bounds( &device->bounds, data, n_elems, n_prev_elems, ranges, n_ranges ) )
+  {
+    ranges = NULL;
+  }
+  device->mem_stats.uploaded_bytes = gl_utils_stream_buffer_write( &device->line_vbo, offset, data, n_elems,
+                                                                   device->buffer_elem_size,
+                                                                   device->packed ? &encoder : NULL,
+                                                                   ranges, n_ranges, device->data_offset, n_prev_elems );
+  profiler_trace_end();
+  device->data_offset = offset;
+  device->n_data_elems = n_elems;
+  glVertexArrayVertexBuffer( device->vao, 0, device->line_vbo.buffer, offset, 2 * device->buffer_elem_size );
+  device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
   return n_elems;
 }
 
+uint32_t
+instancing_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                         uniform_data_t* uniform_data )
+{
+  return instancing_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+instancing_lines_memory_stats( const void* device_in )
+{
+  const instancing_lines_device_t* device = device_in;
+  return device->mem_stats;
+}
+
+// 'bounds' are those of packed input, NULL otherwise.
+static void
+instancing_lines__use_program( const instancing_lines_device_t* device, const uniform_data_t* uniform_data,
+                               const packed_vertex_bounds_t* bounds )
+{
+  glUseProgram( gl_utils_is_affine( uniform_data->mvp ) ? device->affine_program_id : device->program_id );
+  glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, uniform_data->mvp );
+  glUniform2fv( device->uniforms.viewport_size, 1, uniform_data->viewport );
+  glUniform2fv( device->uniforms.aa_radius, 1, uniform_data->aa_radius );
+  if( bounds )
+  {
+    glUniform3fv( device->uniforms.bounds_origin, 1, bounds->origin.data );
+    glUniform3fv( device->uniforms.bounds_extent, 1, bounds->extent.data );
+  }
+}
+
+void
+instancing_lines_render( void* device_in, const int32_t count )
+{
+  const instancing_lines_device_t* device = device_in;
+  instancing_lines__use_program( device, device->uniform_data, device->packed ? &device->bounds : NULL );
+
+  int32_t n_drawn = count;
+  if( device->async_stream )
+  {
+    async_upload_view_t view = async_upload_acquire( device->async_stream );
+    glVertexArrayVertexBuffer( device->vao, 0, view.buffer, 0, 2 * sizeof(vertex_t) );
+    n_drawn = view.n_elems;
+  }
+
+  glBindVertexArray( device->vao );
+  glDrawElementsInstanced( GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL, n_drawn>>1 );
+  if( device->async_stream ) { async_upload_release( device->async_stream ); }
+
+  glBindVertexArray( 0 );
+  glUseProgram( 0 );
+}
+
+line_set_t*
+instancing_lines_create_line_set( const void* device_in, const void* data, int32_t n_elems, int32_t elem_size )
+{
+  const instancing_lines_device_t* device = device_in;
+  return line_set_create( device->packed, data, n_elems, elem_size );
+}
+
+// The vertex array is left pointing at the set - the next update points it back at the ring.
 void
-instancing_lines_render( const void* device_in, const int32_t count )
+instancing_lines_draw_line_set( const void* device_in, const line_set_t* set, uniform_data_t* uniform_data )
 {
   const instancing_lines_device_t* device = device_in;
-  glUseProgram( device->program_id );
-  glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, device->uniform_data->mvp );
-  glUniform2fv( device->uniforms.viewport_size, 1, device->uniform_data->viewport );
-  glUniform2fv( device->uniforms.aa_radius, 1, device->uniform_data->aa_radius );
+  if( !set->n_elems ) { return; }
+  instancing_lines__use_program( device, uniform_data, set->packed ? &set->bounds : NULL );
+  size_t elem_size = set->packed ? sizeof(packed_vertex_t) : sizeof(vertex_t);
+  glVertexArrayVertexBuffer( device->vao, 0, set->buffer.buffer, 0, 2 * elem_size );
 
   glBindVertexArray( device->vao );
-  glDrawElementsInstanced( GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL, count>>1 );
+  glDrawElementsInstanced( GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL, set->n_elems>>1 );
 
   glBindVertexArray( 0 );
   glUseProgram( 0 );
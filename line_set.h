@@ -0,0 +1,113 @@
+#ifndef LINE_SET_H
+#define LINE_SET_H
+
+// Retained line data. A set's vertices live in a buffer of its own, which stays on the GPU until the set is destroyed,
+// so drawing a static layer (a grid, coastlines, a mesh wireframe) again only changes uniforms. Engines that support
+// sets create them in the layout they read (*_create_line_set) and draw them (*_draw_line_set); updating and
+// destroying a set works the same for all of them.
+
+typedef struct line_set
+{
+    gl_utils_buffer_t buffer;
+    uint32_t n_elems;
+
+    // Packed sets hold packed_vertex_t encoded within 'bounds', and keep the encoded vertices to update them in place.
+    bool packed;
+    packed_vertex_bounds_t bounds;
+    packed_vertex_t* packed_buf;
+    uint32_t packed_cap;
+
+    // Upload counters cover the latest create or update, as well as all of them so far.
+    memory_stats_t mem_stats;
+} line_set_t;
+
+line_set_t* line_set_create( bool packed, const void* data, uint32_t n_elems, size_t elem_size );
+void line_set_update( line_set_t* set, const void* data, uint32_t n_elems, size_t elem_size,
+                      const line_range_t* ranges, int32_t n_ranges );
+void line_set_reuse( line_set_t* set );
+void line_set_destroy( line_set_t** set );
+
+#endif /* LINE_SET_H */
+
+#ifdef LINE_SET_IMPLEMENTATION
+
+// Returns NULL if the set, or its buffer storage, could not be allocated.
+line_set_t*
+line_set_create( bool packed, const void* data, uint32_t n_elems, size_t elem_size )
+{
+    line_set_t* set = malloc( sizeof(line_set_t) );
+    if( !set ) { return NULL; }
+    memset( set, 0, sizeof(line_set_t) );
+    set->packed = packed;
+
+    // Storage allocation only reports failure through the error flags, so those left by earlier calls are cleared.
+    while( glGetError() != GL_NO_ERROR ) {}
+    gl_utils_buffer_init( &set->buffer );
+    line_set_update( set, data, n_elems, elem_size, NULL, 0 );
+    if( glGetError() == GL_OUT_OF_MEMORY )
+    {
+        fprintf( stderr, "[Line Set] Failed to allocate %u vertices\n", n_elems );
+        line_set_destroy( &set );
+    }
+    return set;
+}
+
+// Replaces the set's vertices. Like the engines' ranged updates, with 'ranges' set only those vertices and the ones
+// past the previous count changed, and only they are uploaded.
+void
+line_set_update( line_set_t* set, const void* data, uint32_t n_elems, size_t elem_size,
+                 const line_range_t* ranges, int32_t n_ranges )
+{
+    if( set->packed )
+    {
+        uint32_t n_kept = msh_min( n_elems, set->n_elems );
+        if( !packed_vertex_update_bounds( &set->bounds, data, n_elems, set->n_elems, ranges, n_ranges ) )
+        {
+            ranges = NULL;
+            n_kept = 0;
+        }
+        if( n_elems > set->packed_cap )
+        {
+            set->packed_cap = n_elems;
+            set->packed_buf = realloc( set->packed_buf, set->packed_cap * sizeof(packed_vertex_t) );
+        }
+        for( int32_t i = 0; ranges && i < n_ranges; ++i )
+        {
+            uint32_t first = msh_min( ranges[i].first, n_kept );
+            uint32_t end = msh_min( ranges[i].first + ranges[i].count, n_kept );
+            packed_vertex_encode( set->packed_buf + first, (const uint8_t*)data + first * elem_size, end - first,
+                                  &set->bounds );
+        }
+        packed_vertex_encode( set->packed_buf + n_kept, (const uint8_t*)data + n_kept * elem_size, n_elems - n_kept,
+                              &set->bounds );
+        data = set->packed_buf;
+        elem_size = sizeof(packed_vertex_t);
+        set->mem_stats.cpu_staging_bytes = (uint64_t)set->packed_cap * sizeof(packed_vertex_t);
+    }
+
+    set->mem_stats.uploaded_bytes = 0;
+    gl_utils_buffer_upload( &set->buffer, data, n_elems, elem_size, ranges, n_ranges, &set->mem_stats.uploaded_bytes );
+    set->n_elems = n_elems;
+    set->mem_stats.gpu_buffer_bytes = set->buffer.size;
+    set->mem_stats.total_uploaded_bytes += set->mem_stats.uploaded_bytes;
+}
+
+// Records a frame that draws the set as it is, so that its latest upload counts as nothing.
+void
+line_set_reuse( line_set_t* set )
+{
+    set->mem_stats.uploaded_bytes = 0;
+}
+
+void
+line_set_destroy( line_set_t** set_in )
+{
+    line_set_t* set = *set_in;
+    if( !set ) { return; }
+    gl_utils_buffer_term( &set->buffer );
+    free( set->packed_buf );
+    free( set );
+    *set_in = NULL;
+}
+
+#endif /*LINE_SET_IMPLEMENTATION*/
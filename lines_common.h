@@ -0,0 +1,98 @@
+#ifndef LINES_COMMON_H
+#define LINES_COMMON_H
+
+// Types shared by the line drawing engines and the tools built around them. Nothing in here depends on OpenGL.
+
+typedef struct vertex
+{
+    union
+    {
+        struct { msh_vec3_t pos; float width; };
+        msh_vec4_t pos_width;
+    };
+    msh_vec4_t col;
+} vertex_t;
+
+typedef struct uniform_data
+{
+    float* mvp;
+    float* viewport;
+    float* aa_radius;
+} uniform_data_t;
+
+// Consecutive vertices of an engine's input that changed since its previous update.
+typedef struct line_range
+{
+    uint32_t first;
+    uint32_t count;
+} line_range_t;
+
+static inline int
+line_ranges__compare( const void* a, const void* b )
+{
+    uint32_t first_a = ((const line_range_t*)a)->first;
+    uint32_t first_b = ((const line_range_t*)b)->first;
+    return (first_a > first_b) - (first_a < first_b);
+}
+
+// Sorts the ranges and merges the ones that overlap or touch, as the engines expect them. Returns the new count.
+static inline int32_t
+line_ranges_merge( line_range_t* ranges, int32_t n_ranges )
+{
+    qsort( ranges, n_ranges, sizeof(line_range_t), line_ranges__compare );
+    int32_t n_merged = 0;
+    for( int32_t i = 0; i < n_ranges; ++i )
+    {
+        if( !ranges[i].count ) { continue; }
+        line_range_t* last = n_merged ? ranges + n_merged - 1 : NULL;
+        if( last && ranges[i].first <= last->first + last->count )
+        {
+            uint32_t end = msh_max( last->first + last->count, ranges[i].first + ranges[i].count );
+            last->count = end - last->first;
+        }
+        else
+        {
+            ranges[n_merged++] = ranges[i];
+        }
+    }
+    return n_merged;
+}
+
+// Round to nearest even; out of range values become infinity.
+static inline uint16_t
+lines_float_to_half( float value )
+{
+    uint32_t bits; memcpy( &bits, &value, sizeof(bits) );
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if( magnitude >= 0x47800000 ) { return sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00); }
+    if( magnitude < 0x38800000 )
+    {
+        // Denormal in half precision - units of 2^-24.
+        float abs_value; memcpy( &abs_value, &magnitude, sizeof(abs_value) );
+        return sign | (uint16_t)lrintf( abs_value * 16777216.0f );
+    }
+    // Rebias the exponent, and round the 13 dropped mantissa bits.
+    magnitude += 0xc8000fff + ((magnitude >> 13) & 1);
+    return sign | (uint16_t)(magnitude >> 13);
+}
+
+static inline uint8_t
+lines_float_to_unorm8( float value )
+{
+    return (uint8_t)(msh_clamp( value, 0.0f, 1.0f ) * 255.0f + 0.5f);
+}
+
+// Memory owned by an engine. Upload and stall counters cover the most recent update, as well as all updates so far.
+typedef struct memory_stats
+{
+    uint64_t cpu_staging_bytes;
+    uint64_t gpu_buffer_bytes;
+    uint64_t uploaded_bytes;
+    uint64_t total_uploaded_bytes;
+    // Reservations in a stream ring that had to wait for the GPU to finish with the memory.
+    uint64_t stalls;
+    uint64_t total_stalls;
+} memory_stats_t;
+
+#endif /* LINES_COMMON_H */
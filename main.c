@@ -9,31 +9,45 @@
 #include "extern/msh_vec_math.h"
 #include "extern/msh_camera.h"
 
+#ifndef LINES_NO_GLFW
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
+#endif
 #include "extern/glad.h"
+#ifdef LINES_USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 
+#include "lines_common.h"
+
 #include "gl_utils.h"
 
-#define MAX_VERTS 3 * 12 * 1024 * 1024
+#define PACKED_VERTEX_IMPLEMENTATION
+#include "packed_vertex.h"
 
-typedef struct vertex
-{
-    union
-    {
-        struct { msh_vec3_t pos; float width; };
-        msh_vec4_t pos_width;
-    };
-    msh_vec4_t col;
-} vertex_t;
+#define ASYNC_UPLOAD_IMPLEMENTATION
+#include "async_upload.h"
 
-typedef struct uniform_data
+#define LINE_SET_IMPLEMENTATION
+#include "line_set.h"
+
+typedef struct frame_timings
 {
-    float* mvp;
-    float* viewport;
-    float* aa_radius;
-} uniform_data_t;
+    double generate;
+    double submit;
+    double gpu;
+} frame_timings_t;
+
+#define PROFILER_IMPLEMENTATION
+#include "profiler.h"
+
+#define WORKER_POOL_IMPLEMENTATION
+#include "worker_pool.h"
+
+#define CPU_LINES_EXPAND_IMPLEMENTATION
+#include "cpu_lines_expand.h"
 
 #define GL_LINES_IMPLEMENTATION
 #define CPU_LINES_IMPLEMENTATION
@@ -48,93 +62,471 @@ typedef struct uniform_data
 #include "tex_buffer_lines.h"
 #include "ssbo_lines.h"
 
+#define BENCHMARK_IMPLEMENTATION
+#include "benchmark.h"
+
+#define WORKLOAD_IMPLEMENTATION
+#include "workload.h"
+
+#define GOLDEN_IMPLEMENTATION
+#include "golden.h"
+
+#define OVERDRAW_IMPLEMENTATION
+#include "overdraw.h"
+
+#ifdef LINES_USE_EGL
+#define HEADLESS_IMPLEMENTATION
+#include "headless.h"
+#endif
+
 typedef struct line_draw_engine
 {
     void *device;
     void *(*init_device)(void);
     uint32_t (*update)(void *, const void *, int32_t, int32_t, uniform_data_t* uniforms );
-    void (*render)(const void *, const int32_t);
+    // Same as update, but only the given vertex ranges (sorted and disjoint, see line_ranges_merge) and any past the
+    // previous update's count differ from the data of the previous update.
+    uint32_t (*update_ranges)(void *, const void *, int32_t, int32_t, const line_range_t*, int32_t, uniform_data_t* uniforms );
+    // Not const - the CPU method's streaming mode expands and uploads while it draws (see cpu_lines.h).
+    void (*render)(void *, const int32_t);
     void (*term_device)(void**);
+    memory_stats_t (*memory_stats)(const void *);
+    // Retained line sets, NULL for engines without them. With --retained, 'line_set' holds the workload.
+    line_set_t *(*create_line_set)(const void *, const void *, int32_t, int32_t);
+    void (*draw_line_set)(const void *, const line_set_t *, uniform_data_t* uniforms );
+    line_set_t *line_set;
+    // Set when creating 'line_set' failed, so that the engine stays on the immediate path instead of trying again
+    // every frame.
+    bool line_set_failed;
 } line_draw_engine_t;
 
 void
 setup(line_draw_engine_t *engine,
       void *(*init_device_ptr)(void),
       uint32_t (*update_ptr)(void *, const void *, int32_t, int32_t, uniform_data_t* uniforms ),
-      void (*render_ptr)(const void *, const int32_t ),
-      void (*term_device_ptr)(void**))
+      uint32_t (*update_ranges_ptr)(void *, const void *, int32_t, int32_t, const line_range_t*, int32_t, uniform_data_t* uniforms ),
+      void (*render_ptr)(void *, const int32_t ),
+      void (*term_device_ptr)(void**),
+      memory_stats_t (*memory_stats_ptr)(const void *))
 {
     engine->init_device = init_device_ptr;
     engine->update = update_ptr;
+    engine->update_ranges = update_ranges_ptr;
     engine->render = render_ptr;
     engine->term_device = term_device_ptr;
+    engine->memory_stats = memory_stats_ptr;
     
     engine->device = engine->init_device();
 }
 
+void
+setup_line_sets(line_draw_engine_t *engine,
+                line_set_t *(*create_line_set_ptr)(const void *, const void *, int32_t, int32_t),
+                void (*draw_line_set_ptr)(const void *, const line_set_t *, uniform_data_t* uniforms ))
+{
+    engine->create_line_set = create_line_set_ptr;
+    engine->draw_line_set = draw_line_set_ptr;
+}
+
 uint32_t
 update(line_draw_engine_t *engine, const void *data, int32_t n_elems, int32_t elem_size, uniform_data_t* uniforms)
 {
     return engine->update(engine->device, data, n_elems, elem_size, uniforms );
 }
 
+uint32_t
+update_ranges(line_draw_engine_t *engine, const void *data, int32_t n_elems, int32_t elem_size,
+              const line_range_t *ranges, int32_t n_ranges, uniform_data_t* uniforms)
+{
+    return engine->update_ranges(engine->device, data, n_elems, elem_size, ranges, n_ranges, uniforms );
+}
+
 void
 render(line_draw_engine_t *engine, const int32_t count)
 {
     engine->render(engine->device, count);
 }
 
+// Includes the engine's line set, if it has one.
+memory_stats_t
+memory_stats(const line_draw_engine_t *engine)
+{
+    memory_stats_t stats = engine->memory_stats(engine->device);
+    if( engine->line_set )
+    {
+        stats.cpu_staging_bytes += engine->line_set->mem_stats.cpu_staging_bytes;
+        stats.gpu_buffer_bytes += engine->line_set->mem_stats.gpu_buffer_bytes;
+        stats.uploaded_bytes += engine->line_set->mem_stats.uploaded_bytes;
+        stats.total_uploaded_bytes += engine->line_set->mem_stats.total_uploaded_bytes;
+    }
+    return stats;
+}
+
 void
 terminate(line_draw_engine_t* engine)
 {
+    line_set_destroy(&engine->line_set);
     engine->term_device(&engine->device);
 }
 
+#define N_ENGINES 6
+
+int32_t active_engine_idx = 1;
+// Uploads of the Instancing, Texture Buffer and SSBO methods with --async_upload. The line buffer is handed to it
+// without a copy, so it has to be idle before the buffer is written again.
+async_upload_worker_t* upload_worker = NULL;
+// With --retained, engines that support line sets draw the workload from one, created on their first frame.
+bool retained_line_sets = false;
+const char* method_names[N_ENGINES] =
+{
+    "GL Lines",
+    "CPU Lines",
+    "Geometry Shader Lines",
+    "Instancing Lines",
+    "Tex. Buffer Lines",
+    "SSBO Lines"
+};
+
 void
-generate_line_data(vertex_t *line_buf, uint32_t *line_buf_len, uint32_t line_buf_cap)
+setup_engines(line_draw_engine_t *engines)
 {
-    vertex_t *dst = line_buf;
-    float line_width = 0.5;
-    for (float f = -7.2f; f < 2.2f ; f += 0.6f)
+    setup( engines + 0, &gl_lines_init_device, &gl_lines_update, &gl_lines_update_ranges,
+           &gl_lines_render, &gl_lines_term_device, &gl_lines_memory_stats );
+    setup( engines + 1, &cpu_lines_init_device, &cpu_lines_update, &cpu_lines_update_ranges,
+           &cpu_lines_render, &cpu_lines_term_device, &cpu_lines_memory_stats );
+    setup( engines + 2, &geom_shdr_lines_init_device, &geom_shdr_lines_update, &geom_shdr_lines_update_ranges,
+           &geom_shdr_lines_render, &geom_shdr_lines_term_device, &geom_shdr_lines_memory_stats );
+    setup( engines + 3, &instancing_lines_init_device, &instancing_lines_update, &instancing_lines_update_ranges,
+           &instancing_lines_render, &instancing_lines_term_device, &instancing_lines_memory_stats );
+    setup( engines + 4, &tex_buffer_lines_init_device, &tex_buffer_lines_update, &tex_buffer_lines_update_ranges,
+           &tex_buffer_lines_render, &tex_buffer_lines_term_device, &tex_buffer_lines_memory_stats );
+    setup( engines + 5, &ssbo_lines_init_device, &ssbo_lines_update, &ssbo_lines_update_ranges,
+           &ssbo_lines_render, &ssbo_lines_term_device, &ssbo_lines_memory_stats );
+    setup_line_sets( engines + 3, &instancing_lines_create_line_set, &instancing_lines_draw_line_set );
+    setup_line_sets( engines + 4, &tex_buffer_lines_create_line_set, &tex_buffer_lines_draw_line_set );
+    setup_line_sets( engines + 5, &ssbo_lines_create_line_set, &ssbo_lines_draw_line_set );
+}
+
+// Draws a single frame with the given engine. GPU time is measured with the timer ring (if given) and resolved
+// a few frames later, so the returned timings only contain the CPU side. If a pipeline query is given, it
+// brackets the render call. With 'perturb' set, the data the engine drew last is changed with workload_perturb()
+// instead of generated again, and the engine gets a ranged update; 'first_perturbed_frame_idx' is the first frame
+// that did so since the data was generated. An engine that draws from a retained line set
+// only needs line data to create the set, or to update it when perturbed; other frames just draw it.
+frame_timings_t
+draw_frame(line_draw_engine_t *engine, const workload_desc_t *workload, vertex_t *line_buf, uint32_t line_buf_cap,
+           msh_mat4_t mvp, msh_vec2_t viewport_size,
+           profiler_gpu_timer_t *gpu_timer, profiler_pipeline_query_t *pipeline_query, int64_t frame_idx, int32_t engine_idx,
+           bool perturb, int64_t first_perturbed_frame_idx)
+{
+    frame_timings_t timings = {0};
+    uint64_t t1, t2;
+    profiler_trace_set_frame( method_names[engine_idx], frame_idx );
+    bool retained = retained_line_sets && engine->create_line_set && !engine->line_set_failed;
+    bool static_frame = retained && engine->line_set && !perturb;
+    
+    t1 = msh_time_now();
+    profiler_trace_begin( "generate" );
+    if( upload_worker )
+    {
+        profiler_trace_begin( "wait upload" );
+        async_upload_wait_idle( upload_worker );
+        profiler_trace_end();
+    }
+    uint32_t line_buf_len = 0;
+    line_range_t ranges[WORKLOAD_MAX_DIRTY_RANGES];
+    int32_t n_ranges = 0;
+    if( perturb )
+    {
+        line_buf_len = msh_min( workload_vertex_count( workload ), line_buf_cap );
+        n_ranges = workload_perturb( workload, line_buf, line_buf_len, frame_idx, first_perturbed_frame_idx,
+                                     ranges );
+    }
+    else if( !static_frame )
+    {
+        workload_generate(workload, line_buf, &line_buf_len, line_buf_cap);
+    }
+    profiler_trace_end();
+    t2 = msh_time_now();
+    
+    timings.generate = msh_time_diff_ms(t2, t1);
+    
+    if( gpu_timer ) { profiler_gpu_timer_begin( gpu_timer, frame_idx, engine_idx ); }
+    t1 = msh_time_now();
+    
+    // Only the first draw buffer is cleared to white; overdraw mode attaches a second one that accumulates counts.
+    const GLfloat clear_color[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glClearBufferfv(GL_COLOR, 0, clear_color);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glViewport(0, 0, viewport_size.x, viewport_size.y);
+    
+    msh_vec2_t aa_radii = msh_vec2( 2.0f, 2.0f );
+    uniform_data_t uniform_data = { .mvp = &mvp.data[0], .viewport = &viewport_size.x, .aa_radius = &aa_radii.x };
+    profiler_trace_begin( "update" );
+    uint32_t elem_count = 0;
+    if( retained && !engine->line_set )
+    {
+        engine->line_set = engine->create_line_set( engine->device, line_buf, line_buf_len, sizeof(vertex_t) );
+        engine->line_set_failed = !engine->line_set;
+    }
+    else if( retained && perturb )
+    {
+        line_set_update( engine->line_set, line_buf, line_buf_len, sizeof(vertex_t), ranges, n_ranges );
+    }
+    else if( static_frame )
     {
-        *dst++ = (vertex_t){ .pos = msh_vec3(  f - 0.4, -2.0, 0.0 ), .width = line_width, .col = msh_vec4( 0, 0, 0, 1 ) };
-        *dst++ = (vertex_t){ .pos = msh_vec3(  f + 0.4,  2.0, 0.0 ), .width = line_width, .col = msh_vec4( 0, 0, 0, 1 ) };
-        *line_buf_len += 2;
-        line_width += 1.0;
+        line_set_reuse( engine->line_set );
     }
+    // Without a line set, because it could not be created, the data goes through the engine's update as usual.
+    if( !retained || !engine->line_set )
+    {
+        elem_count = perturb
+                   ? update_ranges( engine, line_buf, line_buf_len, sizeof(vertex_t), ranges, n_ranges, &uniform_data )
+                   : update( engine, line_buf, line_buf_len, sizeof(vertex_t), &uniform_data );
+    }
+    profiler_trace_end();
+    profiler_trace_begin( "draw" );
+    if( pipeline_query ) { profiler_pipeline_query_begin( pipeline_query ); }
+    if( retained && engine->line_set ) { engine->draw_line_set( engine->device, engine->line_set, &uniform_data ); }
+    else { render( engine, elem_count ); }
+    if( pipeline_query ) { profiler_pipeline_query_end( pipeline_query ); }
+    profiler_trace_end();
+    
+    t2 = msh_time_now();
+    if( gpu_timer ) { profiler_gpu_timer_end( gpu_timer ); }
+    
+    timings.submit = msh_time_diff_ms(t2, t1);
+    return timings;
+}
+
+// Cycles through all the engines, drawing a fixed number of frames with each. The first 'n_warmup_frames'
+// of every engine are not recorded, so that shader compilation and first-upload costs do not skew the results.
+// With 'pipeline_stats' set, every engine draws one more, untimed frame with pipeline statistics queries active.
+int32_t
+run_benchmark(line_draw_engine_t *engines, const workload_desc_t *workload, vertex_t *line_buf, uint32_t line_buf_cap, msh_camera_t *cam,
+              int32_t n_warmup_frames, int32_t n_frames, const char *output_filename, profiler_trace_t *trace,
+              bool pipeline_stats)
+{
+    benchmark_t bench = {0};
+    benchmark_init( &bench, N_ENGINES, n_frames, method_names );
+    
+    profiler_gpu_timer_t gpu_timer;
+    profiler_gpu_timer_init( &gpu_timer );
+    profiler_gpu_interval_t interval;
     
-    int32_t circle_res = 32;
-    float d_theta = MSH_TWO_PI / circle_res;
-    float radius1 = 0.4f;
-    float radius2 = 2.0f;
-    float cx = 4.5;
-    float cy = 0.0;
-    line_width = 1.0;
+    profiler_pipeline_query_t pipeline_query = {0};
+    if( pipeline_stats ) { pipeline_stats = profiler_pipeline_query_init( &pipeline_query ); }
     
-    for (int i = 0; i < circle_res; ++i)
+    msh_mat4_t mvp = msh_mat4_mul(msh_mat4_mul(cam->proj, cam->view), msh_mat4_identity());
+    msh_vec2_t viewport_size = msh_vec2(cam->viewport.z, cam->viewport.w);
+    for( int32_t engine_idx = 0; engine_idx < N_ENGINES; ++engine_idx )
     {
-        float x1 = cx + radius1 * sin(i * d_theta);
-        float y1 = cy + radius1 * cos(i * d_theta);
+        for( int32_t frame_idx = -n_warmup_frames; frame_idx < n_frames; ++frame_idx )
+        {
+            // Resolve whatever the gpu has finished, only waiting if the ring has no space left.
+            while( profiler_gpu_timer_poll( &gpu_timer, &interval, profiler_gpu_timer_is_full( &gpu_timer ) ) )
+            {
+                benchmark_record_gpu( &bench, interval.user_data, interval.frame_idx, profiler_gpu_interval_ms( &interval ) );
+                profiler_trace_add_gpu_interval( trace, "gpu frame", method_names[interval.user_data], &interval );
+            }
+            
+            // With dirty segments, only an engine's first frame generates the whole workload.
+            bool perturb = workload->n_dirty_segments && frame_idx > -n_warmup_frames;
+            frame_timings_t timings = draw_frame( engines + engine_idx, workload, line_buf, line_buf_cap,
+                                                  mvp, viewport_size, &gpu_timer, NULL, frame_idx, engine_idx, perturb,
+                                                  -n_warmup_frames + 1 );
+            benchmark_record( &bench, engine_idx, frame_idx, timings );
+            benchmark_record_memory( &bench, engine_idx, frame_idx, memory_stats( engines + engine_idx ) );
+        }
         
-        float x2 = cx + radius2 * sin(i * d_theta);
-        float y2 = cy + radius2 * cos(i * d_theta);
+        if( pipeline_stats )
+        {
+            draw_frame( engines + engine_idx, workload, line_buf, line_buf_cap, mvp, viewport_size,
+                        NULL, &pipeline_query, n_frames, engine_idx, workload->n_dirty_segments != 0,
+                        -n_warmup_frames + 1 );
+            benchmark_record_pipeline_stats( &bench, engine_idx, profiler_pipeline_query_read( &pipeline_query ) );
+        }
+    }
+    while( profiler_gpu_timer_poll( &gpu_timer, &interval, 1 ) )
+    {
+        benchmark_record_gpu( &bench, interval.user_data, interval.frame_idx, profiler_gpu_interval_ms( &interval ) );
+        profiler_trace_add_gpu_interval( trace, "gpu frame", method_names[interval.user_data], &interval );
+    }
+    profiler_gpu_timer_term( &gpu_timer );
+    if( pipeline_stats ) { profiler_pipeline_query_term( &pipeline_query ); }
+    
+    benchmark_print_summary( &bench );
+    int32_t success = 1;
+    if( output_filename )
+    {
+        success = benchmark_write( &bench, output_filename );
+    }
+    benchmark_term( &bench );
+    return success;
+}
+
+// Renders the workload once with every engine and compares the result with the reference images in 'golden_dir'.
+// With 'update' set, the references are overwritten instead. Returns 1 if all engines matched.
+int32_t
+run_golden(line_draw_engine_t *engines, const workload_desc_t *workload, vertex_t *line_buf, uint32_t line_buf_cap, msh_camera_t *cam,
+           const char *golden_dir, int32_t update, int32_t tolerance, float max_mismatch_fraction)
+{
+    msh_mat4_t mvp = msh_mat4_mul(msh_mat4_mul(cam->proj, cam->view), msh_mat4_identity());
+    msh_vec2_t viewport_size = msh_vec2(cam->viewport.z, cam->viewport.w);
+    
+    golden_image_t image = {0}, diff = {0};
+    golden_image_init( &image, viewport_size.x, viewport_size.y );
+    golden_image_init( &diff, viewport_size.x, viewport_size.y );
+    
+    int32_t n_failed = 0;
+    char filename[1024];
+    for( int32_t engine_idx = 0; engine_idx < N_ENGINES; ++engine_idx )
+    {
+        // With dirty segments, a few ranged updates follow the first frame, so that the image covers them too.
+        int32_t n_frames = workload->n_dirty_segments ? 4 : 1;
+        for( int32_t frame_idx = 0; frame_idx < n_frames; ++frame_idx )
+        {
+            draw_frame( engines + engine_idx, workload, line_buf, line_buf_cap, mvp, viewport_size, NULL, NULL,
+                        frame_idx, engine_idx, frame_idx > 0, 1 );
+        }
+        golden_capture( &image );
+        
+        golden_make_filename( filename, sizeof(filename), golden_dir, method_names[engine_idx], ".ppm" );
+        if( update )
+        {
+            if( !golden_write_ppm( &image, filename ) ) { n_failed++; continue; }
+            printf( "%-24s updated %s\n", method_names[engine_idx], filename );
+            continue;
+        }
+        
+        golden_image_t reference = {0};
+        if( !golden_read_ppm( &reference, filename ) ) { n_failed++; continue; }
+        golden_result_t result = golden_compare( &reference, &image, tolerance, &diff );
+        golden_image_term( &reference );
+        
+        uint64_t n_pixels = (uint64_t)image.width * image.height;
+        int32_t passed = result.size_matches && result.n_mismatched <= max_mismatch_fraction * n_pixels;
+        if( !result.size_matches )
+        {
+            printf( "%-24s FAILED - reference size differs from %dx%d\n", method_names[engine_idx], image.width, image.height );
+        }
+        else
+        {
+            printf( "%-24s %s - %llu mismatched pixels (%.4f%%), max difference %d\n", method_names[engine_idx],
+                    passed ? "passed" : "FAILED", (unsigned long long)result.n_mismatched,
+                    100.0 * result.n_mismatched / n_pixels, result.max_difference );
+        }
         
-        *dst++ = (vertex_t){ .pos = msh_vec3(  x1, y1, 0.0 ), .width = line_width, .col = msh_vec4(0,0,0,1) };
-        *dst++ = (vertex_t){ .pos = msh_vec3(  x2, y2, 0.0 ), .width = line_width, .col = msh_vec4(0,0,0,1) };
-        *line_buf_len += 2;
+        if( !passed )
+        {
+            n_failed++;
+            golden_make_filename( filename, sizeof(filename), golden_dir, method_names[engine_idx], "_actual.ppm" );
+            golden_write_ppm( &image, filename );
+            if( result.size_matches )
+            {
+                golden_make_filename( filename, sizeof(filename), golden_dir, method_names[engine_idx], "_diff.ppm" );
+                golden_write_ppm( &diff, filename );
+            }
+        }
     }
+    
+    golden_image_term( &diff );
+    golden_image_term( &image );
+    return n_failed == 0;
 }
 
-int32_t active_engine_idx = 1;
-const char* method_names[6] =
+#ifdef LINES_USE_EGL
+// Renders the workload once with every engine while counting fragments per pixel, prints the totals and writes
+// a heatmap of the fragment counts for every engine to 'output_dir'.
+int32_t
+run_overdraw(line_draw_engine_t *engines, const workload_desc_t *workload, vertex_t *line_buf, uint32_t line_buf_cap, msh_camera_t *cam,
+             const headless_context_t *headless_ctx, const char *output_dir)
 {
-    "GL Lines",
-    "CPU Lines",
-    "Geometry Shader Lines",
-    "Instancing Lines",
-    "Tex. Buffer Lines",
-    "SSBO Lines"
-};
+    msh_mat4_t mvp = msh_mat4_mul(msh_mat4_mul(cam->proj, cam->view), msh_mat4_identity());
+    msh_vec2_t viewport_size = msh_vec2(cam->viewport.z, cam->viewport.w);
+    
+    overdraw_target_t target = {0};
+    overdraw_init( &target, headless_ctx->fbo, headless_ctx->width, headless_ctx->height );
+    
+    printf( "%-24s %14s %14s %10s %14s %10s %8s\n", "Method", "Fragments", "Zero coverage", "[%]",
+            "Covered px", "Mean", "Max" );
+    int32_t success = 1;
+    char filename[1024];
+    for( int32_t engine_idx = 0; engine_idx < N_ENGINES; ++engine_idx )
+    {
+        overdraw_begin( &target );
+        draw_frame( engines + engine_idx, workload, line_buf, line_buf_cap, mvp, viewport_size, NULL, NULL, 0, engine_idx,
+                    false, 0 );
+        overdraw_stats_t stats = overdraw_end( &target );
+        
+        printf( "%-24s %14llu %14llu %10.2f %14llu %10.2f %8u\n", method_names[engine_idx],
+                (unsigned long long)stats.n_fragments, (unsigned long long)stats.n_zero_coverage_fragments,
+                100.0 * stats.n_zero_coverage_fragments / msh_max( stats.n_fragments, 1 ),
+                (unsigned long long)stats.n_covered_pixels,
+                (double)(stats.n_fragments - stats.n_zero_coverage_fragments) / msh_max( stats.n_covered_pixels, 1 ),
+                stats.max_overdraw );
+        
+        golden_make_filename( filename, sizeof(filename), output_dir, method_names[engine_idx], "_overdraw.ppm" );
+        success &= overdraw_write_heatmap( &target, stats.max_overdraw, filename );
+    }
+    
+    overdraw_term( &target );
+    return success;
+}
+#endif
+
+void
+setup_debug_output(void)
+{
+    GLint flags;
+    glGetIntegerv( GL_CONTEXT_FLAGS, &flags );
+    if( flags & GL_CONTEXT_FLAG_DEBUG_BIT )
+    {
+        glEnable( GL_DEBUG_OUTPUT );
+        glEnable( GL_DEBUG_OUTPUT_SYNCHRONOUS );
+        glDebugMessageCallback( gl_utils_debug_msg_call_back, NULL );
+        // Turn all diagnostics off
+        glDebugMessageControl( GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE );
+        // Turn errors on
+        glDebugMessageControl( GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, NULL, GL_TRUE );
+    }
+}
+
+#ifndef LINES_NO_GLFW
+
+// Distribution of frame times in interactive mode, per engine and phase. 'frame' is the wall time between
+// consecutive frames, which includes waiting on vsync and the driver.
+typedef enum frame_phase
+{
+    FRAME_PHASE_GENERATE,
+    FRAME_PHASE_SUBMIT,
+    FRAME_PHASE_GPU,
+    FRAME_PHASE_FRAME,
+    N_FRAME_PHASES
+} frame_phase_t;
+
+const char* frame_phase_names[N_FRAME_PHASES] = { "generate", "submit", "gpu", "frame" };
+
+bool frame_stats_requested = false;
+
+void
+print_frame_stats(profiler_histogram_t histograms[N_ENGINES][N_FRAME_PHASES])
+{
+    printf( "%-24s %-10s %8s %10s %10s %10s %10s %10s\n", "Method", "Phase", "Frames",
+            "Mean [ms]", "p50 [ms]", "p95 [ms]", "p99 [ms]", "Max [ms]" );
+    for( int32_t i = 0; i < N_ENGINES; ++i )
+    {
+        for( int32_t j = 0; j < N_FRAME_PHASES; ++j )
+        {
+            const profiler_histogram_t* histogram = &histograms[i][j];
+            if( !histogram->n_values ) { continue; }
+            printf( "%-24s %-10s %8llu %10.4f %10.4f %10.4f %10.4f %10.4f\n", method_names[i], frame_phase_names[j],
+                    (unsigned long long)histogram->n_values, profiler_histogram_mean( histogram ),
+                    profiler_histogram_percentile( histogram, 50.0 ), profiler_histogram_percentile( histogram, 95.0 ),
+                    profiler_histogram_percentile( histogram, 99.0 ), histogram->max );
+        }
+    }
+}
 
 void key_callback( GLFWwindow* window, int key, int scancode, int action, int mods )
 {
@@ -144,20 +536,20 @@ void key_callback( GLFWwindow* window, int key, int scancode, int action, int mo
     if( key == GLFW_KEY_4 && action == GLFW_PRESS ) { active_engine_idx = 3; }
     if( key == GLFW_KEY_5 && action == GLFW_PRESS ) { active_engine_idx = 4; }
     if( key == GLFW_KEY_6 && action == GLFW_PRESS ) { active_engine_idx = 5; }
+    if( key == GLFW_KEY_P && action == GLFW_PRESS ) { frame_stats_requested = true; }
 }
 
-int32_t
-main(int32_t argc, char **argv)
+GLFWwindow*
+create_window(int32_t window_width, int32_t window_height)
 {
     int32_t error = 0;
     error = !glfwInit();
     if (error)
     {
         fprintf(stderr, "[] Failed to initialize glfw!\n");
-        return EXIT_FAILURE;
+        return NULL;
     }
     
-    int32_t window_width = 1024, window_height = 512;
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
     glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
@@ -169,45 +561,316 @@ main(int32_t argc, char **argv)
     if (!window)
     {
         fprintf(stderr, "[] Failed to create window!\n");
-        return EXIT_FAILURE;
+        return NULL;
     }
     
     glfwSetKeyCallback( window, key_callback );
     glfwMakeContextCurrent(window);
     
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        return NULL;
+    }
+    return window;
+}
+
+// Hidden window whose context shares objects with the one of 'window', for the upload thread.
+GLFWwindow*
+create_upload_window(GLFWwindow *window)
+{
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *upload_window = glfwCreateWindow(1, 1, "OGL Lines uploads", NULL, window);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if (!upload_window)
+    {
+        fprintf(stderr, "[] Failed to create the upload window!\n");
+    }
+    return upload_window;
+}
+
+int32_t
+make_upload_window_current(void *upload_window, int32_t current)
+{
+    glfwMakeContextCurrent(current ? upload_window : NULL);
+    return 1;
+}
+
+void
+run_interactive(GLFWwindow *window, line_draw_engine_t *engines, workload_desc_t *workload, vertex_t *line_buf, uint32_t line_buf_cap,
+                msh_camera_t *cam, profiler_trace_t *trace)
+{
+    int32_t window_width, window_height;
+    msh_mat4_t vp = msh_mat4_mul(cam->proj, cam->view);
+    double timers[3] = { 0.0, 0.0, 0.0 };
+    int32_t n_cpu_timings = 0, n_gpu_timings = 0;
+    uint64_t frame_idx = 0;
+    
+    static profiler_histogram_t histograms[N_ENGINES][N_FRAME_PHASES];
+    memset( histograms, 0, sizeof(histograms) );
+    uint64_t frame_start = msh_time_now();
+    
+    profiler_gpu_timer_t gpu_timer;
+    profiler_gpu_timer_init( &gpu_timer );
+    profiler_gpu_interval_t interval;
+    while (!glfwWindowShouldClose(window))
+    {
+        uint64_t frame_end = msh_time_now();
+        if( frame_idx > 0 )
+        {
+            profiler_histogram_add( &histograms[active_engine_idx][FRAME_PHASE_FRAME], msh_time_diff_ms( frame_end, frame_start ) );
+        }
+        frame_start = frame_end;
+        
+        // Update the camera
+        glfwGetWindowSize(window, &window_width, &window_height);
+        if (window_width != cam->viewport.z || window_height != cam->viewport.w)
+        {
+            cam->viewport.z = window_width;
+            cam->viewport.w = window_height;
+            msh_camera_update_proj(cam);
+            vp = msh_mat4_mul(cam->proj, cam->view);
+            workload->view_half_extent = msh_vec2( 1.0f / cam->proj.data[0], 1.0f / cam->proj.data[5] );
+            workload->viewport_size = msh_vec2( window_width, window_height );
+            // The workload follows the view, so retained line sets are created again from the new one.
+            for( int32_t i = 0; i < N_ENGINES; ++i )
+            {
+                line_set_destroy( &engines[i].line_set );
+                engines[i].line_set_failed = false;
+            }
+        }
+        
+        while( profiler_gpu_timer_poll( &gpu_timer, &interval, profiler_gpu_timer_is_full( &gpu_timer ) ) )
+        {
+            profiler_trace_add_gpu_interval( trace, "gpu frame", method_names[interval.user_data], &interval );
+            profiler_histogram_add( &histograms[interval.user_data][FRAME_PHASE_GPU], profiler_gpu_interval_ms( &interval ) );
+            // Results from frames drawn with a previous method are dropped from the title.
+            if( interval.user_data != active_engine_idx ) { continue; }
+            timers[2] += profiler_gpu_interval_ms( &interval );
+            n_gpu_timings++;
+        }
+        
+        msh_mat4_t model = msh_mat4_identity();
+        msh_mat4_t mvp = msh_mat4_mul(vp, model);
+        
+        frame_timings_t timings = draw_frame( engines + active_engine_idx, workload, line_buf, line_buf_cap,
+                                              mvp, msh_vec2(window_width, window_height),
+                                              &gpu_timer, NULL, frame_idx, active_engine_idx, false, 0 );
+        timers[0] += timings.generate;
+        timers[1] += timings.submit;
+        n_cpu_timings++;
+        profiler_histogram_add( &histograms[active_engine_idx][FRAME_PHASE_GENERATE], timings.generate );
+        profiler_histogram_add( &histograms[active_engine_idx][FRAME_PHASE_SUBMIT], timings.submit );
+        
+        if( frame_stats_requested )
+        {
+            print_frame_stats( histograms );
+            frame_stats_requested = false;
+        }
+        
+        char name[128] = {0};
+        if( frame_idx % 5 == 0 )
+        {
+            timers[0] /= msh_max( n_cpu_timings, 1 );
+            timers[1] /= msh_max( n_cpu_timings, 1 );
+            timers[2] /= msh_max( n_gpu_timings, 1 );
+            memory_stats_t mem = memory_stats( engines + active_engine_idx );
+            snprintf(name, 128, "Method : %s - %6.4fms - %6.4fms - %6.4fms - %6.2fMiB/frame", method_names[active_engine_idx],
+                     timers[0], timers[1], timers[2], mem.uploaded_bytes / (1024.0 * 1024.0) );
+            glfwSetWindowTitle(window, name);
+            timers[0] = 0.0f;
+            timers[1] = 0.0f;
+            timers[2] = 0.0f;
+            n_cpu_timings = 0;
+            n_gpu_timings = 0;
+        }
+        frame_idx++;
+        profiler_trace_begin( "swap" );
+        glfwSwapBuffers(window);
+        profiler_trace_end();
+        glfwPollEvents();
+    }
+    profiler_gpu_timer_term( &gpu_timer );
+    print_frame_stats( histograms );
+}
+
+#endif /* LINES_NO_GLFW */
+
+int32_t
+main(int32_t argc, char **argv)
+{
+    int32_t window_size[2] = { 1024, 512 };
+    bool headless = false;
+    bool gl_debug = false;
+    int32_t n_frames = 100;
+    int32_t n_warmup_frames = 10;
+    char* output_filename = NULL;
+    char* trace_filename = NULL;
+    bool pipeline_stats = false;
+    char* golden_dir = NULL;
+    char* overdraw_dir = NULL;
+    bool golden_update = false;
+    int32_t golden_tolerance = 4;
+    float golden_max_mismatch = 0.001f;
+    int32_t cpu_threads = 0;
+    char* cpu_vertex_format = "full";
+    bool cpu_indexed = false;
+    bool cpu_no_cull = false;
+    bool cpu_copy_upload = false;
+    bool cpu_cache = false;
+    uint32_t cpu_stream_segments = 0;
+    bool packed_input = false;
+    bool async_upload = false;
+    bool retained = false;
+    
+    workload_desc_t workload = { .seed = 1, .coverage = 1.0f,
+                                 .length = { WORKLOAD_DIST_UNIFORM, 5.0f, 50.0f },
+                                 .width = { WORKLOAD_DIST_UNIFORM, 1.0f, 5.0f } };
+    char* length_dist = "uniform";
+    char* width_dist = "uniform";
+    float length_params[2] = { workload.length.a, workload.length.b };
+    float width_params[2] = { workload.width.a, workload.width.b };
+    
+    msh_argparse_t parser = {0};
+    msh_ap_init( &parser, "lines", "Reference implementations of wide, anti-aliased line rendering" );
+    msh_ap_add_int_argument( &parser, "--window_size", NULL, "Size of the window / offscreen framebuffer", &window_size[0], 2 );
+    msh_ap_add_bool_argument( &parser, "--headless", NULL, "Run benchmark of all methods without a window (EGL)", &headless, 0 );
+    msh_ap_add_bool_argument( &parser, "--gl_debug", NULL, "Request a debug context in headless mode", &gl_debug, 0 );
+    msh_ap_add_int_argument( &parser, "--frames", NULL, "Number of frames recorded per method in headless mode", &n_frames, 1 );
+    msh_ap_add_int_argument( &parser, "--warmup_frames", NULL, "Number of frames skipped per method in headless mode", &n_warmup_frames, 1 );
+    msh_ap_add_string_argument( &parser, "--output", "-o", "Benchmark results file (.csv or .json)", &output_filename, 1 );
+    msh_ap_add_string_argument( &parser, "--trace", NULL, "Record per-frame phase timings as Chrome trace json", &trace_filename, 1 );
+    msh_ap_add_bool_argument( &parser, "--pipeline_stats", NULL, "Collect pipeline statistics for each method in headless mode", &pipeline_stats, 0 );
+    msh_ap_add_string_argument( &parser, "--golden", NULL, "Compare each method's output with reference images in this directory (headless)", &golden_dir, 1 );
+    msh_ap_add_bool_argument( &parser, "--golden_update", NULL, "Overwrite the reference images instead of comparing", &golden_update, 0 );
+    msh_ap_add_int_argument( &parser, "--golden_tolerance", NULL, "Largest per-channel difference (0-255) for pixels to match", &golden_tolerance, 1 );
+    msh_ap_add_float_argument( &parser, "--golden_max_mismatch", NULL, "Largest fraction of mismatched pixels to pass", &golden_max_mismatch, 1 );
+    msh_ap_add_string_argument( &parser, "--overdraw", NULL, "Measure overdraw of each method, writing heatmaps to this directory (headless)", &overdraw_dir, 1 );
+    msh_ap_add_int_argument( &parser, "--cpu_threads", NULL, "Threads expanding lines in the CPU method (0 uses all cores)", &cpu_threads, 1 );
+    msh_ap_add_string_argument( &parser, "--cpu_vertex_format", NULL, "Vertex layout of the CPU method (full/compact)", &cpu_vertex_format, 1 );
+    msh_ap_add_bool_argument( &parser, "--cpu_indexed", NULL, "Draw the CPU method's quads with an index buffer, 4 vertices each", &cpu_indexed, 0 );
+    msh_ap_add_bool_argument( &parser, "--cpu_no_cull", NULL, "Expand all segments in the CPU method, including the ones off screen", &cpu_no_cull, 0 );
+    msh_ap_add_bool_argument( &parser, "--cpu_copy_upload", NULL, "Expand the CPU method's quads into a staging buffer and copy it, instead of into mapped memory", &cpu_copy_upload, 0 );
+    msh_ap_add_bool_argument( &parser, "--cpu_cache", NULL, "Expand only the segments that changed since the last frame in the CPU method", &cpu_cache, 0 );
+    msh_ap_add_unsigned_int_argument( &parser, "--cpu_stream_segments", NULL, "Expand and draw the CPU method's segments in chunks of this size while rendering (0 expands all at once)", &cpu_stream_segments, 1 );
+    msh_ap_add_bool_argument( &parser, "--packed_input", NULL, "Upload quantized 12 byte vertices to the Instancing, Texture Buffer and SSBO methods", &packed_input, 0 );
+    msh_ap_add_bool_argument( &parser, "--async_upload", NULL, "Upload the Instancing, Texture Buffer and SSBO methods' data on a separate thread with a shared context", &async_upload, 0 );
+    msh_ap_add_bool_argument( &parser, "--retained", NULL, "Upload the workload once into a line set kept on the GPU by the Instancing, Texture Buffer and SSBO methods, changing only uniforms per frame", &retained, 0 );
+    msh_ap_add_unsigned_int_argument( &parser, "--segments", NULL, "Number of random segments (0 draws the demo scene)", &workload.n_segments, 1 );
+    msh_ap_add_unsigned_int_argument( &parser, "--seed", NULL, "Seed of the random workload", &workload.seed, 1 );
+    msh_ap_add_string_argument( &parser, "--length_dist", NULL, "Segment length distribution (constant/uniform/normal/exponential)", &length_dist, 1 );
+    msh_ap_add_float_argument( &parser, "--length", NULL, "Segment length distribution parameters, in pixels", &length_params[0], 2 );
+    msh_ap_add_string_argument( &parser, "--width_dist", NULL, "Segment width distribution (constant/uniform/normal/exponential)", &width_dist, 1 );
+    msh_ap_add_float_argument( &parser, "--width", NULL, "Segment width distribution parameters, in pixels", &width_params[0], 2 );
+    msh_ap_add_float_argument( &parser, "--coverage", NULL, "Fraction of the screen covered by segments", &workload.coverage, 1 );
+    msh_ap_add_bool_argument( &parser, "--3d", NULL, "Spread segments in depth as well", &workload.is_3d, 0 );
+    msh_ap_add_bool_argument( &parser, "--polyline", NULL, "Generate connected polylines instead of disjoint segments", &workload.polyline, 0 );
+    msh_ap_add_unsigned_int_argument( &parser, "--dirty_segments", NULL, "Segments changed per frame after each method's first, uploaded as ranged updates (benchmark and golden runs)", &workload.n_dirty_segments, 1 );
+    if( !msh_ap_parse( &parser, argc, argv ) )
+    {
+        return EXIT_FAILURE;
+    }
+    if( !workload_parse_distribution( length_dist, &workload.length.distribution ) ||
+        !workload_parse_distribution( width_dist, &workload.width.distribution ) )
     {
         return EXIT_FAILURE;
     }
+    workload.length.a = length_params[0]; workload.length.b = length_params[1];
+    workload.width.a  = width_params[0];  workload.width.b  = width_params[1];
+    cpu_lines_set_thread_count( cpu_threads );
+    cpu_lines_set_indexed( cpu_indexed );
+    cpu_lines_set_culling( !cpu_no_cull );
+    cpu_lines_set_zero_copy( !cpu_copy_upload );
+    cpu_lines_set_caching( cpu_cache );
+    cpu_lines_set_streaming( cpu_stream_segments );
+    instancing_lines_set_packed_input( packed_input );
+    tex_buffer_lines_set_packed_input( packed_input );
+    ssbo_lines_set_packed_input( packed_input );
+    retained_line_sets = retained;
+    if( !strcmp( cpu_vertex_format, "compact" ) ) { cpu_lines_set_vertex_format( CPU_LINES_FORMAT_COMPACT ); }
+    else if( strcmp( cpu_vertex_format, "full" ) )
+    {
+        fprintf( stderr, "[] Unknown vertex format \"%s\"\n", cpu_vertex_format );
+        return EXIT_FAILURE;
+    }
+    // Comparisons and overdraw counting need a framebuffer of known size, so they always run offscreen.
+    if( golden_dir || overdraw_dir ) { headless = true; }
+    
+    int32_t window_width = window_size[0], window_height = window_size[1];
+#ifdef LINES_USE_EGL
+    headless_context_t headless_ctx = {0};
+    if( headless )
+    {
+        if( !headless_init( &headless_ctx, window_width, window_height, gl_debug ) )
+        {
+            fprintf(stderr, "[] Failed to create headless context!\n");
+            return EXIT_FAILURE;
+        }
+    }
+#else
+    if( headless )
+    {
+        fprintf(stderr, "[] Headless mode requires building with EGL support (LINES_USE_EGL)!\n");
+        return EXIT_FAILURE;
+    }
+#endif
+    
+#ifndef LINES_NO_GLFW
+    GLFWwindow *window = NULL;
+    if( !headless )
+    {
+        window = create_window( window_width, window_height );
+        if( !window ) { return EXIT_FAILURE; }
+    }
+#else
+    if( !headless )
+    {
+        fprintf(stderr, "[] Built without glfw, only --headless mode is available!\n");
+        return EXIT_FAILURE;
+    }
+#endif
     
     printf("%s\n", glGetString(GL_RENDERER));
     printf("%s\n", glGetString(GL_VENDOR));
     printf("%s\n", glGetString(GL_VERSION));
     
-    GLint flags;
-    glGetIntegerv( GL_CONTEXT_FLAGS, &flags );
-    if( flags & GL_CONTEXT_FLAG_DEBUG_BIT )
+    setup_debug_output();
+    
+    // The upload thread's context is created here, and made current on that thread.
+#ifdef LINES_USE_EGL
+    headless_shared_context_t upload_ctx = {0};
+#endif
+    if( async_upload )
     {
-        glEnable( GL_DEBUG_OUTPUT );
-        glEnable( GL_DEBUG_OUTPUT_SYNCHRONOUS );
-        glDebugMessageCallback( gl_utils_debug_msg_call_back, NULL );
-        // Turn all diagnostics off
-        glDebugMessageControl( GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE );
-        // Turn errors on
-        glDebugMessageControl( GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, NULL, GL_TRUE );
+#ifdef LINES_USE_EGL
+        if( headless && headless_create_shared_context( &headless_ctx, &upload_ctx ) )
+        {
+            upload_worker = async_upload_worker_create( headless_make_shared_context_current, &upload_ctx );
+        }
+#endif
+#ifndef LINES_NO_GLFW
+        GLFWwindow *upload_window = headless ? NULL : create_upload_window( window );
+        if( upload_window )
+        {
+            upload_worker = async_upload_worker_create( make_upload_window_current, upload_window );
+        }
+#endif
+        if( !upload_worker )
+        {
+            fprintf(stderr, "[] Failed to start the upload thread!\n");
+            return EXIT_FAILURE;
+        }
+        // Images are compared frame by frame, so they cannot show a previous upload.
+        if( golden_dir ) { async_upload_set_synchronous( upload_worker, true ); }
+        instancing_lines_set_async_upload( upload_worker );
+        tex_buffer_lines_set_async_upload( upload_worker );
+        ssbo_lines_set_async_upload( upload_worker );
     }
     
-    uint32_t line_buf_cap = MAX_VERTS / 3;
-    uint32_t line_buf_len;
+    uint32_t line_buf_cap = workload_vertex_count( &workload );
     vertex_t *line_buf = malloc(line_buf_cap * sizeof(vertex_t));
     
-    line_draw_engine_t engines[6] = {0};
-    setup( engines + 0, &gl_lines_init_device, &gl_lines_update, &gl_lines_render, &gl_lines_term_device );
-    setup( engines + 1, &cpu_lines_init_device, &cpu_lines_update, &cpu_lines_render, &cpu_lines_term_device );
-    setup( engines + 2, &geom_shdr_lines_init_device, &geom_shdr_lines_update, &geom_shdr_lines_render, &geom_shdr_lines_term_device );
-    setup( engines + 3, &instancing_lines_init_device, &instancing_lines_update, &instancing_lines_render, &instancing_lines_term_device);
-    setup( engines + 4, &tex_buffer_lines_init_device, &tex_buffer_lines_update, &tex_buffer_lines_render, &tex_buffer_lines_term_device );
-    setup( engines + 5, &ssbo_lines_init_device, &ssbo_lines_update, &ssbo_lines_render, &ssbo_lines_term_device);
+    line_draw_engine_t engines[N_ENGINES] = {0};
+    setup_engines( engines );
     
     msh_camera_t cam = {0};
     msh_camera_init(&cam,
@@ -222,90 +885,74 @@ main(int32_t argc, char **argv)
                         .zfar = 100.0f,
                         .use_ortho = true
                     });
-    msh_mat4_t vp = msh_mat4_mul(cam.proj, cam.view);
-    double timers[3] = { 0.0, 0.0, 0.0 };
-    uint64_t frame_idx = 0;
+    workload.view_half_extent = msh_vec2( 1.0f / cam.proj.data[0], 1.0f / cam.proj.data[5] );
+    workload.viewport_size = msh_vec2( window_width, window_height );
     
-    GLuint gl_timer_query;
-    glGenQueries( 1, &gl_timer_query );
     glEnable(GL_BLEND);
     glBlendEquation(GL_FUNC_ADD);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glDisable(GL_DEPTH_TEST);
-    while (!glfwWindowShouldClose(window))
+    
+    profiler_trace_t trace = {0};
+    if( trace_filename )
     {
-        // Update the camera
-        glfwGetWindowSize(window, &window_width, &window_height);
-        if (window_width != cam.viewport.z || window_height != cam.viewport.w)
+        profiler_trace_init( &trace, 1 << 20 );
+        profiler_trace_set_active( &trace );
+    }
+    profiler_trace_t *active_trace = trace_filename ? &trace : NULL;
+    
+    int32_t exit_code = EXIT_SUCCESS;
+    if( overdraw_dir )
+    {
+#ifdef LINES_USE_EGL
+        if( !run_overdraw( engines, &workload, line_buf, line_buf_cap, &cam, &headless_ctx, overdraw_dir ) )
         {
-            cam.viewport.z = window_width;
-            cam.viewport.w = window_height;
-            msh_camera_update_proj(&cam);
-            vp = msh_mat4_mul(cam.proj, cam.view);
-            int32_t fb_w, fb_h;
-            glfwGetFramebufferSize( window, &fb_w, &fb_h );
+            exit_code = EXIT_FAILURE;
         }
-        
-        msh_mat4_t model = msh_mat4_identity();
-        msh_mat4_t mvp = msh_mat4_mul(vp, model);
-        
-        uint64_t t1, t2;
-        
-        t1 = msh_time_now();
-        line_buf_len = 0;
-        generate_line_data(line_buf, &line_buf_len, line_buf_cap);
-        t2 = msh_time_now();
-        
-        double diff1 = msh_time_diff_ms(t2, t1);
-        timers[0] += diff1;
-        
-        glBeginQuery( GL_TIME_ELAPSED, gl_timer_query );
-        t1 = msh_time_now();
-        
-        glClearColor( 1.0f, 1.0f, 1.0f, 1.0f );
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glViewport(0, 0, window_width, window_height);
-        
-        msh_vec2_t aa_radii = msh_vec2( 2.0f, 2.0f );
-        line_draw_engine_t *active_engine = engines + active_engine_idx;
-        uniform_data_t uniform_data = { .mvp = &mvp.data[0], .viewport = &cam.viewport.z, .aa_radius = &aa_radii.x };
-        uint32_t elem_count = update( active_engine, line_buf, line_buf_len, sizeof(vertex_t), &uniform_data );
-        render( active_engine, elem_count );
-        
-        t2 = msh_time_now();
-        glEndQuery( GL_TIME_ELAPSED );
-        
-        double diff2 = msh_time_diff_ms(t2, t1);
-        timers[1] += diff2;
-        
-        GLuint64 time_elapsed = 0;
-        glGetQueryObjectui64v( gl_timer_query, GL_QUERY_RESULT, &time_elapsed );
-        
-        timers[2] += time_elapsed * 1e-6;
-        
-        char name[128] = {0};
-        if( frame_idx % 5 == 0 )
+#endif
+    }
+    else if( golden_dir )
+    {
+        if( !run_golden( engines, &workload, line_buf, line_buf_cap, &cam, golden_dir, golden_update,
+                         golden_tolerance, golden_max_mismatch ) )
         {
-            timers[0] /= 5.0f;
-            timers[1] /= 5.0f;
-            timers[2] /= 5.0f;
-            snprintf(name, 128, "Method : %s - %6.4fms - %6.4fms - %6.4fms", method_names[active_engine_idx], timers[0], timers[1], timers[2] );
-            glfwSetWindowTitle(window, name);
-            timers[0] = 0.0f;
-            timers[1] = 0.0f;
-            timers[2] = 0.0f;
+            exit_code = EXIT_FAILURE;
+        }
+    }
+    else if( headless )
+    {
+        if( !run_benchmark( engines, &workload, line_buf, line_buf_cap, &cam, n_warmup_frames, n_frames,
+                            output_filename, active_trace, pipeline_stats ) )
+        {
+            exit_code = EXIT_FAILURE;
         }
-        frame_idx++;
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    }
+#ifndef LINES_NO_GLFW
+    else
+    {
+        run_interactive( window, engines, &workload, line_buf, line_buf_cap, &cam, active_trace );
+    }
+#endif
+    
+    if( trace_filename )
+    {
+        if( !profiler_trace_write( &trace, trace_filename ) ) { exit_code = EXIT_FAILURE; }
+        profiler_trace_term( &trace );
     }
     
-    terminate( engines + 0 );
-    terminate( engines + 1 );
-    terminate( engines + 2 );
-    terminate( engines + 3 );
-    terminate( engines + 4 );
+    for( int32_t i = 0; i < N_ENGINES; ++i )
+    {
+        terminate( engines + i );
+    }
+    async_upload_worker_destroy( &upload_worker );
+    free( line_buf );
     
-    glfwTerminate();
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+#ifdef LINES_USE_EGL
+    if( upload_ctx.context ) { headless_destroy_shared_context( &upload_ctx ); }
+    if( headless ) { headless_term( &headless_ctx ); }
+#endif
+#ifndef LINES_NO_GLFW
+    if( window ) { glfwTerminate(); }
+#endif
+    return exit_code;
+}
@@ -0,0 +1,126 @@
+#ifndef OVERDRAW_H
+#define OVERDRAW_H
+
+// Overdraw measurement. A float target is attached as the second color attachment of an existing framebuffer and
+// blended additively, while the methods' fragment shaders write (1, zero coverage ? 1 : 0, 0, 0) to it (see
+// GL_UTILS_SHDR_FRAG_OUTPUTS). After a frame, R holds the number of fragments shaded per pixel and G the number of
+// those that ended up fully transparent - mostly the anti-aliasing padding around each quad. Only R and G are used,
+// but the target and the shader output are four-channel, as llvmpipe crashes on a vec2 output without an attachment.
+
+typedef struct overdraw_target
+{
+    GLuint fbo;
+    GLuint count_rb;
+    int32_t width;
+    int32_t height;
+    float* counts;
+} overdraw_target_t;
+
+typedef struct overdraw_stats
+{
+    uint64_t n_fragments;
+    uint64_t n_zero_coverage_fragments;
+    uint64_t n_covered_pixels;
+    uint32_t max_overdraw;
+} overdraw_stats_t;
+
+void overdraw_init( overdraw_target_t* target, GLuint fbo, int32_t width, int32_t height );
+void overdraw_term( overdraw_target_t* target );
+void overdraw_begin( overdraw_target_t* target );
+overdraw_stats_t overdraw_end( overdraw_target_t* target );
+int32_t overdraw_write_heatmap( const overdraw_target_t* target, uint32_t max_overdraw, const char* filename );
+
+#endif /* OVERDRAW_H */
+
+#ifdef OVERDRAW_IMPLEMENTATION
+
+void
+overdraw_init( overdraw_target_t* target, GLuint fbo, int32_t width, int32_t height )
+{
+    memset( target, 0, sizeof(overdraw_target_t) );
+    target->fbo = fbo;
+    target->width = width;
+    target->height = height;
+    target->counts = malloc( (size_t)width * height * 2 * sizeof(float) );
+
+    glCreateRenderbuffers( 1, &target->count_rb );
+    glNamedRenderbufferStorage( target->count_rb, GL_RGBA32F, width, height );
+    glNamedFramebufferRenderbuffer( fbo, GL_COLOR_ATTACHMENT1, GL_RENDERBUFFER, target->count_rb );
+}
+
+void
+overdraw_term( overdraw_target_t* target )
+{
+    glNamedFramebufferRenderbuffer( target->fbo, GL_COLOR_ATTACHMENT1, GL_RENDERBUFFER, 0 );
+    glDeleteRenderbuffers( 1, &target->count_rb );
+    free( target->counts );
+    memset( target, 0, sizeof(overdraw_target_t) );
+}
+
+void
+overdraw_begin( overdraw_target_t* target )
+{
+    const GLenum draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glNamedFramebufferDrawBuffers( target->fbo, 2, draw_buffers );
+    const GLfloat zeros[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    glClearNamedFramebufferfv( target->fbo, GL_COLOR, 1, zeros );
+    glBlendFunci( 1, GL_ONE, GL_ONE );
+}
+
+overdraw_stats_t
+overdraw_end( overdraw_target_t* target )
+{
+    glNamedFramebufferReadBuffer( target->fbo, GL_COLOR_ATTACHMENT1 );
+    glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+    glReadPixels( 0, 0, target->width, target->height, GL_RG, GL_FLOAT, target->counts );
+    glNamedFramebufferReadBuffer( target->fbo, GL_COLOR_ATTACHMENT0 );
+
+    // Back to the regular setup - only the color attachment is drawn into, with the usual blending.
+    const GLenum draw_buffer = GL_COLOR_ATTACHMENT0;
+    glNamedFramebufferDrawBuffers( target->fbo, 1, &draw_buffer );
+    glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+
+    overdraw_stats_t stats = {0};
+    size_t n_pixels = (size_t)target->width * target->height;
+    for( size_t i = 0; i < n_pixels; ++i )
+    {
+        uint32_t n_fragments = (uint32_t)target->counts[2 * i + 0];
+        uint32_t n_zero_coverage = (uint32_t)target->counts[2 * i + 1];
+        stats.n_fragments += n_fragments;
+        stats.n_zero_coverage_fragments += n_zero_coverage;
+        stats.n_covered_pixels += n_fragments > n_zero_coverage;
+        stats.max_overdraw = msh_max( stats.max_overdraw, n_fragments );
+    }
+    return stats;
+}
+
+// Writes the per-pixel fragment count of the last measured frame as a ppm, going from white (no fragments)
+// through blue and green to red (at 'max_overdraw' or more fragments).
+int32_t
+overdraw_write_heatmap( const overdraw_target_t* target, uint32_t max_overdraw, const char* filename )
+{
+    golden_image_t image = {0};
+    golden_image_init( &image, target->width, target->height );
+    for( int32_t y = 0; y < target->height; ++y )
+    {
+        for( int32_t x = 0; x < target->width; ++x )
+        {
+            // Counts are stored bottom row first.
+            float n_fragments = target->counts[2 * ((target->height - 1 - y) * target->width + x)];
+            uint8_t* dst = image.pixels + 3 * (y * target->width + x);
+            if( n_fragments <= 0.0f ) { dst[0] = dst[1] = dst[2] = 255; continue; }
+
+            float t = msh_min( n_fragments / msh_max( max_overdraw, 1 ), 1.0f );
+            msh_vec3_t col = t < 0.5f ? msh_vec3_lerp( msh_vec3( 0.0f, 0.0f, 1.0f ), msh_vec3( 0.0f, 1.0f, 0.0f ), 2.0f * t )
+                                      : msh_vec3_lerp( msh_vec3( 0.0f, 1.0f, 0.0f ), msh_vec3( 1.0f, 0.0f, 0.0f ), 2.0f * t - 1.0f );
+            dst[0] = (uint8_t)(255.0f * col.x);
+            dst[1] = (uint8_t)(255.0f * col.y);
+            dst[2] = (uint8_t)(255.0f * col.z);
+        }
+    }
+    int32_t success = golden_write_ppm( &image, filename );
+    golden_image_term( &image );
+    return success;
+}
+
+#endif /*OVERDRAW_IMPLEMENTATION*/
@@ -0,0 +1,121 @@
+#ifndef PACKED_VERTEX_H
+#define PACKED_VERTEX_H
+
+// Quantized input for the methods that expand lines on the GPU - 12 bytes per vertex instead of the 32 of vertex_t.
+// Positions are 16-bit fixed point within a bounding box of the data they are uploaded with, the width is a half float
+// and the color RGBA8. Shaders read a vertex as three 32-bit words and decode it with PACKED_VERTEX_SHDR_DECODE, with
+// the bounds passed as uniforms. Nothing in here depends on OpenGL.
+
+typedef struct packed_vertex
+{
+    uint16_t pos[3];
+    uint16_t width;
+    uint8_t col[4];
+} packed_vertex_t;
+
+typedef struct packed_vertex_bounds
+{
+    msh_vec3_t origin;
+    msh_vec3_t extent;
+} packed_vertex_bounds_t;
+
+#define PACKED_VERTEX_SHDR_DECODE \
+    "layout(location = 4) uniform vec3 u_bounds_origin;\n" \
+    "layout(location = 5) uniform vec3 u_bounds_extent;\n" \
+    "vec4 unpack_pos_width( uvec3 v )\n" \
+    "{\n" \
+    "    vec3 pos = vec3( unpackUnorm2x16( v.x ), unpackUnorm2x16( v.y ).x );\n" \
+    "    return vec4( u_bounds_origin + u_bounds_extent * pos, unpackHalf2x16( v.y ).y );\n" \
+    "}\n" \
+    "vec4 unpack_col( uvec3 v ) { return unpackUnorm4x8( v.z ); }\n"
+
+int32_t packed_vertex_update_bounds( packed_vertex_bounds_t* bounds, const vertex_t* data, uint32_t n_elems,
+                                     uint32_t n_prev_elems, const line_range_t* ranges, int32_t n_ranges );
+void packed_vertex_encode( void* dst, const void* src, uint32_t n_elems, const void* bounds );
+
+#endif /* PACKED_VERTEX_H */
+
+#ifdef PACKED_VERTEX_IMPLEMENTATION
+
+static void
+packed_vertex__extend( msh_vec3_t* min_pos, msh_vec3_t* max_pos, const vertex_t* data, uint32_t first, uint32_t end )
+{
+    for( uint32_t i = first; i < end; ++i )
+    {
+        for( int32_t k = 0; k < 3; ++k )
+        {
+            min_pos->data[k] = msh_min( min_pos->data[k], data[i].pos.data[k] );
+            max_pos->data[k] = msh_max( max_pos->data[k], data[i].pos.data[k] );
+        }
+    }
+}
+
+// Bounds to encode 'n_elems' vertices with, given that only 'ranges' and the vertices past 'n_prev_elems' changed
+// since they were last encoded with 'bounds'. Returns 1 if these fit in 'bounds', which are then kept, so that the
+// unchanged vertices stay valid. Otherwise 'bounds' become those of all vertices, and all of them have to be encoded
+// again; the same goes for NULL 'ranges'.
+int32_t
+packed_vertex_update_bounds( packed_vertex_bounds_t* bounds, const vertex_t* data, uint32_t n_elems,
+                             uint32_t n_prev_elems, const line_range_t* ranges, int32_t n_ranges )
+{
+    msh_vec3_t min_pos = msh_vec3( FLT_MAX, FLT_MAX, FLT_MAX );
+    msh_vec3_t max_pos = msh_vec3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+    if( ranges && n_prev_elems )
+    {
+        uint32_t n_kept = msh_min( n_elems, n_prev_elems );
+        for( int32_t i = 0; i < n_ranges; ++i )
+        {
+            uint32_t first = msh_min( ranges[i].first, n_kept );
+            packed_vertex__extend( &min_pos, &max_pos, data, first, msh_min( first + ranges[i].count, n_kept ) );
+        }
+        packed_vertex__extend( &min_pos, &max_pos, data, n_kept, n_elems );
+
+        msh_vec3_t bounds_max = msh_vec3_add( bounds->origin, bounds->extent );
+        if( min_pos.x >= bounds->origin.x && min_pos.y >= bounds->origin.y && min_pos.z >= bounds->origin.z &&
+            max_pos.x <= bounds_max.x && max_pos.y <= bounds_max.y && max_pos.z <= bounds_max.z )
+        {
+            return 1;
+        }
+        min_pos = msh_vec3( FLT_MAX, FLT_MAX, FLT_MAX );
+        max_pos = msh_vec3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+    }
+
+    packed_vertex__extend( &min_pos, &max_pos, data, 0, n_elems );
+    if( !n_elems ) { min_pos = max_pos = msh_vec3_zeros(); }
+    bounds->origin = min_pos;
+    bounds->extent = msh_vec3_sub( max_pos, min_pos );
+    return 0;
+}
+
+static inline uint16_t
+packed_vertex__quantize( float value, float origin, float scale )
+{
+    return (uint16_t)msh_clamp( (value - origin) * scale + 0.5f, 0.0f, 65535.0f );
+}
+
+// Encodes 'n_elems' vertex_t from 'src' as packed_vertex_t to 'dst', relative to the packed_vertex_bounds_t in
+// 'bounds'. Matches the signature of the encoders of gl_utils_stream_buffer_write().
+void
+packed_vertex_encode( void* dst, const void* src, uint32_t n_elems, const void* bounds_in )
+{
+    const packed_vertex_bounds_t* bounds = bounds_in;
+    const vertex_t* in = src;
+    packed_vertex_t* out = dst;
+    float scale[3];
+    for( int32_t k = 0; k < 3; ++k )
+    {
+        scale[k] = bounds->extent.data[k] > 0.0f ? 65535.0f / bounds->extent.data[k] : 0.0f;
+    }
+    for( uint32_t i = 0; i < n_elems; ++i )
+    {
+        for( int32_t k = 0; k < 3; ++k )
+        {
+            out[i].pos[k] = packed_vertex__quantize( in[i].pos.data[k], bounds->origin.data[k], scale[k] );
+            out[i].col[k] = lines_float_to_unorm8( in[i].col.data[k] );
+        }
+        out[i].col[3] = lines_float_to_unorm8( in[i].col.data[3] );
+        out[i].width = lines_float_to_half( in[i].width );
+    }
+}
+
+#endif /*PACKED_VERTEX_IMPLEMENTATION*/
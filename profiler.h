@@ -0,0 +1,480 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// GPU timer ring. Each measured interval is a pair of GL_TIMESTAMP queries issued with glQueryCounter. Results are
+// only read back once GL_QUERY_RESULT_AVAILABLE reports them as ready, usually a few frames later, so measuring does
+// not force the CPU to wait for the GPU every frame. Each interval carries the frame index and a user value
+// (e.g. engine index), so that late results can be attributed to the frame that produced them.
+
+#ifndef PROFILER_GPU_TIMER_RING_SIZE
+#define PROFILER_GPU_TIMER_RING_SIZE 8
+#endif
+
+typedef struct profiler_gpu_interval
+{
+    int64_t frame_idx;
+    int32_t user_data;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+} profiler_gpu_interval_t;
+
+typedef struct profiler_gpu_timer
+{
+    GLuint queries[PROFILER_GPU_TIMER_RING_SIZE][2];
+    profiler_gpu_interval_t intervals[PROFILER_GPU_TIMER_RING_SIZE];
+    uint32_t write_idx;
+    uint32_t read_idx;
+} profiler_gpu_timer_t;
+
+void profiler_gpu_timer_init( profiler_gpu_timer_t* timer );
+void profiler_gpu_timer_term( profiler_gpu_timer_t* timer );
+int32_t profiler_gpu_timer_is_full( const profiler_gpu_timer_t* timer );
+void profiler_gpu_timer_begin( profiler_gpu_timer_t* timer, int64_t frame_idx, int32_t user_data );
+void profiler_gpu_timer_end( profiler_gpu_timer_t* timer );
+int32_t profiler_gpu_timer_poll( profiler_gpu_timer_t* timer, profiler_gpu_interval_t* interval, int32_t wait );
+double profiler_gpu_interval_ms( const profiler_gpu_interval_t* interval );
+
+// Pipeline statistics (GL_ARB_pipeline_statistics_query, core in 4.6). The loader only covers 4.5, so the enums are
+// defined here. One query per statistic is active between begin and end; reading the results waits for the gpu,
+// so this is meant for diagnostic frames rather than every frame.
+
+#ifndef GL_VERTICES_SUBMITTED_ARB
+#define GL_VERTICES_SUBMITTED_ARB                 0x82EE
+#define GL_PRIMITIVES_SUBMITTED_ARB               0x82EF
+#define GL_VERTEX_SHADER_INVOCATIONS_ARB          0x82F0
+#define GL_GEOMETRY_SHADER_PRIMITIVES_EMITTED_ARB 0x82F3
+#define GL_FRAGMENT_SHADER_INVOCATIONS_ARB        0x82F4
+#define GL_CLIPPING_INPUT_PRIMITIVES_ARB          0x82F6
+#define GL_CLIPPING_OUTPUT_PRIMITIVES_ARB         0x82F7
+#endif
+
+typedef enum profiler_pipeline_stat
+{
+    PROFILER_STAT_VERTICES_SUBMITTED,
+    PROFILER_STAT_PRIMITIVES_SUBMITTED,
+    PROFILER_STAT_VS_INVOCATIONS,
+    PROFILER_STAT_GS_INVOCATIONS,
+    PROFILER_STAT_GS_PRIMITIVES_EMITTED,
+    PROFILER_STAT_CLIPPING_INPUT_PRIMITIVES,
+    PROFILER_STAT_CLIPPING_OUTPUT_PRIMITIVES,
+    PROFILER_STAT_FS_INVOCATIONS,
+    PROFILER_N_PIPELINE_STATS
+} profiler_pipeline_stat_t;
+
+extern const char* profiler_pipeline_stat_names[PROFILER_N_PIPELINE_STATS];
+
+typedef struct profiler_pipeline_stats
+{
+    uint64_t values[PROFILER_N_PIPELINE_STATS];
+} profiler_pipeline_stats_t;
+
+typedef struct profiler_pipeline_query
+{
+    GLuint queries[PROFILER_N_PIPELINE_STATS];
+    int32_t supported;
+} profiler_pipeline_query_t;
+
+int32_t profiler_pipeline_query_init( profiler_pipeline_query_t* query );
+void profiler_pipeline_query_term( profiler_pipeline_query_t* query );
+void profiler_pipeline_query_begin( profiler_pipeline_query_t* query );
+void profiler_pipeline_query_end( profiler_pipeline_query_t* query );
+profiler_pipeline_stats_t profiler_pipeline_query_read( const profiler_pipeline_query_t* query );
+
+// Fixed-size histogram of durations, for percentiles over arbitrarily long runs. Buckets are spaced logarithmically,
+// with PROFILER_HISTOGRAM_SUB_BUCKETS per power of two starting at 1us, so reported percentiles are upper bounds
+// within ~4.4% of the true value. Values above the last bucket are counted in it; the exact maximum is kept aside.
+
+#ifndef PROFILER_HISTOGRAM_SUB_BUCKETS
+#define PROFILER_HISTOGRAM_SUB_BUCKETS 16
+#endif
+#define PROFILER_HISTOGRAM_N_BUCKETS (PROFILER_HISTOGRAM_SUB_BUCKETS * 24)
+
+typedef struct profiler_histogram
+{
+    uint32_t counts[PROFILER_HISTOGRAM_N_BUCKETS];
+    uint64_t n_values;
+    double sum;
+    double max;
+} profiler_histogram_t;
+
+void profiler_histogram_reset( profiler_histogram_t* histogram );
+void profiler_histogram_add( profiler_histogram_t* histogram, double value_ms );
+double profiler_histogram_percentile( const profiler_histogram_t* histogram, double percentile );
+double profiler_histogram_mean( const profiler_histogram_t* histogram );
+
+// Trace recorder. Named cpu scopes are timed with msh_time_now(), resolved gpu intervals are moved onto the same
+// timeline, and everything can be dumped as Chrome trace json (chrome://tracing, ui.perfetto.dev). Scopes are recorded
+// into whichever trace is active, so that the engines can mark their phases without any plumbing; when no trace is
+// active, beginning and ending a scope does nothing. Events past the capacity are dropped.
+
+#ifndef PROFILER_TRACE_MAX_DEPTH
+#define PROFILER_TRACE_MAX_DEPTH 16
+#endif
+
+typedef enum profiler_trace_track
+{
+    PROFILER_TRACK_CPU = 1,
+    PROFILER_TRACK_GPU = 2
+} profiler_trace_track_t;
+
+typedef struct profiler_trace_event
+{
+    const char* name;
+    const char* label;
+    int64_t frame_idx;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    profiler_trace_track_t track;
+} profiler_trace_event_t;
+
+typedef struct profiler_trace
+{
+    profiler_trace_event_t* events;
+    size_t n_events;
+    size_t capacity;
+    size_t n_dropped;
+
+    int64_t open_scopes[PROFILER_TRACE_MAX_DEPTH];
+    int32_t depth;
+
+    const char* label;
+    int64_t frame_idx;
+    int64_t gpu_to_cpu_offset_ns;
+} profiler_trace_t;
+
+void profiler_trace_init( profiler_trace_t* trace, size_t capacity );
+void profiler_trace_term( profiler_trace_t* trace );
+void profiler_trace_set_active( profiler_trace_t* trace );
+void profiler_trace_set_frame( const char* label, int64_t frame_idx );
+void profiler_trace_begin( const char* name );
+void profiler_trace_end( void );
+void profiler_trace_add_gpu_interval( profiler_trace_t* trace, const char* name, const char* label,
+                                      const profiler_gpu_interval_t* interval );
+int32_t profiler_trace_write( const profiler_trace_t* trace, const char* filename );
+
+#endif /* PROFILER_H */
+
+#ifdef PROFILER_IMPLEMENTATION
+
+void
+profiler_gpu_timer_init( profiler_gpu_timer_t* timer )
+{
+    memset( timer, 0, sizeof(profiler_gpu_timer_t) );
+    glGenQueries( 2 * PROFILER_GPU_TIMER_RING_SIZE, &timer->queries[0][0] );
+}
+
+void
+profiler_gpu_timer_term( profiler_gpu_timer_t* timer )
+{
+    glDeleteQueries( 2 * PROFILER_GPU_TIMER_RING_SIZE, &timer->queries[0][0] );
+    memset( timer, 0, sizeof(profiler_gpu_timer_t) );
+}
+
+int32_t
+profiler_gpu_timer_is_full( const profiler_gpu_timer_t* timer )
+{
+    return (timer->write_idx - timer->read_idx) >= PROFILER_GPU_TIMER_RING_SIZE;
+}
+
+void
+profiler_gpu_timer_begin( profiler_gpu_timer_t* timer, int64_t frame_idx, int32_t user_data )
+{
+    // Caller is expected to poll the results often enough for there to be space in the ring.
+    assert( !profiler_gpu_timer_is_full( timer ) );
+    uint32_t slot = timer->write_idx % PROFILER_GPU_TIMER_RING_SIZE;
+    timer->intervals[slot].frame_idx = frame_idx;
+    timer->intervals[slot].user_data = user_data;
+    glQueryCounter( timer->queries[slot][0], GL_TIMESTAMP );
+}
+
+void
+profiler_gpu_timer_end( profiler_gpu_timer_t* timer )
+{
+    uint32_t slot = timer->write_idx % PROFILER_GPU_TIMER_RING_SIZE;
+    glQueryCounter( timer->queries[slot][1], GL_TIMESTAMP );
+    timer->write_idx++;
+}
+
+// Returns the oldest interval, if its results are available. When 'wait' is set, this will block until they are.
+int32_t
+profiler_gpu_timer_poll( profiler_gpu_timer_t* timer, profiler_gpu_interval_t* interval, int32_t wait )
+{
+    if( timer->read_idx == timer->write_idx ) { return 0; }
+
+    uint32_t slot = timer->read_idx % PROFILER_GPU_TIMER_RING_SIZE;
+    if( !wait )
+    {
+        // Queries complete in order, so the end query being available implies the begin one is too.
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv( timer->queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available );
+        if( !available ) { return 0; }
+    }
+
+    GLuint64 begin_ns = 0, end_ns = 0;
+    glGetQueryObjectui64v( timer->queries[slot][0], GL_QUERY_RESULT, &begin_ns );
+    glGetQueryObjectui64v( timer->queries[slot][1], GL_QUERY_RESULT, &end_ns );
+    timer->intervals[slot].begin_ns = begin_ns;
+    timer->intervals[slot].end_ns = end_ns;
+    *interval = timer->intervals[slot];
+    timer->read_idx++;
+    return 1;
+}
+
+double
+profiler_gpu_interval_ms( const profiler_gpu_interval_t* interval )
+{
+    if( interval->end_ns < interval->begin_ns ) { return 0.0; }
+    return (interval->end_ns - interval->begin_ns) * 1e-6;
+}
+
+const char* profiler_pipeline_stat_names[PROFILER_N_PIPELINE_STATS] =
+{
+    "vertices_submitted", "primitives_submitted", "vs_invocations", "gs_invocations", "gs_primitives_emitted",
+    "clipping_input_primitives", "clipping_output_primitives", "fs_invocations"
+};
+
+static const GLenum profiler__pipeline_stat_targets[PROFILER_N_PIPELINE_STATS] =
+{
+    GL_VERTICES_SUBMITTED_ARB, GL_PRIMITIVES_SUBMITTED_ARB, GL_VERTEX_SHADER_INVOCATIONS_ARB,
+    GL_GEOMETRY_SHADER_INVOCATIONS, GL_GEOMETRY_SHADER_PRIMITIVES_EMITTED_ARB,
+    GL_CLIPPING_INPUT_PRIMITIVES_ARB, GL_CLIPPING_OUTPUT_PRIMITIVES_ARB, GL_FRAGMENT_SHADER_INVOCATIONS_ARB
+};
+
+// Returns 0 if pipeline statistics are not supported; begin/end are no-ops in that case.
+int32_t
+profiler_pipeline_query_init( profiler_pipeline_query_t* query )
+{
+    memset( query, 0, sizeof(profiler_pipeline_query_t) );
+    GLint major = 0, minor = 0;
+    glGetIntegerv( GL_MAJOR_VERSION, &major );
+    glGetIntegerv( GL_MINOR_VERSION, &minor );
+    query->supported = ( major > 4 || (major == 4 && minor >= 6) ) ||
+                       gl_utils_has_extension( "GL_ARB_pipeline_statistics_query" );
+    if( !query->supported )
+    {
+        fprintf( stderr, "[Profiler] GL_ARB_pipeline_statistics_query is not supported\n" );
+        return 0;
+    }
+    glGenQueries( PROFILER_N_PIPELINE_STATS, query->queries );
+    return 1;
+}
+
+void
+profiler_pipeline_query_term( profiler_pipeline_query_t* query )
+{
+    if( query->supported ) { glDeleteQueries( PROFILER_N_PIPELINE_STATS, query->queries ); }
+    memset( query, 0, sizeof(profiler_pipeline_query_t) );
+}
+
+void
+profiler_pipeline_query_begin( profiler_pipeline_query_t* query )
+{
+    if( !query->supported ) { return; }
+    for( int32_t i = 0; i < PROFILER_N_PIPELINE_STATS; ++i )
+    {
+        glBeginQuery( profiler__pipeline_stat_targets[i], query->queries[i] );
+    }
+}
+
+void
+profiler_pipeline_query_end( profiler_pipeline_query_t* query )
+{
+    if( !query->supported ) { return; }
+    for( int32_t i = 0; i < PROFILER_N_PIPELINE_STATS; ++i )
+    {
+        glEndQuery( profiler__pipeline_stat_targets[i] );
+    }
+}
+
+profiler_pipeline_stats_t
+profiler_pipeline_query_read( const profiler_pipeline_query_t* query )
+{
+    profiler_pipeline_stats_t stats = {0};
+    if( !query->supported ) { return stats; }
+    for( int32_t i = 0; i < PROFILER_N_PIPELINE_STATS; ++i )
+    {
+        GLuint64 value = 0;
+        glGetQueryObjectui64v( query->queries[i], GL_QUERY_RESULT, &value );
+        stats.values[i] = value;
+    }
+    return stats;
+}
+
+void
+profiler_histogram_reset( profiler_histogram_t* histogram )
+{
+    memset( histogram, 0, sizeof(profiler_histogram_t) );
+}
+
+void
+profiler_histogram_add( profiler_histogram_t* histogram, double value_ms )
+{
+    double value_us = value_ms * 1e3;
+    int32_t bucket = 0;
+    if( value_us > 1.0 )
+    {
+        bucket = (int32_t)( log2( value_us ) * PROFILER_HISTOGRAM_SUB_BUCKETS );
+        bucket = msh_min( bucket, PROFILER_HISTOGRAM_N_BUCKETS - 1 );
+    }
+    histogram->counts[bucket]++;
+    histogram->n_values++;
+    histogram->sum += value_ms;
+    histogram->max = msh_max( histogram->max, value_ms );
+}
+
+// 'percentile' is in [0, 100]. Returns the upper edge of the bucket containing it, clamped to the maximum.
+double
+profiler_histogram_percentile( const profiler_histogram_t* histogram, double percentile )
+{
+    if( !histogram->n_values ) { return 0.0; }
+    uint64_t rank = (uint64_t)ceil( percentile * 0.01 * histogram->n_values );
+    rank = msh_max( rank, 1 );
+    uint64_t n_seen = 0;
+    for( int32_t i = 0; i < PROFILER_HISTOGRAM_N_BUCKETS; ++i )
+    {
+        n_seen += histogram->counts[i];
+        if( n_seen >= rank )
+        {
+            double upper_ms = exp2( (double)(i + 1) / PROFILER_HISTOGRAM_SUB_BUCKETS ) * 1e-3;
+            return msh_min( upper_ms, histogram->max );
+        }
+    }
+    return histogram->max;
+}
+
+double
+profiler_histogram_mean( const profiler_histogram_t* histogram )
+{
+    return histogram->n_values ? histogram->sum / histogram->n_values : 0.0;
+}
+
+static profiler_trace_t* profiler__active_trace = NULL;
+
+void
+profiler_trace_init( profiler_trace_t* trace, size_t capacity )
+{
+    memset( trace, 0, sizeof(profiler_trace_t) );
+    trace->events = malloc( capacity * sizeof(profiler_trace_event_t) );
+    trace->capacity = capacity;
+
+    // GPU timestamps use their own clock. Sample both once to place gpu intervals on the cpu timeline.
+    GLint64 gpu_now = 0;
+    glGetInteger64v( GL_TIMESTAMP, &gpu_now );
+    trace->gpu_to_cpu_offset_ns = (int64_t)msh_time_now() - (int64_t)gpu_now;
+}
+
+void
+profiler_trace_term( profiler_trace_t* trace )
+{
+    if( profiler__active_trace == trace ) { profiler__active_trace = NULL; }
+    free( trace->events );
+    memset( trace, 0, sizeof(profiler_trace_t) );
+}
+
+void
+profiler_trace_set_active( profiler_trace_t* trace )
+{
+    profiler__active_trace = trace;
+}
+
+void
+profiler_trace_set_frame( const char* label, int64_t frame_idx )
+{
+    profiler_trace_t* trace = profiler__active_trace;
+    if( !trace ) { return; }
+    trace->label = label;
+    trace->frame_idx = frame_idx;
+}
+
+static profiler_trace_event_t*
+profiler__trace_push( profiler_trace_t* trace )
+{
+    if( trace->n_events >= trace->capacity )
+    {
+        trace->n_dropped++;
+        return NULL;
+    }
+    return trace->events + trace->n_events++;
+}
+
+void
+profiler_trace_begin( const char* name )
+{
+    profiler_trace_t* trace = profiler__active_trace;
+    if( !trace ) { return; }
+    assert( trace->depth < PROFILER_TRACE_MAX_DEPTH );
+
+    profiler_trace_event_t* event = profiler__trace_push( trace );
+    trace->open_scopes[trace->depth++] = event ? (int64_t)(event - trace->events) : -1;
+    if( !event ) { return; }
+
+    event->name = name;
+    event->label = trace->label;
+    event->frame_idx = trace->frame_idx;
+    event->track = PROFILER_TRACK_CPU;
+    event->begin_ns = msh_time_now();
+    event->end_ns = event->begin_ns;
+}
+
+void
+profiler_trace_end( void )
+{
+    profiler_trace_t* trace = profiler__active_trace;
+    if( !trace ) { return; }
+    assert( trace->depth > 0 );
+
+    int64_t event_idx = trace->open_scopes[--trace->depth];
+    if( event_idx >= 0 ) { trace->events[event_idx].end_ns = msh_time_now(); }
+}
+
+void
+profiler_trace_add_gpu_interval( profiler_trace_t* trace, const char* name, const char* label,
+                                 const profiler_gpu_interval_t* interval )
+{
+    if( !trace ) { return; }
+    profiler_trace_event_t* event = profiler__trace_push( trace );
+    if( !event ) { return; }
+
+    event->name = name;
+    event->label = label;
+    event->frame_idx = interval->frame_idx;
+    event->track = PROFILER_TRACK_GPU;
+    event->begin_ns = (uint64_t)((int64_t)interval->begin_ns + trace->gpu_to_cpu_offset_ns);
+    event->end_ns = (uint64_t)((int64_t)interval->end_ns + trace->gpu_to_cpu_offset_ns);
+}
+
+int32_t
+profiler_trace_write( const profiler_trace_t* trace, const char* filename )
+{
+    FILE* fp = fopen( filename, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "[Profiler] Failed to open %s for writing\n", filename );
+        return 0;
+    }
+
+    fprintf( fp, "{\n\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [\n" );
+    fprintf( fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"CPU\"}},\n",
+             PROFILER_TRACK_CPU );
+    fprintf( fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"GPU\"}}",
+             PROFILER_TRACK_GPU );
+    for( size_t i = 0; i < trace->n_events; ++i )
+    {
+        const profiler_trace_event_t* event = trace->events + i;
+        fprintf( fp, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                     "\"pid\": 1, \"tid\": %d, \"args\": {\"method\": \"%s\", \"frame\": %lld}}",
+                 event->name, event->track == PROFILER_TRACK_GPU ? "gpu" : "cpu",
+                 event->begin_ns * 1e-3, (event->end_ns - event->begin_ns) * 1e-3,
+                 event->track, event->label ? event->label : "", (long long)event->frame_idx );
+    }
+    fprintf( fp, "\n]\n}\n" );
+    fclose( fp );
+
+    if( trace->n_dropped )
+    {
+        fprintf( stderr, "[Profiler] Trace capacity exceeded, %zu events were dropped\n", trace->n_dropped );
+    }
+    return 1;
+}
+
+#endif /*PROFILER_IMPLEMENTATION*/
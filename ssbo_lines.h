@@ -4,8 +4,25 @@
 void* ssbo_lines_init_device(void);
 uint32_t ssbo_lines_update(void* device, const void* data, int32_t n_elems, int32_t elem_size,
                            uniform_data_t* uniform_data);
-void ssbo_lines_render(const void* device, const int32_t count);
+uint32_t ssbo_lines_update_ranges(void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                  const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data);
+void ssbo_lines_render(void* device, const int32_t count);
 void ssbo_lines_term_device(void**);
+memory_stats_t ssbo_lines_memory_stats(const void* device);
+
+// Upload the vertices as packed_vertex_t, and decode them in the vertex shader. Off by default. Takes effect for
+// devices created afterwards.
+void ssbo_lines_set_packed_input(bool packed);
+
+// Hand the uploads to 'worker' (see async_upload.h), and draw whatever upload completed last. Ranged updates upload
+// everything, and the input is not packed. NULL, the default, uploads in the update. Takes effect for devices created
+// afterwards.
+void ssbo_lines_set_async_upload(async_upload_worker_t* worker);
+
+// Retained line sets (see line_set.h) in the input layout of 'device', drawn with their own buffer bound in place of
+// the device's. Creating one returns NULL on failure.
+line_set_t* ssbo_lines_create_line_set(const void* device, const void* data, int32_t n_elems, int32_t elem_size);
+void ssbo_lines_draw_line_set(const void* device, const line_set_t* set, uniform_data_t* uniform_data);
 
 #endif /*SSBO_LINES*/
 
@@ -14,8 +31,21 @@ void ssbo_lines_term_device(void**);
 typedef struct ssbo_lines_device
 {
     GLuint program_id;
+    GLuint affine_program_id;
     GLuint vao;
-    GLuint line_data_ssbo;
+    // Each update is written to the next region of the ring, and bound as a range for the draw. Ranged updates copy
+    // the unchanged parts over from the previous one.
+    gl_utils_stream_buffer_t line_data_ssbo;
+    size_t alignment;
+    size_t data_offset;
+    size_t data_size;
+    
+    // Packed input keeps the bounds its vertices were encoded with, for ranged updates and the draw.
+    bool packed;
+    size_t buffer_elem_size;
+    packed_vertex_bounds_t bounds;
+    
+    async_upload_stream_t* async_stream;
     
     struct ssbo_lines_uniform_locations
     {
@@ -23,30 +53,73 @@ typedef struct ssbo_lines_device
         GLuint viewport_size;
         GLuint aa_radius;
         GLuint ssbo_data;
+        GLuint bounds_origin;
+        GLuint bounds_extent;
     } uniforms;
     
     uniform_data_t* uniform_data;
+    
+    memory_stats_t mem_stats;
 } ssbo_lines_device_t;
 
+static bool ssbo_lines__packed = false;
+static async_upload_worker_t* ssbo_lines__async_worker = NULL;
+
+void
+ssbo_lines_set_packed_input( bool packed )
+{
+    ssbo_lines__packed = packed;
+}
+
+void
+ssbo_lines_set_async_upload( async_upload_worker_t* worker )
+{
+    ssbo_lines__async_worker = worker;
+}
+
 void*
 ssbo_lines_init_device(void)
 {
     ssbo_lines_device_t* device = malloc( sizeof(ssbo_lines_device_t) );
     memset( device, 0, sizeof(ssbo_lines_device_t) );
+    device->packed = ssbo_lines__packed && !ssbo_lines__async_worker;
+    if( ssbo_lines__async_worker ) { device->async_stream = async_upload_stream_create( ssbo_lines__async_worker ); }
+    device->buffer_elem_size = device->packed ? sizeof(packed_vertex_t) : sizeof(vertex_t);
     
-    const char* vs_src =
-        GL_UTILS_SHDR_VERSION
+    // Either input provides load_vertex()
+    const char* input_src = device->packed ?
+        PACKED_VERTEX_SHDR_DECODE
+        GL_UTILS_SHDR_SOURCE(
+                             struct Vertex {
+                                 vec4 pos_width;
+                                 vec4 color;
+                             };
+                             layout(std430, binding=0) buffer VertexData {
+                                 uint words[];
+                             };
+                             Vertex load_vertex( int idx )
+                             {
+                                 uvec3 v = uvec3( words[3 * idx], words[3 * idx + 1], words[3 * idx + 2] );
+                                 return Vertex( unpack_pos_width( v ), unpack_col( v ) );
+                             }
+                             ) :
         GL_UTILS_SHDR_SOURCE(
                              struct Vertex {
                                  vec4 pos_width;
                                  vec4 color;
                              };
-                             layout(location = 0) uniform mat4 u_mvp;\n
-                             layout(location = 1) uniform vec2 u_viewport_size;\n
-                             layout(location = 2) uniform vec2 u_aa_radius;\n
                              layout(std430, binding=0) buffer VertexData {
                                  Vertex vertices[];
                              };
+                             Vertex load_vertex( int idx ) { return vertices[idx]; }
+                             );
+    
+    // Vertex stage is compiled in two variants, see GL_UTILS_SHDR_AFFINE
+    const char* vs_src =
+        GL_UTILS_SHDR_SOURCE(
+                             layout(location = 0) uniform mat4 u_mvp;\n
+                             layout(location = 1) uniform vec2 u_viewport_size;\n
+                             layout(location = 2) uniform vec2 u_aa_radius;\n
                              
                              out vec4 v_col;\n
                              out noperspective float v_u;
@@ -69,14 +142,14 @@ ssbo_lines_init_device(void)
                                                           ivec2(0, -1), ivec2(1, 1), ivec2(1, -1) );
                                  
                                  Vertex line_vertices[2];
-                                 line_vertices[0] = vertices[line_id_0];
-                                 line_vertices[1] = vertices[line_id_1];
+                                 line_vertices[0] = load_vertex( line_id_0 );
+                                 line_vertices[1] = load_vertex( line_id_1 );
                                  
-                                 vec4 clip_pos_a = u_mvp * vec4( line_vertices[0].pos_width.xyz, 1.0 );
-                                 vec4 clip_pos_b = u_mvp * vec4( line_vertices[1].pos_width.xyz, 1.0 );
+                                 vec4 clip_pos_a = project( u_mvp, line_vertices[0].pos_width.xyz );
+                                 vec4 clip_pos_b = project( u_mvp, line_vertices[1].pos_width.xyz );
                                  
-                                 vec2 ndc_pos_a = clip_pos_a.xy / clip_pos_a.w;
-                                 vec2 ndc_pos_b = clip_pos_b.xy / clip_pos_b.w;
+                                 vec2 ndc_pos_a = to_ndc( clip_pos_a );
+                                 vec2 ndc_pos_b = to_ndc( clip_pos_b );
                                  
                                  vec2 line_vector          = ndc_pos_b - ndc_pos_a;
                                  vec2 viewport_line_vector = line_vector * u_viewport_size;
@@ -106,12 +179,13 @@ ssbo_lines_init_device(void)
                                  v_col = line_vertices[quad_pos.x].color;
                                  v_col.a = min( line_vertices[quad_pos.x].pos_width.w * v_col.a, 1.0f );
                                  
-                                 gl_Position = vec4( (ndc_pos_a + dir_x + dir_y) * zw_part.y, zw_part );
+                                 gl_Position = from_ndc( ndc_pos_a + dir_x + dir_y, zw_part );
                              }
                              );
     
     const char* fs_src =
         GL_UTILS_SHDR_VERSION
+        GL_UTILS_SHDR_FRAG_OUTPUTS
         GL_UTILS_SHDR_SOURCE(
                              layout(location = 2) uniform vec2 u_aa_radius;
                              
@@ -121,47 +195,39 @@ ssbo_lines_init_device(void)
                              in noperspective float v_line_width;
                              in noperspective float v_line_length;
                              
-                             out vec4 frag_color;
                              void main()
                              {
                                  float au = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[0]) / v_line_width),  1.0, abs( v_u / v_line_width ) );
                                  float av = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[1]) / v_line_length), 1.0, abs( v_v / v_line_length ) );
                                  frag_color = v_col;
                                  frag_color.a *= min(au, av);
+                                 write_overdraw();
                              }
                              );
     
-    GLuint vertex_shader   = glCreateShader( GL_VERTEX_SHADER );
     GLuint fragment_shader = glCreateShader( GL_FRAGMENT_SHADER );
     
-    glShaderSource( vertex_shader, 1, &vs_src, 0 );
-    glCompileShader( vertex_shader );
-    gl_utils_assert_shader_compiled( vertex_shader, "VERTEX_SHADER" );
-    
     glShaderSource( fragment_shader, 1, &fs_src, 0 );
     glCompileShader( fragment_shader );
     gl_utils_assert_shader_compiled( fragment_shader, "FRAGMENT_SHADER" );
     
-    device->program_id = glCreateProgram();
-    glAttachShader( device->program_id, vertex_shader );
-    glAttachShader( device->program_id, fragment_shader );
-    glLinkProgram( device->program_id );
-    gl_utils_assert_program_linked( device->program_id );
-    
-    glDetachShader( device->program_id, vertex_shader );
-    glDetachShader( device->program_id, fragment_shader );
-    glDeleteShader( vertex_shader );
+    device->program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_PROJECTIVE, input_src, vs_src, NULL,
+                                                             fragment_shader );
+    device->affine_program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_AFFINE, input_src, vs_src, NULL,
+                                                                 fragment_shader );
     glDeleteShader( fragment_shader );
 #if 1
     device->uniforms.mvp           = glGetUniformLocation( device->program_id, "u_mvp" );
     device->uniforms.viewport_size = glGetUniformLocation( device->program_id, "u_viewport_size" );
     device->uniforms.aa_radius     = glGetUniformLocation( device->program_id, "u_aa_radius" );
+    device->uniforms.bounds_origin = glGetUniformLocation( device->program_id, "u_bounds_origin" );
+    device->uniforms.bounds_extent = glGetUniformLocation( device->program_id, "u_bounds_extent" );
     
     glCreateVertexArrays( 1, &device->vao );
     
-    glCreateBuffers( 1, &device->line_data_ssbo );
-    glNamedBufferStorage( device->line_data_ssbo, MAX_VERTS * sizeof(vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, device->line_data_ssbo );
+    GLint alignment = 0;
+    glGetIntegerv( GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment );
+    device->alignment = msh_max( (size_t)alignment, sizeof(vertex_t) );
 #endif
     return device;
 }
@@ -172,40 +238,143 @@ ssbo_lines_term_device( void** device_in )
 #if 1
     ssbo_lines_device_t* device = *device_in;
     glDeleteProgram( device->program_id );
-    glDeleteBuffers( 1, &device->line_data_ssbo );
+    glDeleteProgram( device->affine_program_id );
+    gl_utils_stream_buffer_term( &device->line_data_ssbo );
+    async_upload_stream_destroy( &device->async_stream );
     glDeleteVertexArrays( 1, &device->vao );
 #endif
 }
 
 uint32_t
-ssbo_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
-                  uniform_data_t* uniform_data )
+ssbo_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                          const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
 #if 1
     ssbo_lines_device_t* device = device_in;
     device->uniform_data = uniform_data;
-    glNamedBufferSubData( device->line_data_ssbo, 0, n_elems*elem_size, data );
+    if( device->async_stream )
+    {
+        async_upload_submit( device->async_stream, data, n_elems, elem_size );
+        device->mem_stats.gpu_buffer_bytes = async_upload_buffer_bytes( device->async_stream );
+        device->mem_stats.uploaded_bytes = (uint64_t)n_elems * elem_size;
+        device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
+        return n_elems;
+    }
+    size_t size = (size_t)n_elems * device->buffer_elem_size;
+    size_t offset = 0;
+    int32_t replaced = 0;
+    uint64_t n_stalls = device->line_data_ssbo.n_stalls;
+    profiler_trace_begin( "wait" );
+    uint8_t* dst = gl_utils_stream_buffer_reserve_frame( &device->line_data_ssbo, size, device->alignment, &offset,
+                                                         &replaced );
+    profiler_trace_end();
+    device->mem_stats.stalls = device->line_data_ssbo.n_stalls - n_stalls;
+    device->mem_stats.total_stalls += device->mem_stats.stalls;
+    device->mem_stats.gpu_buffer_bytes = device->line_data_ssbo.size;
+    uint32_t n_prev_elems = replaced ? 0 : (uint32_t)(device->data_size / device->buffer_elem_size);
+    device->data_size = 0;
+    if( !dst )
+    {
+        fprintf( stderr, "[SSBO Lines] Failed to allocate %zu bytes of line data\n", size );
+        return 0;
+    }
+    profiler_trace_begin( "upload" );
+    gl_utils_encoder_t encoder = { packed_vertex_encode, &device->bounds, elem_size };
+    if( device->packed &&
+        !packed_vertex_update_bounds( &device->bounds, data, n_elems, n_prev_elems, ranges, n_ranges ) )
+    {
+        ranges = NULL;
+    }
+    device->mem_stats.uploaded_bytes = gl_utils_stream_buffer_write( &device->line_data_ssbo, offset, data, n_elems,
+                                                                     device->buffer_elem_size,
+                                                                     device->packed ? &encoder : NULL, ranges,
+                                                                     n_ranges, device->data_offset, n_prev_elems );
+    profiler_trace_end();
+    device->data_offset = offset;
+    device->data_size = size;
+    device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
 #endif
     return n_elems;
 }
 
+uint32_t
+ssbo_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                  uniform_data_t* uniform_data )
+{
+    return ssbo_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+ssbo_lines_memory_stats( const void* device_in )
+{
+    const ssbo_lines_device_t* device = device_in;
+    return device->mem_stats;
+}
+
+// 'bounds' are those of packed input, NULL otherwise.
+static void
+ssbo_lines__use_program( const ssbo_lines_device_t* device, const uniform_data_t* uniform_data,
+                         const packed_vertex_bounds_t* bounds )
+{
+    glUseProgram( gl_utils_is_affine( uniform_data->mvp ) ? device->affine_program_id : device->program_id );
+    
+    glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, uniform_data->mvp );
+    glUniform2fv( device->uniforms.viewport_size, 1, uniform_data->viewport );
+    glUniform2fv( device->uniforms.aa_radius, 1, uniform_data->aa_radius );
+    if( bounds )
+    {
+        glUniform3fv( device->uniforms.bounds_origin, 1, bounds->origin.data );
+        glUniform3fv( device->uniforms.bounds_extent, 1, bounds->extent.data );
+    }
+}
+
 void
-ssbo_lines_render( const void* device_in, const int32_t count )
+ssbo_lines_render( void* device_in, const int32_t count )
 {
 #if 1
     const ssbo_lines_device_t* device = device_in;
-    glUseProgram( device->program_id );
-    
-    glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, device->uniform_data->mvp );
-    glUniform2fv( device->uniforms.viewport_size, 1, device->uniform_data->viewport );
-    glUniform2fv( device->uniforms.aa_radius, 1, device->uniform_data->aa_radius );
+    ssbo_lines__use_program( device, device->uniform_data, device->packed ? &device->bounds : NULL );
     
+    int32_t n_drawn = count;
+    if( device->async_stream )
+    {
+        async_upload_view_t view = async_upload_acquire( device->async_stream );
+        if( view.size ) { glBindBufferRange( GL_SHADER_STORAGE_BUFFER, 0, view.buffer, 0, view.size ); }
+        n_drawn = view.n_elems;
+    }
+    else if( device->data_size )
+    {
+        glBindBufferRange( GL_SHADER_STORAGE_BUFFER, 0, device->line_data_ssbo.buffer, device->data_offset,
+                           device->data_size );
+    }
     glBindVertexArray( device->vao );
-    glDrawArrays( GL_TRIANGLES, 0, 3 * count );
+    glDrawArrays( GL_TRIANGLES, 0, 3 * n_drawn );
+    if( device->async_stream ) { async_upload_release( device->async_stream ); }
     
     glBindVertexArray( 0 );
     glUseProgram( 0 );
 #endif
 }
 
-#endif
\ No newline at end of file
+line_set_t*
+ssbo_lines_create_line_set( const void* device_in, const void* data, int32_t n_elems, int32_t elem_size )
+{
+    const ssbo_lines_device_t* device = device_in;
+    return line_set_create( device->packed, data, n_elems, elem_size );
+}
+
+void
+ssbo_lines_draw_line_set( const void* device_in, const line_set_t* set, uniform_data_t* uniform_data )
+{
+    const ssbo_lines_device_t* device = device_in;
+    if( !set->n_elems ) { return; }
+    ssbo_lines__use_program( device, uniform_data, set->packed ? &set->bounds : NULL );
+    glBindBufferRange( GL_SHADER_STORAGE_BUFFER, 0, set->buffer.buffer, 0, set->buffer.used );
+    glBindVertexArray( device->vao );
+    glDrawArrays( GL_TRIANGLES, 0, 3 * set->n_elems );
+    
+    glBindVertexArray( 0 );
+    glUseProgram( 0 );
+}
+
+#endif
@@ -4,8 +4,25 @@
 void* tex_buffer_lines_init_device(void);
 uint32_t tex_buffer_lines_update(void* device, const void* data, int32_t n_elems, int32_t elem_size,
                                  uniform_data_t* uniform_data);
-void tex_buffer_lines_render(const void* device, const int32_t count);
+uint32_t tex_buffer_lines_update_ranges(void* device, const void* data, int32_t n_elems, int32_t elem_size,
+                                        const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data);
+void tex_buffer_lines_render(void* device, const int32_t count);
 void tex_buffer_lines_term_device(void**);
+memory_stats_t tex_buffer_lines_memory_stats(const void* device);
+
+// Upload the vertices as packed_vertex_t, one RGB32UI texel each, and decode them in the vertex shader. Off by
+// default. Takes effect for devices created afterwards.
+void tex_buffer_lines_set_packed_input(bool packed);
+
+// Hand the uploads to 'worker' (see async_upload.h), and draw whatever upload completed last. Ranged updates upload
+// everything, and the input is not packed. NULL, the default, uploads in the update. Takes effect for devices created
+// afterwards.
+void tex_buffer_lines_set_async_upload(async_upload_worker_t* worker);
+
+// Retained line sets (see line_set.h) in the input layout of 'device', drawn with the texture viewing their own buffer
+// instead of the device's. Creating one returns NULL on failure, including sets beyond the texture buffer limit.
+line_set_t* tex_buffer_lines_create_line_set(const void* device, const void* data, int32_t n_elems, int32_t elem_size);
+void tex_buffer_lines_draw_line_set(const void* device, const line_set_t* set, uniform_data_t* uniform_data);
 
 #endif /*TEX_BUFFER_LINES*/
 
@@ -14,9 +31,25 @@ void tex_buffer_lines_term_device(void**);
 typedef struct tex_buffer_lines_device
 {
     GLuint program_id;
+    GLuint affine_program_id;
     GLuint vao;
-    GLuint line_data_buffer;
+    // Each update is written to the next region of the ring, which the texture then views. Ranged updates copy the
+    // unchanged parts over from the previous one.
+    gl_utils_stream_buffer_t line_data_buffer;
+    size_t alignment;
+    size_t data_offset;
+    uint32_t n_data_elems;
     GLuint line_data_texture_id;
+    GLint max_texels;
+    
+    // Packed input keeps the bounds its vertices were encoded with, for ranged updates and the draw.
+    bool packed;
+    size_t buffer_elem_size;
+    GLenum texel_format;
+    size_t texel_size;
+    packed_vertex_bounds_t bounds;
+    
+    async_upload_stream_t* async_stream;
     
     struct tex_buffer_lines_uniform_locations
     {
@@ -25,24 +58,70 @@ typedef struct tex_buffer_lines_device
         GLuint aa_radius;
         
         GLuint line_data_sampler;
+        GLuint bounds_origin;
+        GLuint bounds_extent;
     } uniforms;
     
     uniform_data_t* uniform_data;
+    
+    memory_stats_t mem_stats;
 } tex_buffer_lines_device_t;
 
+static bool tex_buffer_lines__packed = false;
+static async_upload_worker_t* tex_buffer_lines__async_worker = NULL;
+
+void
+tex_buffer_lines_set_packed_input( bool packed )
+{
+    tex_buffer_lines__packed = packed;
+}
+
+void
+tex_buffer_lines_set_async_upload( async_upload_worker_t* worker )
+{
+    tex_buffer_lines__async_worker = worker;
+}
+
 void*
 tex_buffer_lines_init_device(void)
 {
     tex_buffer_lines_device_t* device = malloc( sizeof(tex_buffer_lines_device_t) );
     memset( device, 0, sizeof(tex_buffer_lines_device_t) );
+    device->packed = tex_buffer_lines__packed && !tex_buffer_lines__async_worker;
+    if( tex_buffer_lines__async_worker )
+    {
+        device->async_stream = async_upload_stream_create( tex_buffer_lines__async_worker );
+    }
+    device->buffer_elem_size = device->packed ? sizeof(packed_vertex_t) : sizeof(vertex_t);
+    device->texel_format = device->packed ? GL_RGB32UI : GL_RGBA32F;
+    device->texel_size = device->packed ? sizeof(packed_vertex_t) : 4 * sizeof(float);
     
+    // Either input provides load_pos_width() and load_color()
+    const char* input_src = device->packed ?
+        PACKED_VERTEX_SHDR_DECODE
+        GL_UTILS_SHDR_SOURCE(
+                             layout(location = 3) uniform usamplerBuffer u_line_data_sampler;\n
+                             vec4 load_pos_width( int idx )
+                             {
+                                 return unpack_pos_width( texelFetch( u_line_data_sampler, idx ).xyz );
+                             }
+                             vec4 load_color( int idx )
+                             {
+                                 return unpack_col( texelFetch( u_line_data_sampler, idx ).xyz );
+                             }
+                             ) :
+        GL_UTILS_SHDR_SOURCE(
+                             layout(location = 3) uniform samplerBuffer u_line_data_sampler;\n
+                             vec4 load_pos_width( int idx ) { return texelFetch( u_line_data_sampler, idx * 2 ); }
+                             vec4 load_color( int idx ) { return texelFetch( u_line_data_sampler, idx * 2 + 1 ); }
+                             );
+    
+    // Vertex stage is compiled in two variants, see GL_UTILS_SHDR_AFFINE
     const char* vs_src =
-        GL_UTILS_SHDR_VERSION
         GL_UTILS_SHDR_SOURCE(
                              layout(location = 0) uniform mat4 u_mvp;\n
                              layout(location = 1) uniform vec2 u_viewport_size;\n
                              layout(location = 2) uniform vec2 u_aa_radius;\n
-                             layout(location = 3) uniform samplerBuffer u_line_data_sampler;\n
                              
                              // TODO(maciej): communicate vertex layout to vertex shader somehow.
                              
@@ -68,18 +147,18 @@ tex_buffer_lines_init_device(void)
                                  
                                  // Sample data for this line segment
                                  vec4 pos_width[2];
-                                 pos_width[0] = texelFetch( u_line_data_sampler, line_id_0 * 2 );
-                                 pos_width[1] = texelFetch( u_line_data_sampler, line_id_1 * 2 );
+                                 pos_width[0] = load_pos_width( line_id_0 );
+                                 pos_width[1] = load_pos_width( line_id_1 );
                                  
                                  vec4 color[2];
-                                 color[0] = texelFetch( u_line_data_sampler, line_id_0 * 2 + 1 );
-                                 color[1] = texelFetch( u_line_data_sampler, line_id_1 * 2 + 1 );
+                                 color[0] = load_color( line_id_0 );
+                                 color[1] = load_color( line_id_1 );
                                  
-                                 vec4 clip_pos_a = u_mvp * vec4( pos_width[0].xyz, 1.0 );
-                                 vec4 clip_pos_b = u_mvp * vec4( pos_width[1].xyz, 1.0 );
+                                 vec4 clip_pos_a = project( u_mvp, pos_width[0].xyz );
+                                 vec4 clip_pos_b = project( u_mvp, pos_width[1].xyz );
                                  
-                                 vec2 ndc_pos_a = clip_pos_a.xy / clip_pos_a.w;
-                                 vec2 ndc_pos_b = clip_pos_b.xy / clip_pos_b.w;
+                                 vec2 ndc_pos_a = to_ndc( clip_pos_a );
+                                 vec2 ndc_pos_b = to_ndc( clip_pos_b );
                                  
                                  vec2 line_vector          = ndc_pos_b - ndc_pos_a;
                                  vec2 viewport_line_vector = line_vector * u_viewport_size;
@@ -109,12 +188,13 @@ tex_buffer_lines_init_device(void)
                                  v_col = color[ quad_pos.x ];
                                  v_col.a = min( pos_width[quad_pos.x].w * v_col.a, 1.0f );
                                  
-                                 gl_Position = vec4( (ndc_pos_a + dir_x + dir_y) * zw_part.y, zw_part );
+                                 gl_Position = from_ndc( ndc_pos_a + dir_x + dir_y, zw_part );
                              }
                              );
     
     const char* fs_src =
         GL_UTILS_SHDR_VERSION
+        GL_UTILS_SHDR_FRAG_OUTPUTS
         GL_UTILS_SHDR_SOURCE(
                              
                              layout(location = 2) uniform vec2 u_aa_radius;
@@ -125,36 +205,26 @@ tex_buffer_lines_init_device(void)
                              in noperspective float v_line_width;
                              in noperspective float v_line_length;
                              
-                             out vec4 frag_color;
                              void main()
                              {
                                  float au = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[0]) / v_line_width),  1.0, abs( v_u / v_line_width ) );
                                  float av = 1.0 - smoothstep( 1.0 - ((2.0*u_aa_radius[1]) / v_line_length), 1.0, abs( v_v / v_line_length ) );
                                  frag_color = v_col;
                                  frag_color.a *= min(au, av);
+                                 write_overdraw();
                              }
                              );
     
-    GLuint vertex_shader   = glCreateShader( GL_VERTEX_SHADER );
     GLuint fragment_shader = glCreateShader( GL_FRAGMENT_SHADER );
     
-    glShaderSource( vertex_shader, 1, &vs_src, 0 );
-    glCompileShader( vertex_shader );
-    gl_utils_assert_shader_compiled( vertex_shader, "VERTEX_SHADER" );
-    
     glShaderSource( fragment_shader, 1, &fs_src, 0 );
     glCompileShader( fragment_shader );
     gl_utils_assert_shader_compiled( fragment_shader, "FRAGMENT_SHADER" );
     
-    device->program_id = glCreateProgram();
-    glAttachShader( device->program_id, vertex_shader );
-    glAttachShader( device->program_id, fragment_shader );
-    glLinkProgram( device->program_id );
-    gl_utils_assert_program_linked( device->program_id );
-    
-    glDetachShader( device->program_id, vertex_shader );
-    glDetachShader( device->program_id, fragment_shader );
-    glDeleteShader( vertex_shader );
+    device->program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_PROJECTIVE, input_src, vs_src, NULL,
+                                                             fragment_shader );
+    device->affine_program_id = gl_utils_create_program_variant( GL_UTILS_SHDR_AFFINE, input_src, vs_src, NULL,
+                                                                 fragment_shader );
     glDeleteShader( fragment_shader );
     
     device->uniforms.mvp           = glGetUniformLocation( device->program_id, "u_mvp" );
@@ -162,14 +232,17 @@ tex_buffer_lines_init_device(void)
     device->uniforms.aa_radius     = glGetUniformLocation( device->program_id, "u_aa_radius" );
     
     device->uniforms.line_data_sampler = glGetUniformLocation( device->program_id, "u_line_data_sampler");
+    device->uniforms.bounds_origin = glGetUniformLocation( device->program_id, "u_bounds_origin" );
+    device->uniforms.bounds_extent = glGetUniformLocation( device->program_id, "u_bounds_extent" );
     
     glCreateVertexArrays( 1, &device->vao );
     
-    glCreateBuffers( 1, &device->line_data_buffer );
-    glNamedBufferStorage( device->line_data_buffer, MAX_VERTS * sizeof(vertex_t), NULL, GL_DYNAMIC_STORAGE_BIT );
+    glGetIntegerv( GL_MAX_TEXTURE_BUFFER_SIZE, &device->max_texels );
+    GLint alignment = 0;
+    glGetIntegerv( GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT, &alignment );
+    device->alignment = msh_max( (size_t)alignment, sizeof(vertex_t) );
     
     glCreateTextures( GL_TEXTURE_BUFFER, 1, &device->line_data_texture_id );
-    glTextureBuffer( device->line_data_texture_id, GL_RGBA32F, device->line_data_buffer );
     
     return device;
 }
@@ -179,37 +252,164 @@ tex_buffer_lines_term_device( void** device_in )
 {
     tex_buffer_lines_device_t* device = *device_in;
     glDeleteProgram( device->program_id );
-    glDeleteBuffers( 1, &device->line_data_buffer );
+    glDeleteProgram( device->affine_program_id );
+    gl_utils_stream_buffer_term( &device->line_data_buffer );
+    async_upload_stream_destroy( &device->async_stream );
     glDeleteVertexArrays( 1, &device->vao );
     glDeleteTextures( 1, &device->line_data_texture_id );
 }
 
 uint32_t
-tex_buffer_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
-                        uniform_data_t* uniform_data )
+tex_buffer_lines_update_ranges( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                                const line_range_t* ranges, int32_t n_ranges, uniform_data_t* uniform_data )
 {
     tex_buffer_lines_device_t* device = device_in;
     device->uniform_data = uniform_data;
-    glNamedBufferSubData( device->line_data_buffer, 0, n_elems*elem_size, data );
+    // Unlike the buffer, the texture that views it cannot grow beyond an implementation limit.
+    size_t n_texels = (size_t)n_elems * device->buffer_elem_size / device->texel_size;
+    if( n_texels > (size_t)device->max_texels )
+    {
+        fprintf( stderr, "[Tex. Buffer Lines] %zu texels exceed the texture buffer limit of %d\n",
+                 n_texels, device->max_texels );
+        return 0;
+    }
+    if( device->async_stream )
+    {
+        async_upload_submit( device->async_stream, data, n_elems, elem_size );
+        device->mem_stats.gpu_buffer_bytes = async_upload_buffer_bytes( device->async_stream );
+        device->mem_stats.uploaded_bytes = (uint64_t)n_elems * elem_size;
+        device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
+        return n_elems;
+    }
+    size_t size = (size_t)n_elems * device->buffer_elem_size;
+    if( !size ) { return 0; }
+    size_t offset = 0;
+    int32_t replaced = 0;
+    uint64_t n_stalls = device->line_data_buffer.n_stalls;
+    profiler_trace_begin( "wait" );
+    uint8_t* dst = gl_utils_stream_buffer_reserve_frame( &device->line_data_buffer, size, device->alignment, &offset,
+                                                         &replaced );
+    profiler_trace_end();
+    device->mem_stats.stalls = device->line_data_buffer.n_stalls - n_stalls;
+    device->mem_stats.total_stalls += device->mem_stats.stalls;
+    device->mem_stats.gpu_buffer_bytes = device->line_data_buffer.size;
+    uint32_t n_prev_elems = replaced ? 0 : device->n_data_elems;
+    device->n_data_elems = 0;
+    if( !dst )
+    {
+        fprintf( stderr, "[Tex. Buffer Lines] Failed to allocate %zu bytes of line data\n", size );
+        return 0;
+    }
+    profiler_trace_begin( "upload" );
+    gl_utils_encoder_t encoder = { packed_vertex_encode, &device->bounds, elem_size };
+    if( device->packed &&
+        !packed_vertex_update_bounds( &device->bounds, data, n_elems, n_prev_elems, ranges, n_ranges ) )
+    {
+        ranges = NULL;
+    }
+    device->mem_stats.uploaded_bytes = gl_utils_stream_buffer_write( &device->line_data_buffer, offset, data, n_elems,
+                                                                     device->buffer_elem_size,
+                                                                     device->packed ? &encoder : NULL, ranges,
+                                                                     n_ranges, device->data_offset, n_prev_elems );
+    profiler_trace_end();
+    device->data_offset = offset;
+    device->n_data_elems = n_elems;
+    glTextureBufferRange( device->line_data_texture_id, device->texel_format, device->line_data_buffer.buffer, offset,
+                          size );
+    device->mem_stats.total_uploaded_bytes += device->mem_stats.uploaded_bytes;
     return n_elems;
 }
 
+uint32_t
+tex_buffer_lines_update( void* device_in, const void* data, int32_t n_elems, int32_t elem_size,
+                        uniform_data_t* uniform_data )
+{
+    return tex_buffer_lines_update_ranges( device_in, data, n_elems, elem_size, NULL, 0, uniform_data );
+}
+
+memory_stats_t
+tex_buffer_lines_memory_stats( const void* device_in )
+{
+    const tex_buffer_lines_device_t* device = device_in;
+    return device->mem_stats;
+}
+
+// 'bounds' are those of packed input, NULL otherwise.
+static void
+tex_buffer_lines__use_program( const tex_buffer_lines_device_t* device, const uniform_data_t* uniform_data,
+                               const packed_vertex_bounds_t* bounds )
+{
+    glUseProgram( gl_utils_is_affine( uniform_data->mvp ) ? device->affine_program_id : device->program_id );
+    
+    glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, uniform_data->mvp );
+    glUniform2fv( device->uniforms.viewport_size, 1, uniform_data->viewport );
+    glUniform2fv( device->uniforms.aa_radius, 1, uniform_data->aa_radius );
+    if( bounds )
+    {
+        glUniform3fv( device->uniforms.bounds_origin, 1, bounds->origin.data );
+        glUniform3fv( device->uniforms.bounds_extent, 1, bounds->extent.data );
+    }
+}
+
 void
-tex_buffer_lines_render( const void* device_in, const int32_t count )
+tex_buffer_lines_render( void* device_in, const int32_t count )
 {
     const tex_buffer_lines_device_t* device = device_in;
-    glUseProgram( device->program_id );
+    tex_buffer_lines__use_program( device, device->uniform_data, device->packed ? &device->bounds : NULL );
+    
+    int32_t n_drawn = count;
+    if( device->async_stream )
+    {
+        async_upload_view_t view = async_upload_acquire( device->async_stream );
+        if( view.size )
+        {
+            glTextureBufferRange( device->line_data_texture_id, device->texel_format, view.buffer, 0, view.size );
+        }
+        n_drawn = view.n_elems;
+    }
     
-    glUniformMatrix4fv( device->uniforms.mvp, 1, GL_FALSE, device->uniform_data->mvp );
-    glUniform2fv( device->uniforms.viewport_size, 1, device->uniform_data->viewport );
-    glUniform2fv( device->uniforms.aa_radius, 1, device->uniform_data->aa_radius );
+    glActiveTexture( GL_TEXTURE0 );
+    glBindTexture( GL_TEXTURE_BUFFER, device->line_data_texture_id );
+    glUniform1i( device->uniforms.line_data_sampler, 0 );
+    
+    glBindVertexArray( device->vao );
+    glDrawArrays( GL_TRIANGLES, 0, 3 * n_drawn );
+    if( device->async_stream ) { async_upload_release( device->async_stream ); }
+    
+    glBindVertexArray( 0 );
+    glUseProgram( 0 );
+}
+
+line_set_t*
+tex_buffer_lines_create_line_set( const void* device_in, const void* data, int32_t n_elems, int32_t elem_size )
+{
+    const tex_buffer_lines_device_t* device = device_in;
+    size_t n_texels = (size_t)n_elems * device->buffer_elem_size / device->texel_size;
+    if( n_texels > (size_t)device->max_texels )
+    {
+        fprintf( stderr, "[Tex. Buffer Lines] %zu texels exceed the texture buffer limit of %d\n",
+                 n_texels, device->max_texels );
+        return NULL;
+    }
+    return line_set_create( device->packed, data, n_elems, elem_size );
+}
+
+// The texture is left viewing the set - the next update points it back at the ring.
+void
+tex_buffer_lines_draw_line_set( const void* device_in, const line_set_t* set, uniform_data_t* uniform_data )
+{
+    const tex_buffer_lines_device_t* device = device_in;
+    if( !set->n_elems ) { return; }
+    tex_buffer_lines__use_program( device, uniform_data, set->packed ? &set->bounds : NULL );
+    glTextureBufferRange( device->line_data_texture_id, device->texel_format, set->buffer.buffer, 0,
+                          set->buffer.used );
     
     glActiveTexture( GL_TEXTURE0 );
     glBindTexture( GL_TEXTURE_BUFFER, device->line_data_texture_id );
     glUniform1i( device->uniforms.line_data_sampler, 0 );
     
     glBindVertexArray( device->vao );
-    glDrawArrays( GL_TRIANGLES, 0, 3 * count );
+    glDrawArrays( GL_TRIANGLES, 0, 3 * set->n_elems );
     
     glBindVertexArray( 0 );
     glUseProgram( 0 );
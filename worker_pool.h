@@ -0,0 +1,220 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+// Minimal persistent pool of worker threads. worker_pool_run() hands out 'n_tasks' task indices to the workers and to
+// the calling thread, and returns once all of them are done, so the caller can use the results right away. Workers
+// sleep between runs. Tasks should be coarse - they are handed out under a lock.
+
+typedef void (*worker_pool_task_fn)( void* user_data, uint32_t task_idx );
+
+typedef struct worker_pool worker_pool_t;
+
+// 'n_threads' counts the calling thread as well; 0 uses one thread per available core, 1 runs everything inline.
+worker_pool_t* worker_pool_create( int32_t n_threads );
+void worker_pool_destroy( worker_pool_t** pool );
+int32_t worker_pool_thread_count( const worker_pool_t* pool );
+void worker_pool_run( worker_pool_t* pool, worker_pool_task_fn task, void* user_data, uint32_t n_tasks );
+int32_t worker_pool_core_count( void );
+
+#endif /* WORKER_POOL_H */
+
+#ifdef WORKER_POOL_IMPLEMENTATION
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE             worker_pool__thread_t;
+typedef CRITICAL_SECTION   worker_pool__mutex_t;
+typedef CONDITION_VARIABLE worker_pool__cond_t;
+#define worker_pool__lock( m )          EnterCriticalSection( m )
+#define worker_pool__unlock( m )        LeaveCriticalSection( m )
+#define worker_pool__wait( c, m )       SleepConditionVariableCS( c, m, INFINITE )
+#define worker_pool__broadcast( c )     WakeAllConditionVariable( c )
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t          worker_pool__thread_t;
+typedef pthread_mutex_t    worker_pool__mutex_t;
+typedef pthread_cond_t     worker_pool__cond_t;
+#define worker_pool__lock( m )          pthread_mutex_lock( m )
+#define worker_pool__unlock( m )        pthread_mutex_unlock( m )
+#define worker_pool__wait( c, m )       pthread_cond_wait( c, m )
+#define worker_pool__broadcast( c )     pthread_cond_broadcast( c )
+#endif
+
+struct worker_pool
+{
+    int32_t n_workers;
+    worker_pool__thread_t* workers;
+
+    worker_pool__mutex_t mutex;
+    worker_pool__cond_t work_available;
+    worker_pool__cond_t work_done;
+
+    // Current run; guarded by the mutex. 'generation' changes for every run, so that sleeping workers can tell a new
+    // run from a spurious wakeup.
+    worker_pool_task_fn task;
+    void* user_data;
+    uint32_t n_tasks;
+    uint32_t next_task;
+    uint32_t n_finished;
+    uint64_t generation;
+    int32_t shutdown;
+};
+
+int32_t
+worker_pool_core_count( void )
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    return msh_max( (int32_t)info.dwNumberOfProcessors, 1 );
+#else
+    return msh_max( (int32_t)sysconf( _SC_NPROCESSORS_ONLN ), 1 );
+#endif
+}
+
+// Runs tasks of the current run until there are none left. Called with the mutex held, returns with it held.
+static void
+worker_pool__drain( worker_pool_t* pool )
+{
+    while( pool->next_task < pool->n_tasks )
+    {
+        uint32_t task_idx = pool->next_task++;
+        worker_pool__unlock( &pool->mutex );
+        pool->task( pool->user_data, task_idx );
+        worker_pool__lock( &pool->mutex );
+        if( ++pool->n_finished == pool->n_tasks ) { worker_pool__broadcast( &pool->work_done ); }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+worker_pool__main( LPVOID arg )
+#else
+static void*
+worker_pool__main( void* arg )
+#endif
+{
+    worker_pool_t* pool = arg;
+    uint64_t seen_generation = 0;
+    worker_pool__lock( &pool->mutex );
+    for( ;; )
+    {
+        while( !pool->shutdown && pool->generation == seen_generation )
+        {
+            worker_pool__wait( &pool->work_available, &pool->mutex );
+        }
+        if( pool->shutdown ) { break; }
+        seen_generation = pool->generation;
+        worker_pool__drain( pool );
+    }
+    worker_pool__unlock( &pool->mutex );
+    return 0;
+}
+
+worker_pool_t*
+worker_pool_create( int32_t n_threads )
+{
+    if( n_threads <= 0 ) { n_threads = worker_pool_core_count(); }
+
+    worker_pool_t* pool = malloc( sizeof(worker_pool_t) );
+    memset( pool, 0, sizeof(worker_pool_t) );
+    pool->n_workers = n_threads - 1;
+    pool->workers = pool->n_workers ? malloc( pool->n_workers * sizeof(worker_pool__thread_t) ) : NULL;
+
+#ifdef _WIN32
+    InitializeCriticalSection( &pool->mutex );
+    InitializeConditionVariable( &pool->work_available );
+    InitializeConditionVariable( &pool->work_done );
+#else
+    pthread_mutex_init( &pool->mutex, NULL );
+    pthread_cond_init( &pool->work_available, NULL );
+    pthread_cond_init( &pool->work_done, NULL );
+#endif
+
+    for( int32_t i = 0; i < pool->n_workers; ++i )
+    {
+#ifdef _WIN32
+        pool->workers[i] = CreateThread( NULL, 0, worker_pool__main, pool, 0, NULL );
+        int32_t created = pool->workers[i] != NULL;
+#else
+        int32_t created = pthread_create( &pool->workers[i], NULL, worker_pool__main, pool ) == 0;
+#endif
+        if( !created )
+        {
+            fprintf( stderr, "[WorkerPool] Failed to start worker thread, continuing with %d threads\n", i + 1 );
+            pool->n_workers = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+void
+worker_pool_destroy( worker_pool_t** pool_in )
+{
+    worker_pool_t* pool = *pool_in;
+    if( !pool ) { return; }
+
+    worker_pool__lock( &pool->mutex );
+    pool->shutdown = 1;
+    worker_pool__broadcast( &pool->work_available );
+    worker_pool__unlock( &pool->mutex );
+
+    for( int32_t i = 0; i < pool->n_workers; ++i )
+    {
+#ifdef _WIN32
+        WaitForSingleObject( pool->workers[i], INFINITE );
+        CloseHandle( pool->workers[i] );
+#else
+        pthread_join( pool->workers[i], NULL );
+#endif
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection( &pool->mutex );
+#else
+    pthread_mutex_destroy( &pool->mutex );
+    pthread_cond_destroy( &pool->work_available );
+    pthread_cond_destroy( &pool->work_done );
+#endif
+    free( pool->workers );
+    free( pool );
+    *pool_in = NULL;
+}
+
+int32_t
+worker_pool_thread_count( const worker_pool_t* pool )
+{
+    return pool ? pool->n_workers + 1 : 1;
+}
+
+void
+worker_pool_run( worker_pool_t* pool, worker_pool_task_fn task, void* user_data, uint32_t n_tasks )
+{
+    // Nothing to share - skip waking up the workers.
+    if( !pool || !pool->n_workers || n_tasks <= 1 )
+    {
+        for( uint32_t i = 0; i < n_tasks; ++i ) { task( user_data, i ); }
+        return;
+    }
+
+    worker_pool__lock( &pool->mutex );
+    pool->task = task;
+    pool->user_data = user_data;
+    pool->n_tasks = n_tasks;
+    pool->next_task = 0;
+    pool->n_finished = 0;
+    pool->generation++;
+    worker_pool__broadcast( &pool->work_available );
+
+    // The calling thread works too, then waits for the tasks still running on the workers.
+    worker_pool__drain( pool );
+    while( pool->n_finished < pool->n_tasks )
+    {
+        worker_pool__wait( &pool->work_done, &pool->mutex );
+    }
+    worker_pool__unlock( &pool->mutex );
+}
+
+#endif /*WORKER_POOL_IMPLEMENTATION*/
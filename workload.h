@@ -0,0 +1,254 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+// Synthetic line data. Besides the small demo scene used for screenshots, segments can be generated from a seeded
+// random workload description, so that scenes with a given density can be reproduced when comparing methods.
+// Sizes are specified in pixels and converted to world units using the 'view_half_extent' / 'viewport_size' pair.
+
+typedef enum workload_distribution
+{
+    WORKLOAD_DIST_CONSTANT,    // always 'a'
+    WORKLOAD_DIST_UNIFORM,     // uniform in [a, b]
+    WORKLOAD_DIST_NORMAL,      // mean 'a', standard deviation 'b'
+    WORKLOAD_DIST_EXPONENTIAL, // 'a' + exponential with mean 'b'; long tail of occasional large values
+    WORKLOAD_N_DISTRIBUTIONS
+} workload_distribution_t;
+
+typedef struct workload_range
+{
+    workload_distribution_t distribution;
+    float a;
+    float b;
+} workload_range_t;
+
+typedef struct workload_desc
+{
+    uint32_t n_segments;       // 0 generates the demo scene
+    uint32_t seed;
+    workload_range_t length;   // in pixels
+    workload_range_t width;    // in pixels
+    float coverage;            // fraction of the screen area the segments are spread over; smaller means more overdraw
+    bool is_3d;                // random depth, otherwise all segments lie in z = 0 plane
+    bool polyline;             // consecutive segments share endpoints, otherwise segments are disjoint
+    uint32_t n_dirty_segments; // segments workload_perturb() changes per frame
+
+    msh_vec2_t view_half_extent;
+    msh_vec2_t viewport_size;
+} workload_desc_t;
+
+// Most ranges that workload_perturb() reports.
+#define WORKLOAD_MAX_DIRTY_RANGES 4
+
+uint32_t workload_vertex_count( const workload_desc_t* desc );
+void workload_generate( const workload_desc_t* desc, vertex_t* line_buf, uint32_t* line_buf_len, uint32_t line_buf_cap );
+int32_t workload_perturb( const workload_desc_t* desc, vertex_t* line_buf, uint32_t line_buf_len, int64_t frame_idx,
+                          int64_t first_frame_idx, line_range_t* ranges );
+int32_t workload_parse_distribution( const char* name, workload_distribution_t* distribution );
+
+#endif /* WORKLOAD_H */
+
+#ifdef WORKLOAD_IMPLEMENTATION
+
+static const char* workload__distribution_names[WORKLOAD_N_DISTRIBUTIONS] =
+{
+    "constant", "uniform", "normal", "exponential"
+};
+
+int32_t
+workload_parse_distribution( const char* name, workload_distribution_t* distribution )
+{
+    for( int32_t i = 0; i < WORKLOAD_N_DISTRIBUTIONS; ++i )
+    {
+        if( !strcmp( name, workload__distribution_names[i] ) )
+        {
+            *distribution = (workload_distribution_t)i;
+            return 1;
+        }
+    }
+    fprintf( stderr, "[Workload] Unknown distribution \"%s\"\n", name );
+    return 0;
+}
+
+static float
+workload__sample( msh_rand_ctx_t* rand_gen, workload_range_t range )
+{
+    float value = range.a;
+    switch( range.distribution )
+    {
+        case WORKLOAD_DIST_CONSTANT:
+            break;
+        case WORKLOAD_DIST_UNIFORM:
+            value = range.a + msh_rand_nextf( rand_gen ) * (range.b - range.a);
+            break;
+        case WORKLOAD_DIST_NORMAL:
+        {
+            // Box-Muller; guard against log(0)
+            float u1 = msh_max( msh_rand_nextf( rand_gen ), 1e-7f );
+            float u2 = msh_rand_nextf( rand_gen );
+            value = range.a + range.b * sqrtf( -2.0f * logf( u1 ) ) * cosf( MSH_TWO_PI * u2 );
+        } break;
+        case WORKLOAD_DIST_EXPONENTIAL:
+        {
+            float u = msh_max( msh_rand_nextf( rand_gen ), 1e-7f );
+            value = range.a - range.b * logf( u );
+        } break;
+        default:
+            break;
+    }
+    return msh_max( value, 0.0f );
+}
+
+static void
+workload__generate_demo( vertex_t *line_buf, uint32_t *line_buf_len, uint32_t line_buf_cap )
+{
+    vertex_t *dst = line_buf;
+    float line_width = 0.5;
+    for (float f = -7.2f; f < 2.2f ; f += 0.6f)
+    {
+        if( *line_buf_len + 2 > line_buf_cap ) { return; }
+        *dst++ = (vertex_t){ .pos = msh_vec3(  f - 0.4, -2.0, 0.0 ), .width = line_width, .col = msh_vec4( 0, 0, 0, 1 ) };
+        *dst++ = (vertex_t){ .pos = msh_vec3(  f + 0.4,  2.0, 0.0 ), .width = line_width, .col = msh_vec4( 0, 0, 0, 1 ) };
+        *line_buf_len += 2;
+        line_width += 1.0;
+    }
+
+    int32_t circle_res = 32;
+    float d_theta = MSH_TWO_PI / circle_res;
+    float radius1 = 0.4f;
+    float radius2 = 2.0f;
+    float cx = 4.5;
+    float cy = 0.0;
+    line_width = 1.0;
+
+    for (int i = 0; i < circle_res; ++i)
+    {
+        if( *line_buf_len + 2 > line_buf_cap ) { return; }
+        float x1 = cx + radius1 * sin(i * d_theta);
+        float y1 = cy + radius1 * cos(i * d_theta);
+
+        float x2 = cx + radius2 * sin(i * d_theta);
+        float y2 = cy + radius2 * cos(i * d_theta);
+
+        *dst++ = (vertex_t){ .pos = msh_vec3(  x1, y1, 0.0 ), .width = line_width, .col = msh_vec4(0,0,0,1) };
+        *dst++ = (vertex_t){ .pos = msh_vec3(  x2, y2, 0.0 ), .width = line_width, .col = msh_vec4(0,0,0,1) };
+        *line_buf_len += 2;
+    }
+}
+
+uint32_t
+workload_vertex_count( const workload_desc_t* desc )
+{
+    // Demo scene has 16 parallel lines and 32 spokes.
+    if( !desc->n_segments ) { return 2 * (16 + 32); }
+    return 2 * desc->n_segments;
+}
+
+void
+workload_generate( const workload_desc_t* desc, vertex_t* line_buf, uint32_t* line_buf_len, uint32_t line_buf_cap )
+{
+    if( !desc->n_segments )
+    {
+        workload__generate_demo( line_buf, line_buf_len, line_buf_cap );
+        return;
+    }
+
+    msh_rand_ctx_t rand_gen;
+    msh_rand_init( &rand_gen, desc->seed );
+
+    // Segments are placed within a centered rectangle covering 'coverage' fraction of the screen area.
+    float side_scale = sqrtf( msh_clamp( desc->coverage, 1e-6f, 1.0f ) );
+    msh_vec2_t half_extent = msh_vec2_scalar_mul( desc->view_half_extent, side_scale );
+    float world_per_pixel = 2.0f * desc->view_half_extent.y / desc->viewport_size.y;
+    float depth = desc->is_3d ? half_extent.y : 0.0f;
+
+    uint32_t n_segments = msh_min( desc->n_segments, line_buf_cap / 2 );
+    vertex_t* dst = line_buf;
+    msh_vec3_t prev = msh_vec3( (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * half_extent.x,
+                                (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * half_extent.y,
+                                (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * depth );
+    float prev_width = workload__sample( &rand_gen, desc->width );
+    for( uint32_t i = 0; i < n_segments; ++i )
+    {
+        msh_vec3_t p = prev;
+        float width_p = prev_width;
+        if( !desc->polyline )
+        {
+            p = msh_vec3( (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * half_extent.x,
+                          (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * half_extent.y,
+                          (2.0f * msh_rand_nextf( &rand_gen ) - 1.0f) * depth );
+            width_p = workload__sample( &rand_gen, desc->width );
+        }
+
+        float length = workload__sample( &rand_gen, desc->length ) * world_per_pixel;
+        float theta = MSH_TWO_PI * msh_rand_nextf( &rand_gen );
+        float phi = desc->is_3d ? MSH_PI * (msh_rand_nextf( &rand_gen ) - 0.5f) : 0.0f;
+        msh_vec3_t q = msh_vec3( p.x + length * cosf( theta ) * cosf( phi ),
+                                 p.y + length * sinf( theta ) * cosf( phi ),
+                                 p.z + length * sinf( phi ) );
+
+        // Polylines wander around - reflect them back so they stay inside the covered region.
+        if( desc->polyline )
+        {
+            if( msh_abs( q.x ) > half_extent.x ) { q.x = 2.0f * p.x - q.x; }
+            if( msh_abs( q.y ) > half_extent.y ) { q.y = 2.0f * p.y - q.y; }
+            if( msh_abs( q.z ) > depth )         { q.z = 2.0f * p.z - q.z; }
+        }
+        float width_q = workload__sample( &rand_gen, desc->width );
+
+        msh_vec4_t col = msh_vec4( 0.6f * msh_rand_nextf( &rand_gen ),
+                                   0.6f * msh_rand_nextf( &rand_gen ),
+                                   0.6f * msh_rand_nextf( &rand_gen ), 1.0f );
+        *dst++ = (vertex_t){ .pos = p, .width = width_p, .col = col };
+        *dst++ = (vertex_t){ .pos = q, .width = width_q, .col = col };
+
+        prev = q;
+        prev_width = width_q;
+    }
+    *line_buf_len += 2 * n_segments;
+}
+
+// Toggles the window of 'n_dirty_segments' segments that starts at frame_idx * n_dirty_segments, wrapping around.
+// Returns the number of ranges written.
+static int32_t
+workload__toggle_window( const workload_desc_t* desc, vertex_t* line_buf, uint32_t n_segments, int64_t frame_idx,
+                         line_range_t* ranges )
+{
+    uint32_t n_window = msh_min( desc->n_dirty_segments, n_segments );
+    // Warm-up frames have negative indices.
+    int64_t window_idx = (frame_idx * n_window) % n_segments;
+    uint32_t first = (uint32_t)(window_idx < 0 ? window_idx + n_segments : window_idx);
+    for( uint32_t i = 0; i < n_window; ++i )
+    {
+        // Swapping the red and blue channels is exact, so toggling twice restores the original color.
+        vertex_t* v = line_buf + 2 * ((first + i) % n_segments);
+        for( int32_t j = 0; j < 2; ++j ) { v[j].col = msh_vec4( v[j].col.z, v[j].col.y, v[j].col.x, v[j].col.w ); }
+    }
+
+    uint32_t n_head = msh_min( n_window, n_segments - first );
+    ranges[0] = (line_range_t){ .first = 2 * first, .count = 2 * n_head };
+    if( n_head == n_window ) { return 1; }
+    ranges[1] = (line_range_t){ .first = 0, .count = 2 * (n_window - n_head) };
+    return 2;
+}
+
+// Changes the colors of a few segments of the data generated for a previous frame, the way a highlight following the
+// cursor would: the window of segments of the previous frame is toggled back, and the one of 'frame_idx' toggled on.
+// 'first_frame_idx' is the first frame perturbed since the data was generated; its previous frame toggled nothing.
+// The changed vertices are written to 'ranges' (WORKLOAD_MAX_DIRTY_RANGES of them at most), sorted and merged. Returns
+// the number of ranges.
+int32_t
+workload_perturb( const workload_desc_t* desc, vertex_t* line_buf, uint32_t line_buf_len, int64_t frame_idx,
+                  int64_t first_frame_idx, line_range_t* ranges )
+{
+    uint32_t n_segments = line_buf_len / 2;
+    if( !desc->n_dirty_segments || !n_segments ) { return 0; }
+    int32_t n_ranges = 0;
+    if( frame_idx > first_frame_idx )
+    {
+        n_ranges = workload__toggle_window( desc, line_buf, n_segments, frame_idx - 1, ranges );
+    }
+    n_ranges += workload__toggle_window( desc, line_buf, n_segments, frame_idx, ranges + n_ranges );
+    return line_ranges_merge( ranges, n_ranges );
+}
+
+#endif /*WORKLOAD_IMPLEMENTATION*/